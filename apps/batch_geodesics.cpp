@@ -0,0 +1,520 @@
+#include "regiodesics/AsyncIO.h"
+#include "regiodesics/algorithm.h"
+#include "regiodesics/util.h"
+#include "regiodesics/version.h"
+
+#include <boost/program_options.hpp>
+
+#include <omp.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+
+// A region of the atlas and the painted shell file giving its top and bottom
+// voxels. Several regions may share a shell file.
+struct RegionEntry
+{
+    long long label;
+    std::string shellFile;
+};
+
+struct BatchOptions
+{
+    size_t averageSize = 1000;
+    NearestVoxelMethod nearestMethod = NearestVoxelMethod::rtree;
+    FieldOptions fieldOptions;
+    size_t connectivity = 6;
+    std::string indexCache;
+    size_t threads = 1;
+    std::string outputDir = ".";
+    bool merge = false;
+    VolumeEncoding encoding = VolumeEncoding::raw;
+};
+
+// Atlas wide fields in which the fields of every region are written at its
+// voxels.
+struct MergedFields
+{
+    MergedFields(const StringMap& metadata, size_t width, size_t height,
+                 size_t depth);
+
+    Volume<float> relativeDistances;
+    Volume<Point4c> orientations;
+    Volume<float> heights;
+    Volume<float> distances;
+};
+
+// Runs tasks concurrently within a budget of threads. Each task is given a
+// number of threads for its OpenMP loops and starts as soon as that many
+// threads are free.
+class ThreadBudget
+{
+public:
+    explicit ThreadBudget(const size_t threads)
+        : _threads(threads)
+        , _available(threads)
+    {
+    }
+
+    ~ThreadBudget()
+    {
+        for (auto& task : _tasks)
+            task.wait();
+    }
+
+    void run(size_t threads, const std::function<void()>& task)
+    {
+        threads = std::max(size_t(1), std::min(threads, _threads));
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _freed.wait(lock, [&] { return _available >= threads; });
+            _available -= threads;
+        }
+        _tasks.push_back(std::async(std::launch::async, [this, threads,
+                                                         task] {
+            omp_set_num_threads(int(threads));
+            try
+            {
+                task();
+            }
+            catch (...)
+            {
+                _release(threads);
+                throw;
+            }
+            _release(threads);
+        }));
+    }
+
+    // Waits for all the tasks and rethrows the first error.
+    void wait()
+    {
+        for (auto& task : _tasks)
+            task.get();
+        _tasks.clear();
+    }
+
+private:
+    const size_t _threads;
+    size_t _available;
+    std::mutex _mutex;
+    std::condition_variable _freed;
+    std::vector<std::future<void>> _tasks;
+
+    void _release(const size_t threads)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _available += threads;
+        }
+        _freed.notify_all();
+    }
+};
+
+std::vector<RegionEntry> readRegionList(const std::string& filename);
+
+// The atlas is mapped read-only, it is not const only to be viewed.
+template <typename T>
+size_t processRegions(Volume<T>& atlas, const std::vector<RegionEntry>& entries,
+                      const BatchOptions& options);
+
+int main(int argc, char* argv[])
+{
+    BatchOptions batch;
+    batch.threads = omp_get_max_threads();
+    bool gzip = false;
+
+    namespace po = boost::program_options;
+    // clang-format off
+    po::options_description options("Options");
+    options.add_options()
+        ("help,h", "Produce help message.")
+        ("version,v", "Show program name/version banner and exit.")
+        ("average-size,a", po::value<size_t>(&batch.averageSize)->
+                               value_name("lines")->
+                               default_value(batch.averageSize),
+         "Size of k-nearest neighbour query of top to bottom lines used to"
+         " approximate the fields.")
+        ("nearest-method", po::value<NearestVoxelMethod>(&batch.nearestMethod)->
+                               value_name("rtree|transform")->
+                               default_value(batch.nearestMethod),
+         "Method used to find the closest opposite shell voxel of each shell"
+         " voxel: one R-tree query per voxel or a Euclidean feature transform"
+         " of the region.")
+        ("index-cache", po::value<std::string>(&batch.indexCache)->
+                            value_name("DIR"),
+         "Directory where the segment index of each region is cached, keyed"
+         " by the contents of its shell and the nearest method, so that other"
+         " runs on the same regions map it instead of building it again.")
+        ("coherent", po::bool_switch(&batch.fieldOptions.coherent),
+         "Traverse voxels brick by brick and bound each k-nearest neighbour"
+         " query with the result of the previous voxel.")
+        ("epsilon", po::value<float>(&batch.fieldOptions.epsilon)->
+                        default_value(batch.fieldOptions.epsilon),
+         "Use (1 + epsilon)-approximate k-nearest neighbour queries. 0 gives"
+         " exact queries.")
+        ("tolerance", po::value<float>(&batch.fieldOptions.tolerance)->
+                          default_value(batch.fieldOptions.tolerance),
+         "Evaluate the fields on a coarse lattice and interpolate them where"
+         " the interpolation error at a few sample voxels is below this"
+         " tolerance. 0 evaluates every voxel.")
+        ("connectivity", po::value<size_t>(&batch.connectivity)->
+                             value_name("6|18|26")->
+                             default_value(batch.connectivity),
+         "Neighbours of a voxel considered to find the boundary of a region.")
+        ("threads", po::value<size_t>(&batch.threads)->
+                        default_value(batch.threads),
+         "Threads shared by the regions. Each region is given a number of"
+         " threads proportional to its number of voxels, and small regions"
+         " are processed concurrently.")
+        ("output-dir,o", po::value<std::string>(&batch.outputDir)->
+                             default_value(batch.outputDir),
+         "Directory of the output files.")
+        ("merge", po::bool_switch(&batch.merge),
+         "Write the fields of all the regions in atlas wide relativeDistance,"
+         " orientation, height and distance files, instead of files of the"
+         " bounding box of each region prefixed with its label.")
+        ("gzip", po::bool_switch(&gzip),
+         "Save the outputs with gzip encoding, compressed in parallel.");
+
+    po::options_description hidden;
+    hidden.add_options()
+        ("atlas", po::value<std::string>()->required(), "Annotation volume");
+    hidden.add_options()
+        ("regions", po::value<std::string>()->required(), "Region list");
+    // clang-format on
+
+    po::options_description allOptions;
+    allOptions.add(hidden).add(options);
+
+    po::positional_options_description positional;
+    positional.add("atlas", 1);
+    positional.add("regions", 1);
+
+    po::variables_map vm;
+
+    auto parser = po::command_line_parser(argc, argv);
+    po::store(parser.options(allOptions).positional(positional).run(), vm);
+
+    if (vm.count("version"))
+    {
+        std::cout << "Brain region geodesics" << std::endl;
+        return 0;
+    }
+    if (vm.count("atlas") == 0 || vm.count("regions") == 0 ||
+        vm.count("help"))
+    {
+        std::cout << "Usage: " << argv[0] << " atlas regions [options]"
+                  << std::endl
+                  << std::endl
+                  << "Computes the relative distance, orientation, height"
+                     " and distance fields of\nseveral regions of an"
+                     " annotation volume loaded once. Each line of the"
+                     "\nregions file gives the label of a region and the"
+                     " shell file with its top\nand bottom voxels, as"
+                     " painted by layer_segmenter."
+                  << std::endl
+                  << options << std::endl;
+        return 0;
+    }
+
+    try
+    {
+        po::notify(vm);
+    }
+    catch (const po::error& e)
+    {
+        std::cerr << "Command line parse error: " << e.what() << std::endl
+                  << options << std::endl;
+        return -1;
+    }
+    if (batch.connectivity != 6 && batch.connectivity != 18 &&
+        batch.connectivity != 26)
+    {
+        std::cerr << "Invalid connectivity: " << batch.connectivity
+                  << std::endl;
+        return -1;
+    }
+    if (gzip)
+        batch.encoding = VolumeEncoding::gzip;
+    batch.threads = std::max(batch.threads, size_t(1));
+
+    const auto entries = readRegionList(vm["regions"].as<std::string>());
+    const size_t failures = visitLabelVolume(
+        vm["atlas"].as<std::string>(), [&entries, &batch](auto& atlas) {
+            return processRegions(atlas, entries, batch);
+        });
+    if (failures != 0)
+    {
+        std::cerr << failures << " regions failed" << std::endl;
+        return -1;
+    }
+}
+
+// Reads lines of "label shell-file", ignoring empty lines and comments
+// starting with #. A label may only appear once, since the regions are
+// processed concurrently and write the same output files or voxels.
+std::vector<RegionEntry> readRegionList(const std::string& filename)
+{
+    std::ifstream in(filename);
+    if (!in)
+        throw std::runtime_error("Could not open " + filename);
+    std::vector<RegionEntry> entries;
+    // Line of each label.
+    std::map<long long, size_t> lines;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number)
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        RegionEntry entry;
+        if (!(words >> entry.label))
+        {
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+            throw std::runtime_error("Invalid label at line " +
+                                     std::to_string(number) + " of " +
+                                     filename);
+        }
+        if (!(words >> entry.shellFile))
+            throw std::runtime_error("Missing shell file at line " +
+                                     std::to_string(number) + " of " +
+                                     filename);
+        const auto first = lines.emplace(entry.label, number);
+        if (!first.second)
+            throw std::runtime_error(
+                "Duplicate label " + std::to_string(entry.label) +
+                " at line " + std::to_string(number) + " of " + filename +
+                ", already at line " + std::to_string(first.first->second));
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+// Metadata of a volume of quaternions with the geometry of the atlas.
+StringMap quaternionMetadata(StringMap metadata)
+{
+    metadata["space directions"] = "none " + metadata["space directions"];
+    return metadata;
+}
+
+MergedFields::MergedFields(const StringMap& metadata, const size_t width,
+                           const size_t height, const size_t depth)
+    : relativeDistances(width, height, depth, metadata)
+    , orientations(width, height, depth, quaternionMetadata(metadata))
+    , heights(width, height, depth, metadata)
+    , distances(width, height, depth, metadata)
+{
+    relativeDistances.set(NAN);
+    orientations.metadata()["kinds"] = "quaternion domain domain domain";
+    orientations.set(nullQuaternion());
+    heights.set(NAN);
+    distances.set(NAN);
+}
+
+template <typename T>
+Volume<T> viewBox(Volume<T>& volume, const LabelBox& box)
+{
+    return volume.view(box.begin[0], box.begin[1], box.begin[2],
+                       box.end[0] - box.begin[0], box.end[1] - box.begin[1],
+                       box.end[2] - box.begin[2]);
+}
+
+// Returns the shell of a region within its bounding box. The boundary of the
+// region is found from the atlas and its top and bottom voxels are taken from
+// the painted shell.
+template <typename T>
+Volume<char> annotateRegionShell(Volume<T>& atlas, const T label,
+                                 const LabelBox& box, Volume<char>& painted,
+                                 const size_t connectivity)
+{
+    const Volume<T> labels = viewBox(atlas, box);
+    Volume<char> shell = annotateBoundaryVoxels(labels, connectivity, label);
+    const Volume<char> paintedBox = viewBox(painted, box);
+    size_t tops = 0;
+    size_t bottoms = 0;
+    shell.apply([&paintedBox, &tops, &bottoms](size_t x, size_t y, size_t z,
+                                               const char value) {
+        const char paint = paintedBox(x, y, z);
+        if (value == Void || (paint != Top && paint != Bottom))
+            return value;
+        ++(paint == Top ? tops : bottoms);
+        return paint;
+    });
+    if (tops == 0 || bottoms == 0)
+        throw std::runtime_error("No top or bottom voxels in the shell");
+    return shell;
+}
+
+// Copies the fields of the voxels of the region to the atlas wide fields.
+// The regions have no voxels in common, so they can be merged concurrently.
+template <typename T>
+void mergeRegionFields(Volume<T>& atlas, const T label,
+                       const LabelBox& box, const Volume<char>& shell,
+                       const Fields& fields, MergedFields& merged)
+{
+    const Volume<T> labels = viewBox(atlas, box);
+    Volume<float> relativeDistances = viewBox(merged.relativeDistances, box);
+    Volume<Point4c> orientations = viewBox(merged.orientations, box);
+    Volume<float> heights = viewBox(merged.heights, box);
+    Volume<float> distances = viewBox(merged.distances, box);
+    labels.visit([&](size_t x, size_t y, size_t z, const T value) {
+        if (value != label)
+            return;
+        relativeDistances(x, y, z) = fields.relativeDistances(x, y, z);
+        orientations(x, y, z) =
+            directionToQuaternion(fields.orientations(x, y, z), shell);
+        heights(x, y, z) = fields.heights(x, y, z);
+        distances(x, y, z) = fields.distances(x, y, z);
+    });
+}
+
+template <typename T>
+size_t processRegions(Volume<T>& atlas, const std::vector<RegionEntry>& entries,
+                      const BatchOptions& options)
+{
+    std::vector<T> labels;
+    for (const auto& entry : entries)
+    {
+        if (entry.label <= 0 || (long long)T(entry.label) != entry.label)
+            throw std::runtime_error("Invalid label for the atlas type: " +
+                                     std::to_string(entry.label));
+        labels.push_back(T(entry.label));
+    }
+    const auto boxes = computeLabelBoxes(atlas, labels);
+
+    // Each shell file is mapped once for all its regions.
+    std::map<std::string, std::unique_ptr<Volume<char>>> shells;
+    for (const auto& entry : entries)
+    {
+        auto& shell = shells[entry.shellFile];
+        if (shell)
+            continue;
+        shell.reset(new Volume<char>(entry.shellFile, VolumeLoading::map));
+        if (shell->dimensions() != atlas.dimensions())
+            throw std::runtime_error("The dimensions of " + entry.shellFile +
+                                     " differ from the atlas");
+    }
+
+    // The largest regions are started first and given threads in proportion
+    // to their number of voxels.
+    std::vector<const RegionEntry*> order;
+    size_t totalVoxels = 0;
+    for (const auto& entry : entries)
+    {
+        const auto box = boxes.find(T(entry.label));
+        if (box == boxes.end())
+        {
+            std::cerr << "Region " << entry.label << " not found in the atlas"
+                      << std::endl;
+            continue;
+        }
+        order.push_back(&entry);
+        totalVoxels += box->second.voxels;
+    }
+    std::sort(order.begin(), order.end(),
+              [&boxes](const RegionEntry* a, const RegionEntry* b) {
+                  return boxes.at(T(a->label)).voxels >
+                         boxes.at(T(b->label)).voxels;
+              });
+
+    std::unique_ptr<MergedFields> merged;
+    if (options.merge)
+        merged.reset(new MergedFields(atlas.metadata(), atlas.width(),
+                                      atlas.height(), atlas.depth()));
+
+    std::mutex mutex;
+    size_t failures = entries.size() - order.size();
+    ThreadBudget budget(options.threads);
+    for (const RegionEntry* entry : order)
+    {
+        const T label(entry->label);
+        const LabelBox& box = boxes.at(label);
+        const size_t threads =
+            (box.voxels * options.threads + totalVoxels - 1) / totalVoxels;
+        Volume<char>& painted = *shells.at(entry->shellFile);
+        budget.run(threads, [&, entry, label, threads] {
+            const auto start = std::chrono::steady_clock::now();
+            float evaluatedFraction = 0;
+            FieldOptions fieldOptions = options.fieldOptions;
+            fieldOptions.evaluatedFraction = &evaluatedFraction;
+            // The regions computed concurrently would mix their progress
+            // bars.
+            fieldOptions.progress = 0;
+            const auto prefix =
+                options.outputDir + "/" + std::to_string(entry->label) + "_";
+            try
+            {
+                const auto shell = annotateRegionShell(
+                    atlas, label, box, painted, options.connectivity);
+                const auto index = computeSegmentIndex(
+                    shell, options.nearestMethod, options.indexCache);
+                const auto fields = computeFields(shell, options.averageSize,
+                                                  &index, fieldOptions);
+                if (merged)
+                {
+                    mergeRegionFields(atlas, label, box, shell, fields,
+                                      *merged);
+                }
+                else
+                {
+                    const auto encoding = options.encoding;
+                    fields.relativeDistances.save(
+                        prefix + "relativeDistance.nrrd", encoding);
+                    toQuaternions(fields.orientations, shell)
+                        .save(prefix + "orientation.nrrd", encoding);
+                    fields.heights.save(prefix + "height.nrrd", encoding);
+                    fields.distances.save(prefix + "distance.nrrd",
+                                          encoding);
+                }
+            }
+            catch (const std::exception& e)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::cerr << "Region " << entry->label << " failed: "
+                          << e.what() << std::endl;
+                ++failures;
+                return;
+            }
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            std::lock_guard<std::mutex> lock(mutex);
+            std::cout << "Region " << entry->label << ": " << box.voxels
+                      << " voxels, " << threads << " threads, "
+                      << elapsed.count() << " s";
+            if (fieldOptions.tolerance > 0)
+                std::cout << ", evaluated " << evaluatedFraction * 100
+                          << "% of the shell voxels";
+            std::cout << std::endl;
+        });
+    }
+    budget.wait();
+
+    if (merged)
+    {
+        std::cout << "Saving" << std::endl;
+        // The outputs are independent files written concurrently.
+        const auto prefix = options.outputDir + "/";
+        const auto encoding = options.encoding;
+        AsyncWriter writer(4);
+        writer.submit([&] {
+            merged->relativeDistances.save(prefix + "relativeDistance.nrrd",
+                                           encoding);
+        });
+        writer.submit([&] {
+            merged->orientations.save(prefix + "orientation.nrrd", encoding);
+        });
+        writer.submit([&] {
+            merged->heights.save(prefix + "height.nrrd", encoding);
+        });
+        writer.submit([&] {
+            merged->distances.save(prefix + "distance.nrrd", encoding);
+        });
+        writer.wait();
+    }
+    return failures;
+}
@@ -7,6 +7,12 @@
 int main(int argc, char* argv[])
 {
     size_t averageSize = 1000;
+    NearestVoxelMethod nearestMethod = NearestVoxelMethod::rtree;
+    FieldOptions fieldOptions;
+    float evaluatedFraction = 0;
+    fieldOptions.evaluatedFraction = &evaluatedFraction;
+    bool gzip = false;
+    std::string indexCache;
 
     namespace po = boost::program_options;
     po::options_description options("Options");
@@ -20,8 +26,37 @@ int main(int argc, char* argv[])
         ("average-size,a", po::value<size_t>(&averageSize)->value_name("lines")->default_value(averageSize),
          "Size of k-nearest neighbour query of top to bottom lines used to"
          " approximate direction vectors.")
+        ("nearest-method", po::value<NearestVoxelMethod>(&nearestMethod)->
+                               value_name("rtree|transform")->
+                               default_value(nearestMethod),
+         "Method used to find the closest opposite shell voxel of each shell"
+         " voxel: one R-tree query per voxel or a Euclidean feature transform"
+         " of the whole volume.")
+        ("index-cache", po::value<std::string>(&indexCache)->
+                            value_name("DIR"),
+         "Directory where the segment index of the shell is cached, keyed by"
+         " the contents of the shell and the nearest method, so that other"
+         " runs on the same shell map it instead of building it again.")
+        ("coherent", po::bool_switch(&fieldOptions.coherent),
+         "Traverse voxels brick by brick and bound each k-nearest neighbour"
+         " query with the result of the previous voxel. Gives the same"
+         " results up to ties between equidistant lines.")
+        ("epsilon", po::value<float>(&fieldOptions.epsilon)->
+                        default_value(fieldOptions.epsilon),
+         "Use (1 + epsilon)-approximate k-nearest neighbour queries and report"
+         " the maximum deviation from the exact result on a sample of voxels."
+         " 0 gives exact queries.")
+        ("tolerance", po::value<float>(&fieldOptions.tolerance)->
+                          default_value(fieldOptions.tolerance),
+         "Evaluate the fields on a coarse lattice and interpolate them where"
+         " the interpolation error at a few sample voxels is below this"
+         " tolerance, refining elsewhere and near the shell boundary. Reports"
+         " the fraction of voxels evaluated exactly and the maximum deviation"
+         " on a sample of voxels. 0 evaluates every voxel.")
          ("output-path,o", po::value<std::string>()->default_value("direction_vectors.nrrd"),
-        "File path of the 3D unit vector field to save.");
+        "File path of the 3D unit vector field to save.")
+        ("gzip", po::bool_switch(&gzip),
+         "Save the output with gzip encoding, compressed in parallel.");
     // clang-format on
 
     po::variables_map vm;
@@ -65,13 +100,27 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    const Volume<char> shell(vm["shells"].as<std::string>());
+    const Volume<char> shell(vm["shells"].as<std::string>(),
+                             VolumeLoading::map);
 
     std::cout << "Computing direction vectors.\n";
-    const auto index = computeSegmentIndex(shell);
-    auto result = computeOrientationsAndHeights(shell, averageSize, &index);
+    const auto index = computeSegmentIndex(shell, nearestMethod, indexCache);
+    auto result = computeOrientationsAndHeights(shell, averageSize, &index,
+                                                fieldOptions);
     const auto& direction_vectors = std::get<0>(result);
+    if (fieldOptions.tolerance > 0)
+    {
+        std::cout << "Evaluated " << *fieldOptions.evaluatedFraction * 100
+                  << "% of the shell voxels" << std::endl;
+    }
+    if (fieldOptions.epsilon > 0 || fieldOptions.tolerance > 0)
+    {
+        std::cout << estimateFieldDeviation(shell, averageSize, index, 0,
+                                            &direction_vectors)
+                  << std::endl;
+    }
 
     std::cout << "Saving.\n";
-    direction_vectors.save(vm["output-path"].as<std::string>());
+    direction_vectors.save(vm["output-path"].as<std::string>(),
+                           gzip ? VolumeEncoding::gzip : VolumeEncoding::raw);
 }
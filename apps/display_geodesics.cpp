@@ -1,3 +1,4 @@
+#include "regiodesics/AsyncIO.h"
 #include "regiodesics/Bricks.h"
 #include "regiodesics/util.h"
 
@@ -11,10 +12,11 @@
 osg::Vec4 TopColor(1, 1, 0, 1);
 osg::Vec4 BottomColor(0, 0.5, 1, 1);
 
-using Point4c = PointTN<char, 4>;
-
-std::vector<Point3f> findIsosurfaceSamples(const Volume<float>& distances,
-                                           const float isovalue)
+// The voxels are traversed with z fastest and 8 corners per voxel, which
+// is cache friendly with BrickStorage but not with LinearStorage.
+template <typename Storage>
+std::vector<Point3f> findIsosurfaceSamples(
+    const Volume<float, Storage>& distances, const float isovalue)
 {
     std::vector<Point3f> points;
     const auto width = distances.width();
@@ -219,32 +221,54 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    Volume<char> shell(vm["shell"].as<std::string>());
-    Volume<Point4c> origOrientations(vm["orientations"].as<std::string>());
-    Volume<float> heights(vm["heights"].as<std::string>());
-    Volume<float> distances(vm["distances"].as<std::string>());
-    Volume<float> relatives(vm["relatives"].as<std::string>());
-    clearOutsideXRange(shell, cropX, '\0');
-    clearOutsideXRange(relatives, cropX, NAN);
-    clearOutsideXRange(heights, cropX, NAN);
-    clearOutsideYRange(shell, cropY, '\0');
-    clearOutsideYRange(heights, cropY, NAN);
-    clearOutsideYRange(relatives, cropY, NAN);
-    clearOutsideZRange(shell, cropZ, '\0');
-    clearOutsideZRange(heights, cropZ, NAN);
-    clearOutsideZRange(relatives, cropZ, NAN);
-
+    // The inputs are loaded concurrently. The volumes cleared outside the ROI
+    // are mapped copy-on-write.
+    const auto cow = VolumeLoading::mapPrivate;
+    auto loadingShell = loadVolumeAsync<char>(vm["shell"].as<std::string>(),
+                                              cow);
+    auto loadingOrientations = loadVolumeAsync<Point4c>(
+        vm["orientations"].as<std::string>(), VolumeLoading::map);
+    auto loadingHeights =
+        loadVolumeAsync<float>(vm["heights"].as<std::string>(), cow);
+    auto loadingDistances = loadVolumeAsync<float>(
+        vm["distances"].as<std::string>(), VolumeLoading::map);
+    auto loadingRelatives =
+        loadVolumeAsync<float>(vm["relatives"].as<std::string>(), cow);
+    // Only the membership of the voxels in the ROI is kept.
+    std::future<BitVolume> loadingRoi;
     if (vm.count("roi"))
     {
-        Volume<unsigned short> roi(vm["roi"].as<std::string>());
-        roi.visit([&shell, &relatives, &heights](size_t i, size_t j, size_t k,
-                                                 const unsigned short x) {
-            if (x == 0)
-            {
-                shell(i, j, k) = '\0';
-                relatives(i, j, k) = NAN;
-                heights(i, j, k) = NAN;
-            }
+        const auto path = vm["roi"].as<std::string>();
+        loadingRoi = std::async(std::launch::async, [=] {
+            Volume<unsigned short> roi(path, VolumeLoading::map);
+            return BitVolume(cropVolume(roi, cropX, cropY, cropZ));
+        });
+    }
+
+    // Only the crop box is displayed, the views share the loaded volumes.
+    const auto crop = [&cropX, &cropY, &cropZ](auto& volume) {
+        return cropVolume(volume, cropX, cropY, cropZ);
+    };
+    auto fullShell = loadingShell.get();
+    auto fullOrientations = loadingOrientations.get();
+    auto fullHeights = loadingHeights.get();
+    auto fullDistances = loadingDistances.get();
+    auto fullRelatives = loadingRelatives.get();
+    Volume<char> shell = crop(fullShell);
+    const Volume<Point4c> origOrientations = crop(fullOrientations);
+    Volume<float> heights = crop(fullHeights);
+    const Volume<float> distances = crop(fullDistances);
+    Volume<float> relatives = crop(fullRelatives);
+
+    if (loadingRoi.valid())
+    {
+        BitVolume outside = loadingRoi.get();
+        outside.invert();
+        outside.visit([&shell, &relatives, &heights](size_t i, size_t j,
+                                                     size_t k) {
+            shell(i, j, k) = '\0';
+            relatives(i, j, k) = NAN;
+            heights(i, j, k) = NAN;
         });
     }
 
@@ -252,15 +276,15 @@ int main(int argc, char* argv[])
 
     osg::Group* scene = new osg::Group();
 
-    const std::vector<Point3f> grid =
-        findIsosurfaceSamples(relatives, seedHeight);
+    const std::vector<Point3f> grid = findIsosurfaceSamples(
+        Volume<float, BrickStorage<>>(relatives), seedHeight);
     scene->addChild(
         createDistanceLines(grid, orientations, heights, distances));
 
     Bricks::ColorMap colors;
     colors[Top] = TopColor;
     colors[Bottom] = BottomColor;
-    Bricks bricks(shell, {Top, Bottom}, colors, true);
+    Bricks bricks(shell, {Top, Bottom}, colors, true, Bricks::Mesh::greedy);
     scene->addChild(bricks.node());
 
     osgViewer::Viewer viewer;
@@ -1,3 +1,4 @@
+#include "regiodesics/AsyncIO.h"
 #include "regiodesics/algorithm.h"
 #include "regiodesics/programs.h"
 #include "regiodesics/util.h"
@@ -6,18 +7,70 @@
 #include <boost/program_options.hpp>
 
 #include <iostream>
+#include <memory>
+
+// How the output fields are saved.
+struct OutputFormat
+{
+    // Regiodesics sparse format instead of NRRD.
+    bool sparse = false;
+    // Encoding of the NRRD files.
+    VolumeEncoding encoding = VolumeEncoding::raw;
+};
 
 void saveQuaternions(const Volume<Point3f>& direction_vectors,
-                     const Volume<char>& shell, const std::string& output_path);
+                     const Volume<char>& shell, const std::string& output_path,
+                     const OutputFormat& format);
+
+void saveQuaternions(const SparseVolume<Point3f>& direction_vectors,
+                     const Volume<char>& shell, const std::string& output_path,
+                     const OutputFormat& format);
+
+template <typename Field>
+void saveOrientations(const Field& direction_vectors,
+                      const Volume<char>& shell,
+                      const boost::program_options::variables_map& vm,
+                      const OutputFormat& format, AsyncWriter& writer);
+
+template <typename T>
+void saveField(const Volume<T>& field, const std::string& path,
+               const OutputFormat& format)
+{
+    field.save(path, format.encoding);
+}
+
+template <typename T>
+void saveField(const SparseVolume<T>& field, const std::string& path,
+               const OutputFormat& format)
+{
+    if (format.sparse)
+        field.saveSparse(path);
+    else
+        field.save(path, format.encoding);
+}
 
 void saveDistances(const Volume<float>& heights,
                    const Volume<float>& relative_distances,
                    const std::string& heights_path,
-                   const std::string& distances_path);
+                   const std::string& distances_path,
+                   const OutputFormat& format, AsyncWriter& writer);
+
+void streamFields(const Volume<char>& shell, size_t averageSize,
+                  const SegmentIndex& index, const FieldOptions& fieldOptions,
+                  const boost::program_options::variables_map& vm,
+                  size_t memoryBudget, const OutputFormat& format);
 
 int main(int argc, char* argv[])
 {
     size_t averageSize = 1000;
+    NearestVoxelMethod nearestMethod = NearestVoxelMethod::rtree;
+    FieldOptions fieldOptions;
+    float evaluatedFraction = 0;
+    fieldOptions.evaluatedFraction = &evaluatedFraction;
+    OutputFormat format;
+    bool gzip = false;
+    size_t memoryBudget = 0;
+    std::string indexCache;
 
     namespace po = boost::program_options;
     // clang-format off
@@ -28,6 +81,33 @@ int main(int argc, char* argv[])
         ("average-size,a", po::value<size_t>(&averageSize)->value_name("lines"),
          "Size of k-nearest neighbour query of top to bottom lines used to"
          " approximate direction vectors.")
+        ("nearest-method", po::value<NearestVoxelMethod>(&nearestMethod)->
+                               value_name("rtree|transform")->
+                               default_value(nearestMethod),
+         "Method used to find the closest opposite shell voxel of each shell"
+         " voxel: one R-tree query per voxel or a Euclidean feature transform"
+         " of the whole volume.")
+        ("index-cache", po::value<std::string>(&indexCache)->
+                            value_name("DIR"),
+         "Directory where the segment index of the shell is cached, keyed by"
+         " the contents of the shell and the nearest method, so that other"
+         " runs on the same shell map it instead of building it again.")
+        ("coherent", po::bool_switch(&fieldOptions.coherent),
+         "Traverse voxels brick by brick and bound each k-nearest neighbour"
+         " query with the result of the previous voxel. Gives the same"
+         " results up to ties between equidistant lines.")
+        ("epsilon", po::value<float>(&fieldOptions.epsilon)->
+                        default_value(fieldOptions.epsilon),
+         "Use (1 + epsilon)-approximate k-nearest neighbour queries and report"
+         " the maximum deviation from the exact result on a sample of voxels."
+         " 0 gives exact queries.")
+        ("tolerance", po::value<float>(&fieldOptions.tolerance)->
+                          default_value(fieldOptions.tolerance),
+         "Evaluate the fields on a coarse lattice and interpolate them where"
+         " the interpolation error at a few sample voxels is below this"
+         " tolerance, refining elsewhere and near the shell boundary. Reports"
+         " the fraction of voxels evaluated exactly and the maximum deviation"
+         " on a sample of voxels. 0 evaluates every voxel.")
          ("output-quaternions,q", po::value<std::string>(),
          "File path of the quaternionic orientation field to save."
          " If neither output-quaternions nor output-direction-vectors is specified,"
@@ -37,14 +117,31 @@ int main(int argc, char* argv[])
         ("output-distances,d", po::value<std::string>()->default_value("distance.nrrd"),
         "File path of the distance field to save.")
         ("output-heights", po::value<std::string>()->default_value("height.nrrd"),
-         "File path of the height field to save.");
+         "File path of the height field to save.")
+        ("output-relative-distances,r",
+         po::value<std::string>()->default_value("relativeDistance.nrrd"),
+         "File path of the relative distance field to save when it is computed"
+         " together with the other fields (no relative-distances argument).")
+        ("sparse-output", po::bool_switch(&format.sparse),
+         "Save the fields computed together (no relative-distances argument)"
+         " in the sparse format of Regiodesics, which only stores the voxels"
+         " of the shell, instead of NRRD.")
+        ("gzip", po::bool_switch(&gzip),
+         "Save the NRRD outputs with gzip encoding, compressed in parallel.")
+        ("memory-budget", po::value<size_t>(&memoryBudget)->value_name("MB"),
+         "Compute the fields computed together (no relative-distances"
+         " argument) slab by slab along z and write them directly to the"
+         " NRRD files, keeping the fields in memory within this budget. The"
+         " shell and the segment index come on top. The deviation of"
+         " approximate fields is not reported in this mode. With gzip, the"
+         " compressed outputs are kept in memory until the end.");
 
 
     po::options_description hidden;
     hidden.add_options()
         ("shell", po::value<std::string>()->required(), "Shell volume");
     hidden.add_options()
-        ("distances", po::value<std::string>()->required(), "Relative distance field");
+        ("distances", po::value<std::string>(), "Relative distance field");
     // clang-format on
 
     po::options_description allOptions;
@@ -64,11 +161,16 @@ int main(int argc, char* argv[])
         std::cout << "Brain region geodesics" << std::endl;
         return 0;
     }
-    if (vm.count("shell") == 0 || vm.count("distances") == 0 ||
-        vm.count("help"))
+    if (vm.count("shell") == 0 || vm.count("help"))
     {
         std::cout << "Usage: " << argv[0]
-                  << " shell relative-distances [options]" << std::endl
+                  << " shell [relative-distances] [options]" << std::endl
+                  << std::endl
+                  << "If relative-distances is not given, the relative"
+                     " distance field is computed\ntogether with the"
+                     " orientations and distances from a single k-nearest"
+                     "\nneighbour query per voxel."
+                  << std::endl
                   << options << std::endl;
         return 0;
     }
@@ -83,26 +185,94 @@ int main(int argc, char* argv[])
                   << options << std::endl;
         return -1;
     }
+    if (gzip)
+        format.encoding = VolumeEncoding::gzip;
 
-    const Volume<char> shell(vm["shell"].as<std::string>());
-    const Volume<float> relative_distances(vm["distances"].as<std::string>());
+    const Volume<char> shell(vm["shell"].as<std::string>(),
+                             VolumeLoading::map);
+    // The relative distances are loaded while the fields are computed.
+    std::future<Volume<float>> loadingDistances;
+    if (vm.count("distances"))
+        loadingDistances = loadVolumeAsync<float>(
+            vm["distances"].as<std::string>(), VolumeLoading::map);
+    const auto index = computeSegmentIndex(shell, nearestMethod, indexCache);
+
+    if (vm.count("distances") == 0 && memoryBudget != 0)
+    {
+        if (format.sparse)
+        {
+            std::cerr << "memory-budget and sparse-output are incompatible"
+                      << std::endl;
+            return -1;
+        }
+        streamFields(shell, averageSize, index, fieldOptions, vm,
+                     memoryBudget, format);
+        return 0;
+    }
+
+    if (vm.count("distances") == 0)
+    {
+        std::cout << "Computing relative distances, orientations and absolute"
+                     " distances"
+                  << std::endl;
+        // The fields are only stored for the voxels of the shell and
+        // expanded while saving to NRRD.
+        const auto fields =
+            computeSparseFields(shell, averageSize, &index, fieldOptions);
+        if (fieldOptions.tolerance > 0)
+        {
+            std::cout << "Evaluated " << *fieldOptions.evaluatedFraction * 100
+                      << "% of the shell voxels" << std::endl;
+        }
+        if (fieldOptions.epsilon > 0 || fieldOptions.tolerance > 0)
+        {
+            std::cout << estimateFieldDeviation(shell, averageSize, index,
+                                                &fields.relativeDistances,
+                                                &fields.orientations)
+                      << std::endl;
+        }
+        std::cout << "Saving" << std::endl;
+        // The outputs are independent files written concurrently.
+        AsyncWriter writer(4);
+        saveOrientations(fields.orientations, shell, vm, format, writer);
+        writer.submit([&] {
+            saveField(fields.relativeDistances,
+                      vm["output-relative-distances"].as<std::string>(),
+                      format);
+        });
+        writer.submit([&] {
+            saveField(fields.heights, vm["output-heights"].as<std::string>(),
+                      format);
+        });
+        writer.submit([&] {
+            saveField(fields.distances,
+                      vm["output-distances"].as<std::string>(), format);
+        });
+        writer.wait();
+        return 0;
+    }
 
-    const auto index = computeSegmentIndex(shell);
     std::cout << "Computing orientations and absolute distances" << std::endl;
-    auto result = computeOrientationsAndHeights(shell, averageSize, &index);
-    std::cout << "Saving" << std::endl;
+    auto result = computeOrientationsAndHeights(shell, averageSize, &index,
+                                                fieldOptions);
     const auto& direction_vectors = std::get<0>(result);
     auto& heights = std::get<1>(result);
+    if (fieldOptions.tolerance > 0)
+    {
+        std::cout << "Evaluated " << *fieldOptions.evaluatedFraction * 100
+                  << "% of the shell voxels" << std::endl;
+    }
+    if (fieldOptions.epsilon > 0 || fieldOptions.tolerance > 0)
+    {
+        std::cout << estimateFieldDeviation(shell, averageSize, index, 0,
+                                            &direction_vectors)
+                  << std::endl;
+    }
+    std::cout << "Saving" << std::endl;
 
-    if (vm.count("output-quaternions"))
-        saveQuaternions(direction_vectors, shell,
-                        vm["output-quaternions"].as<std::string>());
-    if (vm.count("output-direction-vectors"))
-        direction_vectors.save(
-            vm["output-direction-vectors"].as<std::string>());
-    if (!vm.count("output-quaternions") &&
-        !vm.count("output-direction-vectors"))
-        saveQuaternions(direction_vectors, shell, "orientation.nrrd");
+    // The orientations are written while the distances are computed.
+    AsyncWriter writer(4);
+    saveOrientations(direction_vectors, shell, vm, format, writer);
 
     // For correcting the distances from voxel space to volume space we take
     // into account that the volume is isotropic.
@@ -112,67 +282,78 @@ int main(int argc, char* argv[])
         return x * correction;
     });
 
+    const Volume<float> relative_distances = loadingDistances.get();
     saveDistances(heights, relative_distances,
-                  vm["output-distances"].as<std::string>(),
-                  vm["output-heights"].as<std::string>());
+                  vm["output-heights"].as<std::string>(),
+                  vm["output-distances"].as<std::string>(), format, writer);
+    writer.wait();
+}
+
+// Submits the orientation outputs to the writer. The direction vectors and
+// the shell must be kept until they are written.
+template <typename Field>
+void saveOrientations(const Field& direction_vectors,
+                      const Volume<char>& shell,
+                      const boost::program_options::variables_map& vm,
+                      const OutputFormat& format, AsyncWriter& writer)
+{
+    if (vm.count("output-quaternions"))
+    {
+        const auto path = vm["output-quaternions"].as<std::string>();
+        writer.submit([&direction_vectors, &shell, path, format] {
+            saveQuaternions(direction_vectors, shell, path, format);
+        });
+    }
+    if (vm.count("output-direction-vectors"))
+    {
+        const auto path = vm["output-direction-vectors"].as<std::string>();
+        writer.submit([&direction_vectors, path, format] {
+            saveField(direction_vectors, path, format);
+        });
+    }
+    if (!vm.count("output-quaternions") &&
+        !vm.count("output-direction-vectors"))
+    {
+        writer.submit([&direction_vectors, &shell, format] {
+            saveQuaternions(direction_vectors, shell, "orientation.nrrd",
+                            format);
+        });
+    }
 }
 
 void saveQuaternions(const Volume<Point3f>& direction_vectors,
-                     const Volume<char>& shell, const std::string& output_path)
+                     const Volume<char>& shell, const std::string& output_path,
+                     const OutputFormat& format)
 {
-    using Point4c = PointTN<char, 4>;
-    Volume<Point4c> output(direction_vectors.width(),
-                           direction_vectors.height(),
-                           direction_vectors.depth(),
-                           direction_vectors.metadata());
-    // Overriding the original metadata to provide what the consumer tools
-    // expect
+    toQuaternions(direction_vectors, shell).save(output_path, format.encoding);
+}
+
+void saveQuaternions(const SparseVolume<Point3f>& direction_vectors,
+                     const Volume<char>& shell, const std::string& output_path,
+                     const OutputFormat& format)
+{
+    // The void voxels are not active and saved as null quaternions.
+    SparseVolume<Point4c> output(direction_vectors, nullQuaternion(),
+                                 direction_vectors.metadata());
     auto& metadata = output.metadata();
     metadata["kinds"] = "quaternion domain domain domain";
 
     output.apply([&direction_vectors, &shell](size_t i, size_t j, size_t k,
                                               const Point4c&) {
-        Point4c p;
-        if (shell(i, j, k) == 0)
-        {
-            p.set<0>(0);
-            p.set<1>(0);
-            p.set<2>(0);
-            p.set<3>(0);
-        }
-        else
-        {
-            // This code ignores the possible mirrorings being applied by
-            // by the NRRD space directions
-            auto orientation = direction_vectors(i, j, k);
-            const auto vx = direction_vectors.volumeAxis(0);
-            const auto vy = direction_vectors.volumeAxis(1);
-            const auto vz = direction_vectors.volumeAxis(2);
-            orientation = vx * orientation.get<0>() +
-                          vy * orientation.get<1>() + vz * orientation.get<2>();
-            osg::Vec3 v(orientation.get<0>(), orientation.get<1>(),
-                        orientation.get<2>());
-            v.normalize();
-
-            osg::Vec3 up(0, 1, 0);
-            osg::Quat q(std::acos(up * v), up ^ v);
-            q /= q.length();
-            // According to nrrd specs a quaternion is w x y z
-            p.set<0>(static_cast<int8_t>(std::round(q[3] * 127)));
-            p.set<1>(static_cast<int8_t>(std::round(q[0] * 127)));
-            p.set<2>(static_cast<int8_t>(std::round(q[1] * 127)));
-            p.set<3>(static_cast<int8_t>(std::round(q[2] * 127)));
-        }
-        return p;
+        return directionToQuaternion(direction_vectors(i, j, k), shell);
     });
-    output.save(output_path);
+    saveField(output, output_path, format);
 }
 
 void saveDistances(const Volume<float>& heights,
                    const Volume<float>& relative_distances,
                    const std::string& heights_path,
-                   const std::string& distances_path)
+                   const std::string& distances_path,
+                   const OutputFormat& format, AsyncWriter& writer)
 {
+    writer.submit([&heights, heights_path, format] {
+        heights.save(heights_path, format.encoding);
+    });
     Volume<float> output(heights.width(), heights.height(), heights.depth(),
                          heights.metadata());
     output.apply([&heights, &relative_distances](size_t i, size_t j, size_t k,
@@ -181,6 +362,75 @@ void saveDistances(const Volume<float>& heights,
             return NAN;
         return heights(i, j, k) * relative_distances(i, j, k);
     });
-    heights.save(heights_path);
-    output.save(distances_path);
+    writer.save(std::move(output), distances_path, format.encoding);
+}
+
+void streamFields(const Volume<char>& shell, const size_t averageSize,
+                  const SegmentIndex& index, const FieldOptions& fieldOptions,
+                  const boost::program_options::variables_map& vm,
+                  const size_t memoryBudget, const OutputFormat& format)
+{
+    const size_t depth = shell.depth();
+    const auto encoding = format.encoding;
+    std::unique_ptr<VolumeWriter<Point4c>> quaternions;
+    std::unique_ptr<VolumeWriter<Point3f>> directions;
+    if (vm.count("output-quaternions"))
+        quaternions.reset(new VolumeWriter<Point4c>(
+            vm["output-quaternions"].as<std::string>(), depth, encoding));
+    if (vm.count("output-direction-vectors"))
+        directions.reset(new VolumeWriter<Point3f>(
+            vm["output-direction-vectors"].as<std::string>(), depth,
+            encoding));
+    if (!quaternions && !directions)
+        quaternions.reset(
+            new VolumeWriter<Point4c>("orientation.nrrd", depth, encoding));
+    VolumeWriter<float> relativeDistances(
+        vm["output-relative-distances"].as<std::string>(), depth, encoding);
+    VolumeWriter<float> heights(vm["output-heights"].as<std::string>(), depth,
+                                encoding);
+    VolumeWriter<float> distances(vm["output-distances"].as<std::string>(),
+                                  depth, encoding);
+
+    // The fields and the quaternions of two slabs: one is written in the
+    // background while the next one is computed.
+    const size_t bytesPerVoxel =
+        2 * (24 + (quaternions ? sizeof(Point4c) : 0));
+    const size_t slabDepth =
+        fieldSlabDepth(shell, bytesPerVoxel, memoryBudget << 20);
+    const size_t slabs = (depth + slabDepth - 1) / slabDepth;
+
+    std::cout << "Computing relative distances, orientations and absolute"
+                 " distances in "
+              << slabs << " slabs of " << slabDepth << " planes" << std::endl;
+    AsyncWriter writer(1, 1);
+    computeFieldSlabs(
+        shell, averageSize, slabDepth,
+        [&](Fields& fields, const size_t z) {
+            auto slab = std::make_shared<Fields>(std::move(fields));
+            writer.submit([&, slab, z] {
+                if (quaternions)
+                    quaternions->write(
+                        toQuaternions(slab->orientations, shell, z));
+                if (directions)
+                    directions->write(slab->orientations);
+                relativeDistances.write(slab->relativeDistances);
+                heights.write(slab->heights);
+                distances.write(slab->distances);
+            });
+        },
+        &index, fieldOptions);
+    writer.wait();
+    if (fieldOptions.tolerance > 0)
+    {
+        std::cout << "Evaluated " << *fieldOptions.evaluatedFraction * 100
+                  << "% of the shell voxels" << std::endl;
+    }
+
+    if (quaternions)
+        quaternions->close();
+    if (directions)
+        directions->close();
+    relativeDistances.close();
+    heights.close();
+    distances.close();
 }
@@ -0,0 +1,272 @@
+#include "regiodesics/algorithm.h"
+#include "regiodesics/version.h"
+#include <boost/program_options.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+namespace
+{
+double _seconds(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+std::vector<float> _sortedDistances(const SegmentRecords& records,
+                                    const Point3f& point)
+{
+    std::vector<float> distances;
+    for (const auto& record : records)
+        distances.push_back(squaredDistance(record, point));
+    std::sort(distances.begin(), distances.end());
+    return distances;
+}
+
+// Segments at the same distance may be returned in a different order and
+// their distances differ by rounding errors.
+bool _sameDistances(const std::vector<float>& a, const std::vector<float>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i != a.size(); ++i)
+    {
+        if (std::abs(a[i] - b[i]) > 1e-4f * std::max(1.f, b[i]))
+            return false;
+    }
+    return true;
+}
+
+bool _tied(const std::vector<float>& distances, const size_t i)
+{
+    return distances[i + 1] - distances[i] <=
+           1e-4f * std::max(1.f, distances[i + 1]);
+}
+
+// Returns true if the two nearest segments of the point or its k-th and
+// (k + 1)-th nearest ones are equidistant, in which case the fields at this
+// point depend on the order of the segments in the index.
+bool _ambiguous(const SegmentIndex& index, const Point3f& point,
+                const size_t k)
+{
+    SegmentRecords nearest;
+    index.nearest(point, k + 1, nearest);
+    const auto distances = _sortedDistances(nearest, point);
+    return (distances.size() > 1 && _tied(distances, 0)) ||
+           (distances.size() > k && _tied(distances, k - 1));
+}
+
+// Applies random edits of the top and bottom voxels of the shell, checking
+// after each batch that the fields of IncrementalSegmentation::update are
+// those of a full computation with its index, except at ambiguous voxels.
+// Returns the number of mismatching voxels.
+size_t _checkUpdates(const Volume<char>& original, const size_t setSize,
+                     const size_t updates, const size_t edits)
+{
+    Volume<char> shell = original.copy();
+    std::vector<Coords> voxels;
+    size_t counts[] = {0, 0};
+    shell.visit([&](size_t x, size_t y, size_t z, const char& value) {
+        if (value == Void)
+            return;
+        voxels.push_back(Coords(x, y, z));
+        counts[0] += value == Top;
+        counts[1] += value == Bottom;
+    });
+
+    const LayerClassifier classifier({0.5f});
+    auto start = std::chrono::steady_clock::now();
+    IncrementalSegmentation segmentation(shell, setSize, classifier);
+    std::cout << "IncrementalSegmentation build: " << _seconds(start) << " s"
+              << std::endl;
+
+    std::mt19937 random(0);
+    size_t mismatches = 0;
+    for (size_t update = 0; update != updates; ++update)
+    {
+        // The shell voxels become top or bottom voxels and the top and
+        // bottom voxels shell voxels, keeping at least one of each.
+        for (size_t i = 0; i != edits; ++i)
+        {
+            const Coords& voxel = voxels[random() % voxels.size()];
+            char& value = shell(voxel);
+            if (value == Top || value == Bottom)
+            {
+                size_t& count = counts[value == Top ? 0 : 1];
+                if (count == 1)
+                    continue;
+                --count;
+                value = Shell;
+            }
+            else
+            {
+                value = random() % 2 ? Top : Bottom;
+                ++counts[value == Top ? 0 : 1];
+            }
+            segmentation.markChanged(voxel.get<0>(), voxel.get<1>(),
+                                     voxel.get<2>());
+        }
+
+        start = std::chrono::steady_clock::now();
+        const size_t recomputed = segmentation.update();
+        const double seconds = _seconds(start);
+        const auto reference =
+            computeRelativeDistancesAndLayers(shell, setSize, classifier,
+                                              &segmentation.index());
+        const Volume<float>& expected = std::get<0>(reference);
+        const Volume<float>& distances = segmentation.relativeDistances();
+        size_t wrong = 0;
+        size_t ties = 0;
+        shell.visit([&](size_t x, size_t y, size_t z, const char&) {
+            const float a = distances(x, y, z);
+            const float b = expected(x, y, z);
+            if (std::isnan(a) == std::isnan(b) && !(std::abs(a - b) > 1e-4f))
+                return;
+            if (_ambiguous(segmentation.index(), Point3f(x, y, z), setSize))
+                ++ties;
+            else
+                ++wrong;
+        });
+        std::cout << "Update " << update << ": "
+                  << segmentation.changedSegments() << " segments, "
+                  << recomputed << " voxels, " << seconds << " s, " << wrong
+                  << " mismatching voxels, " << ties << " ties" << std::endl;
+        mismatches += wrong;
+    }
+    return mismatches;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    size_t averageSize = 1000;
+    size_t stride = 7;
+    size_t updates = 0;
+    size_t edits = 10;
+    NearestVoxelMethod nearestMethod = NearestVoxelMethod::rtree;
+
+    namespace po = boost::program_options;
+    po::options_description options("Options");
+    // clang-format off
+    options.add_options()
+        ("help,h", "Produce this help message.")
+        ("version,v", "Show program description and exit.")
+        ("shells,s", po::value<std::string>()->required(), "Shells volume, that is, a 3D array"
+        " of type char (int8), where bottom voxels are labeled with 3 and top voxels are labeled"
+        " with 4.")
+        ("average-size,a", po::value<size_t>(&averageSize)->value_name("lines")->default_value(averageSize),
+         "Size of the k-nearest neighbour queries.")
+        ("stride", po::value<size_t>(&stride)->default_value(stride),
+         "Query one out of every `stride` non empty voxels of the shell.")
+        ("nearest-method", po::value<NearestVoxelMethod>(&nearestMethod)->
+                               value_name("rtree|transform")->
+                               default_value(nearestMethod),
+         "Method used to find the closest opposite shell voxel of each shell"
+         " voxel.")
+        ("updates", po::value<size_t>(&updates)->default_value(updates),
+         "Number of random batches of top and bottom voxel edits after which"
+         " the fields of the incremental segmentation are checked against a"
+         " full computation.")
+        ("edits", po::value<size_t>(&edits)->default_value(edits),
+         "Number of voxels edited in each batch of --updates.");
+    // clang-format on
+
+    po::variables_map vm;
+
+    auto parser = po::command_line_parser(argc, argv);
+    po::store(parser.options(options).run(), vm);
+
+    if (vm.count("version"))
+    {
+        std::cout << "index_benchmark (Regiodesics "
+                  << regiodesics::Version::getString() << ")" << std::endl;
+    }
+    if (vm.count("shells") == 0 || vm.count("help"))
+    {
+        // clang-format off
+        std::cout << "Compare the segment index with a Boost R-tree.\n\n"
+            "Builds both indices from the segments joining the bottom and top\n"
+            "shells and times the k-nearest segment queries of a sample of\n"
+            "shell voxels, checking that both return the same distances.\n"
+            "Optionally checks the incremental updates of the fields after\n"
+            "random edits of the shell.\n\n"
+            "Usage: " << argv[0] << " --shells SHELLS [options]\n\n";
+        std::cout << options << std::endl;
+        return 0;
+        // clang-format on
+    }
+
+    try
+    {
+        po::notify(vm);
+    }
+    catch (const po::error& e)
+    {
+        std::cerr << "Command line parse error: " << e.what() << std::endl
+                  << options << std::endl;
+        return -1;
+    }
+    if (stride == 0)
+    {
+        std::cerr << "stride must be positive" << std::endl;
+        return -1;
+    }
+
+    const Volume<char> shell(vm["shells"].as<std::string>(),
+                             VolumeLoading::map);
+    const auto records = computeSegmentRecords(shell, nearestMethod);
+    std::cout << records.size() << " segments" << std::endl;
+
+    std::vector<Point3f> points;
+    size_t count = 0;
+    shell.visit([&](size_t x, size_t y, size_t z, const char& v) {
+        if (v != 0 && count++ % stride == 0)
+            points.push_back(Point3f(x, y, z));
+    });
+    std::cout << points.size() << " queries with k = " << averageSize
+              << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    const SegmentIndex index(records);
+    std::cout << "SegmentIndex build: " << _seconds(start) << " s" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    const SegmentRTree rtree(records.begin(), records.end());
+    std::cout << "Boost R-tree build: " << _seconds(start) << " s" << std::endl;
+
+    std::vector<SegmentRecords> results(points.size());
+    start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < points.size(); ++i)
+        index.nearest(points[i], averageSize, results[i]);
+    std::cout << "SegmentIndex queries: " << _seconds(start) << " s"
+              << std::endl;
+
+    std::vector<SegmentRecords> reference(points.size());
+    start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < points.size(); ++i)
+        rtree.query(boost::geometry::index::nearest(points[i], averageSize),
+                    std::back_inserter(reference[i]));
+    std::cout << "Boost R-tree queries: " << _seconds(start) << " s"
+              << std::endl;
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        if (!_sameDistances(_sortedDistances(results[i], points[i]),
+                            _sortedDistances(reference[i], points[i])))
+        {
+            ++mismatches;
+        }
+    }
+    std::cout << mismatches << " mismatching queries" << std::endl;
+
+    size_t wrongVoxels = 0;
+    if (updates != 0)
+        wrongVoxels = _checkUpdates(shell, averageSize, updates, edits);
+    return mismatches == 0 && wrongVoxels == 0 ? 0 : 1;
+}
@@ -5,12 +5,18 @@
 #include "regiodesics/util.h"
 #include "regiodesics/version.h"
 
+#include <osg/NodeCallback>
 #include <osgGA/GUIEventAdapter>
 #include <osgViewer/Renderer>
 #include <osgViewer/Viewer>
 #include <osgViewer/ViewerEventHandlers>
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include <boost/program_options.hpp>
 #include <boost/progress.hpp>
@@ -24,9 +30,16 @@ osg::Vec4 BottomColor(0, 0.5, 1, 1);
 class Painter : public osgGA::GUIEventHandler
 {
 public:
-    typedef boost::signals2::signal<void()> DoneSignal;
+    typedef boost::signals2::signal<void()> KeySignal;
+    typedef boost::signals2::signal<void(size_t, size_t, size_t, char)>
+        PaintSignal;
 
-    DoneSignal done;
+    // Enter, s and l keys.
+    KeySignal done;
+    KeySignal save;
+    KeySignal toggleLayers;
+    // Voxels whose label is changed by the brush, with their new label.
+    PaintSignal painted;
 
     class PostDrawCallback : public osg::Camera::DrawCallback
     {
@@ -80,6 +93,7 @@ public:
                     size_t x = coords[0] - 1;
                     size_t y = coords[1] - 1;
                     size_t z = coords[2] - 1;
+                    const char value = volume(x, y, z);
                     switch (_painter->_state)
                     {
                     case State::paintTop:
@@ -96,6 +110,8 @@ public:
                         break;
                     default:;
                     }
+                    if (volume(x, y, z) != value)
+                        _painter->painted(x, y, z, volume(x, y, z));
                 }
             }
         }
@@ -120,9 +136,6 @@ public:
                         osgGA::GUIActionAdapter& aa, osg::Object*,
                         osg::NodeVisitor*)
     {
-        if (_state == State::done)
-            return false;
-
         switch (ea.getEventType())
         {
         case osgGA::GUIEventAdapter::PUSH:
@@ -157,14 +170,17 @@ public:
         case osgGA::GUIEventAdapter::KEYDOWN:
             if (ea.getKey() == osgGA::GUIEventAdapter::KEY_Return)
             {
-                _state = State::done;
                 done();
                 return true;
             }
             else if (ea.getKey() == 's')
             {
-                std::cout << "Saving shell volume" << std::endl;
-                _volume.save("shell.nrrd");
+                save();
+                return true;
+            }
+            else if (ea.getKey() == 'l')
+            {
+                toggleLayers();
                 return true;
             }
             else if (ea.getKey() == '+')
@@ -201,8 +217,7 @@ private:
         off,
         erase,
         paintTop,
-        paintBottom,
-        done
+        paintBottom
     };
 
     Volume<char>& _volume;
@@ -216,46 +231,289 @@ private:
 
 typedef std::map<std::string, std::string> PathMap;
 Volume<char> segment(Volume<char>& shell, const size_t averageSize,
+                     const NearestVoxelMethod nearestMethod,
+                     const FieldOptions& fieldOptions,
                      const std::vector<float>& splitPoints, const bool bottomUp,
-                     const PathMap& output_paths)
+                     const PathMap& output_paths,
+                     const std::string& indexCache)
 {
-    std::cout << "Computing relative distances" << std::endl;
-    auto distances = computeRelativeDistanceField(shell, averageSize);
-    distances.save(output_paths.at("output-relative-distances"));
-
-    std::cout << "Annotating layers" << std::endl;
-    if (bottomUp)
+    std::cout << "Computing relative distances and layers" << std::endl;
+    const auto index = computeSegmentIndex(shell, nearestMethod, indexCache);
+    auto result = computeRelativeDistancesAndLayers(
+        shell, averageSize, LayerClassifier(splitPoints, bottomUp), &index,
+        fieldOptions);
+    const auto& distances = std::get<0>(result);
+    auto& layers = std::get<1>(result);
+    if (fieldOptions.tolerance > 0)
+    {
+        std::cout << "Evaluated " << *fieldOptions.evaluatedFraction * 100
+                  << "% of the shell voxels" << std::endl;
+    }
+    if (fieldOptions.epsilon > 0 || fieldOptions.tolerance > 0)
     {
-        /* We achieve this by modifying the distance field to be 1 - d */
-        shell.apply(
-            [](size_t, size_t, size_t, float value) { return 1 - value; });
+        std::cout << estimateFieldDeviation(shell, averageSize, index,
+                                            &distances, 0)
+                  << std::endl;
     }
-    auto layers = annotateLayers(distances, splitPoints);
+    distances.save(output_paths.at("output-relative-distances"));
     layers.save(output_paths.at("output-layers"));
 
-    return layers;
+    return std::move(layers);
 }
 
-Volume<unsigned int> loadVolume(const std::string& filename)
+osg::ref_ptr<osg::Node> createLayersNode(const Volume<char>& layers)
 {
-    try
+    Bricks::ColorMap layerColors;
+    layerColors[1] = osg::Vec4(1.0, 0, 0, 1);
+    layerColors[2] = osg::Vec4(1.0, 0.5, 0, 1);
+    layerColors[3] = osg::Vec4(1.0, 1.0, 0, 1);
+    layerColors[4] = osg::Vec4(0.5, 1.0, 0.5, 1);
+    layerColors[5] = osg::Vec4(0, 1.0, 1.0, 1);
+    layerColors[6] = osg::Vec4(0, 0.5, 0.5, 1);
+    // The layers are not painted, only their visible faces are meshed.
+    Bricks layerBricks(layers, {1, 2, 3, 4, 5, 6}, layerColors, false,
+                       Bricks::Mesh::greedy);
+    return layerBricks.node();
+}
+
+struct SegmentationSettings
+{
+    size_t averageSize;
+    NearestVoxelMethod nearestMethod;
+    FieldOptions fieldOptions;
+    std::vector<float> splitPoints;
+    bool bottomUp;
+    PathMap outputPaths;
+    std::string indexCache;
+};
+
+// Saves and segments the painted shell in a background thread, so that the
+// viewer stays responsive. The thread works on its own copy of the shell, to
+// which the painted voxels are applied when a task starts, and a running
+// segmentation is cancelled as soon as voxels are painted. With exact queries
+// the segmentations after the first one are incremental.
+class SegmentationWorker
+{
+public:
+    // The crop ranges give the shell segmented within the full one.
+    SegmentationWorker(const Volume<char>& fullShell,
+                       const std::pair<size_t, size_t>& cropX,
+                       const std::pair<size_t, size_t>& cropY,
+                       const std::pair<size_t, size_t>& cropZ,
+                       const SegmentationSettings& settings)
+        : _fullShell(fullShell.copy())
+        , _shell(cropVolume(_fullShell, cropX, cropY, cropZ))
+        , _settings(settings)
     {
-        return Volume<unsigned int>(filename);
+        _settings.fieldOptions.cancel = &_cancel;
+        _settings.fieldOptions.completion = &_completion;
+        _thread = std::thread([this] { _run(); });
     }
-    catch (std::runtime_error&)
+
+    ~SegmentationWorker()
     {
-        // Try converting the volume from unsigned short into int
-        Volume<unsigned short> in(filename);
-        size_t width, height, depth;
-        std::tie(width, height, depth) = in.dimensions();
-        Volume<unsigned int> out(width, height, depth, in.metadata());
-        for (size_t x = 0; x < width; ++x)
-            for (size_t y = 0; y < height; ++y)
-                for (size_t z = 0; z < depth; ++z)
-                    out(x, y, z) = in(x, y, z);
-        return out;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _cancel = true;
+        _wake.notify_all();
+        _thread.join();
+    }
+
+    // Records the new value of a voxel of the cropped shell. May be called
+    // from any thread.
+    void paint(const size_t x, const size_t y, const size_t z,
+               const char value)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _edits.push_back(Edit{x, y, z, value});
+        if (_running == Task::segment)
+            _cancel = true;
+    }
+
+    // Saves the full shell to shell.nrrd and segments the cropped one.
+    void segment() { _request(Task::segment); }
+    // Saves the full shell to shell.nrrd.
+    void saveShell() { _request(Task::save); }
+
+    // Returns the layers of the segmentation finished since the last call,
+    // null if none.
+    osg::ref_ptr<osg::Node> takeLayers()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        osg::ref_ptr<osg::Node> layers = _layers;
+        _layers = nullptr;
+        return layers;
+    }
+
+    // Returns the running task and its progress, empty if idle.
+    std::string status() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        switch (_running)
+        {
+        case Task::save:
+            return "saving the shell";
+        case Task::segment:
+            return "segmenting " +
+                   std::to_string(int(_completion * 100)) + "%";
+        default:
+            return std::string();
+        }
+    }
+
+private:
+    // In increasing order of work, a segmentation also saving the shell.
+    enum class Task
+    {
+        none,
+        save,
+        segment
+    };
+
+    struct Edit
+    {
+        size_t x;
+        size_t y;
+        size_t z;
+        char value;
+    };
+
+    Volume<char> _fullShell;
+    Volume<char> _shell;
+    SegmentationSettings _settings;
+    std::unique_ptr<IncrementalSegmentation> _segmentation;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _wake;
+    std::vector<Edit> _edits;
+    Task _requested = Task::none;
+    Task _running = Task::none;
+    bool _stopping = false;
+    std::atomic<bool> _cancel{false};
+    std::atomic<float> _completion{0};
+    osg::ref_ptr<osg::Node> _layers;
+    std::thread _thread;
+
+    void _request(const Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _requested = std::max(_requested, task);
+        }
+        _wake.notify_all();
+    }
+
+    void _run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _wake.wait(lock, [this] {
+                return _stopping || _requested != Task::none;
+            });
+            if (_stopping)
+                return;
+            std::vector<Edit> edits;
+            edits.swap(_edits);
+            _running = _requested;
+            _requested = Task::none;
+            _cancel = false;
+            _completion = 0;
+            lock.unlock();
+
+            for (const auto& edit : edits)
+            {
+                _shell(edit.x, edit.y, edit.z) = edit.value;
+                if (_segmentation)
+                    _segmentation->markChanged(edit.x, edit.y, edit.z);
+            }
+            osg::ref_ptr<osg::Node> layers;
+            try
+            {
+                std::cout << "Saving shell volume" << std::endl;
+                _fullShell.save("shell.nrrd");
+                if (_running == Task::segment)
+                    layers = _segment();
+            }
+            catch (const Cancelled&)
+            {
+                std::cout << "Segmentation cancelled by new edits, press"
+                             " Enter to restart it"
+                          << std::endl;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << std::endl;
+            }
+
+            lock.lock();
+            if (layers)
+                _layers = layers;
+            _running = Task::none;
+        }
+    }
+
+    osg::ref_ptr<osg::Node> _segment()
+    {
+        const auto& settings = _settings;
+        const auto& options = settings.fieldOptions;
+        const auto& paths = settings.outputPaths;
+        if (options.epsilon != 0 || options.tolerance != 0)
+        {
+            return createLayersNode(
+                ::segment(_shell, settings.averageSize,
+                          settings.nearestMethod, options,
+                          settings.splitPoints, settings.bottomUp, paths,
+                          settings.indexCache));
+        }
+
+        if (!_segmentation)
+        {
+            std::cout << "Computing relative distances and layers"
+                      << std::endl;
+            // The first segments are found with the nearest method or taken
+            // from the cache, the updates query the R-trees of the voxels.
+            const auto index = computeSegmentIndex(
+                _shell, settings.nearestMethod, settings.indexCache);
+            _segmentation.reset(new IncrementalSegmentation(
+                _shell, settings.averageSize,
+                LayerClassifier(settings.splitPoints, settings.bottomUp),
+                &index, options));
+        }
+        else
+        {
+            const size_t voxels = _segmentation->update();
+            std::cout << "Updated " << _segmentation->changedSegments()
+                      << " segments and recomputed " << voxels << " voxels"
+                      << std::endl;
+        }
+        _segmentation->relativeDistances().save(
+            paths.at("output-relative-distances"));
+        _segmentation->layers().save(paths.at("output-layers"));
+        return createLayersNode(_segmentation->layers());
+    }
+};
+
+// Calls a functor in the update traversal of every frame.
+class UpdateCallback : public osg::NodeCallback
+{
+public:
+    explicit UpdateCallback(std::function<void()> functor)
+        : _functor(std::move(functor))
+    {
+    }
+
+    void operator()(osg::Node* node, osg::NodeVisitor* visitor) override
+    {
+        _functor();
+        traverse(node, visitor);
     }
-}
+
+private:
+    std::function<void()> _functor;
+};
 
 int main(int argc, char* argv[])
 {
@@ -263,6 +521,13 @@ int main(int argc, char* argv[])
     std::pair<size_t, size_t> cropY{0, std::numeric_limits<size_t>::max()};
     std::pair<size_t, size_t> cropZ{0, std::numeric_limits<size_t>::max()};
     size_t averageSize = 1000;
+    NearestVoxelMethod nearestMethod = NearestVoxelMethod::rtree;
+    FieldOptions fieldOptions;
+    float evaluatedFraction = 0;
+    fieldOptions.evaluatedFraction = &evaluatedFraction;
+    size_t connectivity = 6;
+    size_t region = 0;
+    std::string indexCache;
 
     namespace po = boost::program_options;
     // clang-format off
@@ -272,6 +537,13 @@ int main(int argc, char* argv[])
         ("version,v", "Show program name/version banner and exit.")
         ("shell,s", po::value<std::string>(), "Load a saved painted shell.")
         ("flip,f", "Flip 'top' and 'bottom' voxels in the shell dataset.")
+        ("connectivity", po::value<size_t>(&connectivity)->
+                             value_name("6|18|26")->default_value(connectivity),
+         "Neighbours of a voxel considered to find the boundary of the region"
+         " when annotating the shell: face, edge or corner neighbours.")
+        ("region", po::value<size_t>(&region)->value_name("label"),
+         "Label of the region to annotate in the input volume. By default all"
+         " the non zero voxels.")
         ("bottom-up,b", "Enumerate layers from the bottom to the top, instead"
          " of top to bottom.")
         ("thickness,t", po::value<std::vector<float>>()->multitoken(),
@@ -280,6 +552,33 @@ int main(int argc, char* argv[])
         ("average-size,a", po::value<size_t>(&averageSize)->value_name("lines"),
          "Size of k-nearest neighbour query of top to bottom lines used to"
          " approximate relative voxel positions.")
+        ("nearest-method", po::value<NearestVoxelMethod>(&nearestMethod)->
+                               value_name("rtree|transform")->
+                               default_value(nearestMethod),
+         "Method used to find the closest opposite shell voxel of each shell"
+         " voxel: one R-tree query per voxel or a Euclidean feature transform"
+         " of the whole volume.")
+        ("index-cache", po::value<std::string>(&indexCache)->
+                            value_name("DIR"),
+         "Directory where the segment index of the shell is cached, keyed by"
+         " the contents of the shell and the nearest method, so that other"
+         " runs on the same shell map it instead of building it again.")
+        ("coherent", po::bool_switch(&fieldOptions.coherent),
+         "Traverse voxels brick by brick and bound each k-nearest neighbour"
+         " query with the result of the previous voxel. Gives the same"
+         " results up to ties between equidistant lines.")
+        ("epsilon", po::value<float>(&fieldOptions.epsilon)->
+                        default_value(fieldOptions.epsilon),
+         "Use (1 + epsilon)-approximate k-nearest neighbour queries and report"
+         " the maximum deviation from the exact result on a sample of voxels."
+         " 0 gives exact queries.")
+        ("tolerance", po::value<float>(&fieldOptions.tolerance)->
+                          default_value(fieldOptions.tolerance),
+         "Evaluate the fields on a coarse lattice and interpolate them where"
+         " the interpolation error at a few sample voxels is below this"
+         " tolerance, refining elsewhere and near the shell boundary. Reports"
+         " the fraction of voxels evaluated exactly and the maximum deviation"
+         " on a sample of voxels. 0 evaluates every voxel.")
         ("crop-x,x", po::value<std::pair<size_t, size_t>>(&cropX)->
                          value_name("<min>[:<max>]"),
          "Optional crop range for x axis.")
@@ -345,6 +644,11 @@ int main(int argc, char* argv[])
                   << std::endl;
         return -1;
     }
+    if (connectivity != 6 && connectivity != 18 && connectivity != 26)
+    {
+        std::cerr << "The connectivity must be 6, 18 or 26" << std::endl;
+        return -1;
+    }
     const bool bottomUp = vm.count("bottom-up");
 
     std::string filename = vm["input"].as<std::string>();
@@ -367,17 +671,32 @@ int main(int argc, char* argv[])
         }
     }
 
-    Volume<unsigned int> inVolume =
-        filename == ":test:" ? createVolume(64, 8) : loadVolume(filename);
-    std::cout << "Input volume dimensions: " << inVolume.width() << " "
-              << inVolume.height() << " " << inVolume.depth() << std::endl;
-
-    Volume<char> shell = shellFile.empty() ? annotateBoundaryVoxels(inVolume)
-                                           : Volume<char>(shellFile);
+    // The input labels are only needed to annotate the shell and to check
+    // the dimensions of a saved one.
+    std::tuple<size_t, size_t, size_t> dimensions;
+    const auto annotate = [&](const auto& inVolume) {
+        using Label = typename std::decay<decltype(inVolume)>::type::Value;
+        if (size_t(Label(region)) != region)
+            throw std::runtime_error("Invalid region for the atlas type: " +
+                                     std::to_string(region));
+        dimensions = inVolume.dimensions();
+        std::cout << "Input volume dimensions: " << inVolume.width() << " "
+                  << inVolume.height() << " " << inVolume.depth()
+                  << std::endl;
+        // Read rather than mapped since the shell may be flipped, painted
+        // and saved over its file.
+        return shellFile.empty()
+                   ? annotateBoundaryVoxels(inVolume, connectivity,
+                                            Label(region))
+                   : Volume<char>(shellFile, VolumeLoading::read);
+    };
+    Volume<char> fullShell = filename == ":test:"
+                                 ? annotate(createVolume(64, 8))
+                                 : visitLabelVolume(filename, annotate);
 
     if (vm.count("flip") && !shellFile.empty())
     {
-        shell.apply([](size_t, size_t, size_t, char value) {
+        fullShell.apply([](size_t, size_t, size_t, char value) {
             switch (value)
             {
             case Top:
@@ -389,17 +708,15 @@ int main(int argc, char* argv[])
         });
     }
 
-    if (filename != ":test:" && inVolume.dimensions() != shell.dimensions())
+    if (filename != ":test:" && dimensions != fullShell.dimensions())
     {
         std::cerr << "Invalid shell volume" << std::endl;
         return -1;
     }
-    clearOutsideXRange<unsigned int>(inVolume, cropX, 0);
-    clearOutsideXRange(shell, cropX, '\0');
-    clearOutsideYRange<unsigned int>(inVolume, cropY, 0);
-    clearOutsideYRange(shell, cropY, '\0');
-    clearOutsideZRange<unsigned int>(inVolume, cropZ, 0);
-    clearOutsideZRange(shell, cropZ, '\0');
+    // Everything is computed in the crop box only, the outputs have its
+    // dimensions and space origin. The shell is a view of the full shell,
+    // which is saved with the painted voxels.
+    Volume<char> shell = cropVolume(fullShell, cropX, cropY, cropZ);
 
     PathMap output_paths{{"output-relative-distances", "relativeDistance.nrrd"},
                          {"output-layers", "layer.nrrd"}};
@@ -412,7 +729,8 @@ int main(int argc, char* argv[])
 
     if (vm.count("segment"))
     {
-        segment(shell, averageSize, splitPoints, bottomUp, output_paths);
+        segment(shell, averageSize, nearestMethod, fieldOptions, splitPoints,
+                bottomUp, output_paths, indexCache);
         return 0;
     }
 
@@ -435,23 +753,48 @@ int main(int argc, char* argv[])
     osg::ref_ptr<Painter> painter = new Painter(shell, bricks, cameras[0]);
     viewer.addEventHandler(painter);
 
-    painter->done.connect([scene, averageSize, bottomUp, &shell, splitPoints,
-                           &output_paths] {
-        shell.save("shell.nrrd");
-
-        auto layers =
-            segment(shell, averageSize, splitPoints, bottomUp, output_paths);
-
-        Bricks::ColorMap layerColors;
-        layerColors[1] = osg::Vec4(1.0, 0, 0, 1);
-        layerColors[2] = osg::Vec4(1.0, 0.5, 0, 1);
-        layerColors[3] = osg::Vec4(1.0, 1.0, 0, 1);
-        layerColors[4] = osg::Vec4(0.5, 1.0, 0.5, 1);
-        layerColors[5] = osg::Vec4(0, 1.0, 1.0, 1);
-        layerColors[6] = osg::Vec4(0, 0.5, 0.5, 1);
-        Bricks layerBricks(layers, {1, 2, 3, 4, 5, 6}, layerColors);
+    // The worker owns a copy of the shell updated with the painted voxels,
+    // and the layers it computes are swapped into the scene on the next
+    // frame. The window title shows the progress of its tasks.
+    SegmentationWorker worker(
+        fullShell, cropX, cropY, cropZ,
+        SegmentationSettings{averageSize, nearestMethod, fieldOptions,
+                             splitPoints, bottomUp, output_paths,
+                             indexCache});
+    painter->painted.connect(
+        [&worker](size_t x, size_t y, size_t z, char value) {
+            worker.paint(x, y, z, value);
+        });
+    painter->save.connect([&worker] { worker.saveShell(); });
+    painter->done.connect([&worker] { worker.segment(); });
+
+    osg::ref_ptr<osg::Node> layersNode;
+    osgViewer::Viewer::Windows windows;
+    viewer.getWindows(windows);
+    std::string status;
+    scene->setUpdateCallback(new UpdateCallback([&] {
+        const osg::ref_ptr<osg::Node> layers = worker.takeLayers();
+        if (layers)
+        {
+            layersNode = layers;
+            scene->removeChild(0, scene->getNumChildren());
+            scene->addChild(layersNode);
+        }
+        const std::string current = worker.status();
+        if (current == status || windows.empty())
+            return;
+        status = current;
+        windows[0]->setWindowName(status.empty()
+                                      ? "Layer segmenter"
+                                      : "Layer segmenter - " + status);
+    }));
+
+    painter->toggleLayers.connect([scene, &bricks, &layersNode] {
+        if (!layersNode)
+            return;
+        const bool shown = scene->getChild(0) == layersNode.get();
         scene->removeChild(0, scene->getNumChildren());
-        scene->addChild(layerBricks.node());
+        scene->addChild(shown ? bricks.node() : layersNode.get());
     });
 
     viewer.run();
@@ -0,0 +1,231 @@
+#ifndef __NRRD_GZIP_HXX
+#define __NRRD_GZIP_HXX
+
+// Block-parallel gzip codec for the "gzip" encoding of NRRD files.
+//
+// The data is cut in blocks compressed independently (in parallel) as raw
+// deflate streams ended by a full flush, like pigz -i does. Their
+// concatenation is a single valid deflate stream, wrapped in a single gzip
+// member that any gzip reader can decompress. The compressed size of each
+// block is stored in the "gzip blocks" key of the header, so that files
+// written here can also be decompressed in parallel.
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace NRRD
+{
+	/// Uncompressed size of the blocks compressed in parallel.
+	const size_t GzipBlockSize=size_t(1)<<20;
+
+	/// Compresses a stream of bytes into a gzip member.
+	class GzipWriter
+	{
+	public:
+		explicit GzipWriter(int level=Z_DEFAULT_COMPRESSION)
+			: _level(level)
+			, _crc(crc32(0,Z_NULL,0))
+		{
+			// Magic number, deflate, no flags, no time, no extra flags, unknown OS.
+			const unsigned char header[]={0x1f,0x8b,8,0,0,0,0,0,0,255};
+			_out.assign((const char*)header,sizeof(header));
+		}
+
+		/// Appends data to the stream. Whole blocks are compressed as soon as possible.
+		void write(const char* data, size_t size)
+		{
+			if (!_pending.empty())
+			{
+				const size_t n=std::min(size,GzipBlockSize-_pending.size());
+				_pending.append(data,n);
+				data+=n;
+				size-=n;
+				if (_pending.size()<GzipBlockSize)
+					return;
+				_compress(_pending.data(),_pending.size(),false);
+				_pending.clear();
+			}
+			const size_t whole=size/GzipBlockSize*GzipBlockSize;
+			_compress(data,whole,false);
+			_pending.assign(data+whole,size-whole);
+		}
+
+		/// Compresses the remaining data and returns the gzip member.
+		const std::string& finish()
+		{
+			_compress(_pending.data(),_pending.size(),true);
+			_pending.clear();
+			for (int i=0;i<4;i++) _out.push_back(char((_crc>>(8*i))&0xff));
+			for (int i=0;i<4;i++) _out.push_back(char((_size>>(8*i))&0xff));
+			return _out;
+		}
+
+		/// Value of the "gzip blocks" key: the block size and the compressed size of each block.
+		std::string blocks() const
+		{
+			std::ostringstream str;
+			str << GzipBlockSize;
+			for (auto size : _blocks) str << " " << size;
+			return str.str();
+		}
+
+	private:
+		int _level;
+		uLong _crc;
+		uint64_t _size=0;
+		std::string _out;
+		std::string _pending;
+		std::vector<size_t> _blocks;
+
+		/// Compresses whole blocks in parallel, the last one being possibly partial (or empty) if last is true.
+		void _compress(const char* data, size_t size, bool last)
+		{
+			const size_t count=(size+GzipBlockSize-1)/GzipBlockSize+(last&&size%GzipBlockSize==0);
+			if (count==0)
+				return;
+			std::vector<std::string> blocks(count);
+			std::vector<uLong> crcs(count);
+			bool ok=true;
+			#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+			for (long long i=0;i<(long long)count;i++)
+			{
+				const size_t begin=std::min(size,size_t(i)*GzipBlockSize);
+				const size_t n=std::min(size-begin,GzipBlockSize);
+				const bool lastBlock=last&&i+1==(long long)count;
+				ok=_deflate(data+begin,n,lastBlock,blocks[i])&&ok;
+				crcs[i]=crc32(crc32(0,Z_NULL,0),(const Bytef*)data+begin,(uInt)n);
+			}
+			if (!ok)
+				throw std::runtime_error("NRRD::GzipWriter: compression error");
+			for (size_t i=0;i<count;i++)
+			{
+				const size_t n=std::min(size-std::min(size,i*GzipBlockSize),GzipBlockSize);
+				_crc=crc32_combine(_crc,crcs[i],(z_off_t)n);
+				_out+=blocks[i];
+				_blocks.push_back(blocks[i].size());
+			}
+			_size+=size;
+		}
+
+		bool _deflate(const char* data, size_t size, bool last, std::string& out) const
+		{
+			z_stream stream={};
+			if (deflateInit2(&stream,_level,Z_DEFLATED,-MAX_WBITS,8,Z_DEFAULT_STRATEGY)!=Z_OK)
+				return false;
+			out.resize(deflateBound(&stream,(uLong)size)+16);
+			stream.next_in=(Bytef*)data;
+			stream.avail_in=(uInt)size;
+			stream.next_out=(Bytef*)&out[0];
+			stream.avail_out=(uInt)out.size();
+			int result=deflate(&stream,last?Z_FINISH:Z_FULL_FLUSH);
+			const bool ok=last?result==Z_STREAM_END:(result==Z_OK&&stream.avail_in==0&&stream.avail_out!=0);
+			out.resize(out.size()-stream.avail_out);
+			deflateEnd(&stream);
+			return ok;
+		}
+	};
+
+	/// Decompresses one block of a GzipWriter member.
+	inline bool inflateBlock(const char* in, size_t inSize, char* out, size_t outSize)
+	{
+		z_stream stream={};
+		if (inflateInit2(&stream,-MAX_WBITS)!=Z_OK)
+			return false;
+		// inflate rejects a null output even without any output, e.g. the empty last block of empty data.
+		char empty=0;
+		stream.next_in=(Bytef*)in;
+		stream.avail_in=(uInt)inSize;
+		stream.next_out=(Bytef*)(outSize?out:&empty);
+		stream.avail_out=(uInt)outSize;
+		int result=inflate(&stream,Z_SYNC_FLUSH);
+		const bool ok=(result==Z_OK||result==Z_STREAM_END||result==Z_BUF_ERROR)&&stream.avail_out==0&&stream.avail_in==0;
+		inflateEnd(&stream);
+		return ok;
+	}
+
+	/// Decompresses gzip data into exactly outSize bytes. If blocks is the "gzip blocks" key written with the data,
+	/// the blocks are decompressed in parallel, otherwise the data is decompressed sequentially (concatenated gzip
+	/// members are supported). Returns false on error.
+	inline bool gunzip(const char* in, size_t inSize, char* out, size_t outSize, const std::string& blocks="")
+	{
+		std::istringstream str(blocks);
+		size_t blockSize=0, size=0;
+		std::vector<size_t> offsets(1,10);
+		if (str >> blockSize && blockSize)
+			while (str >> size)
+				offsets.push_back(offsets.back()+size);
+		const size_t count=offsets.size()-1;
+		// GzipWriter ends with a possibly empty partial block, after a plain 10 bytes header.
+		const bool parallel=count>0 && count==outSize/blockSize+1 && offsets.back()+8<=inSize &&
+			(unsigned char)in[0]==0x1f && (unsigned char)in[1]==0x8b && in[2]==8 && in[3]==0;
+		if (parallel)
+		{
+			bool ok=true;
+			std::vector<uLong> crcs(count);
+			#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+			for (long long i=0;i<(long long)count;i++)
+			{
+				const size_t begin=std::min(outSize,size_t(i)*blockSize);
+				const size_t n=std::min(outSize-begin,blockSize);
+				ok=inflateBlock(in+offsets[i],offsets[i+1]-offsets[i],out+begin,n)&&ok;
+				crcs[i]=crc32(crc32(0,Z_NULL,0),(const Bytef*)out+begin,(uInt)n);
+			}
+			if (!ok)
+				return false;
+			uLong crc=crc32(0,Z_NULL,0);
+			for (size_t i=0;i<count;i++)
+			{
+				const size_t begin=std::min(outSize,i*blockSize);
+				crc=crc32_combine(crc,crcs[i],(z_off_t)std::min(outSize-begin,blockSize));
+			}
+			const unsigned char* trailer=(const unsigned char*)in+offsets.back();
+			uLong expected=0;
+			for (int i=0;i<4;i++) expected|=uLong(trailer[i])<<(8*i);
+			return crc==expected;
+		}
+
+		// Sequential decompression, in chunks since zlib counts bytes with 32 bits.
+		const size_t chunk=size_t(1)<<30;
+		z_stream stream={};
+		if (inflateInit2(&stream,16+MAX_WBITS)!=Z_OK)
+			return false;
+		size_t read=0, written=0;
+		int result=Z_OK;
+		while (written<outSize)
+		{
+			if (stream.avail_in==0)
+			{
+				if (read==inSize)
+					break;
+				stream.next_in=(Bytef*)in+read;
+				stream.avail_in=(uInt)std::min(chunk,inSize-read);
+				read+=stream.avail_in;
+			}
+			const size_t available=std::min(chunk,outSize-written);
+			stream.next_out=(Bytef*)out+written;
+			stream.avail_out=(uInt)available;
+			result=inflate(&stream,Z_NO_FLUSH);
+			written+=available-stream.avail_out;
+			if (result==Z_STREAM_END)
+			{
+				// Next member, if any.
+				if (stream.avail_in==0 && read==inSize)
+					break;
+				result=inflateReset(&stream);
+			}
+			if (result!=Z_OK)
+				break;
+		}
+		inflateEnd(&stream);
+		return written==outSize;
+	}
+
+} // namespace NRRD
+
+#endif // __NRRD_GZIP_HXX
@@ -3,18 +3,24 @@
 #define __NRRD_HXX
 
 // Simple header-only implementation of the NRRD file format
-// Does not implement:  line skip, byte skip, orientations, encodings other than raw, kinds other than domain.
+// Does not implement:  line skip, byte skip, orientations, encodings other than raw and gzip, kinds other than domain.
+// Compresses and decompresses gzip in parallel (see gzip.hxx).
 // Converts all type strings to C-type equivalent i.e. "uint8" to "unsigned char"
 // Always writes "endian" tag (required for FIJI/ImageJ loading)
 // Can open files of Big and little endian but saves files only in native format.
 
 #include "StringUtil.hxx"
 #include "TypeString.hxx"
+#include "gzip.hxx"
 
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <map>
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <thread>
 
 #ifdef NRRD
 #undef NRRD
@@ -28,6 +34,11 @@
 //	std::map<std::string,std::string> hdr_fields=std::map<std::string,std::string>)
 //
 //template <typename T>
+//void NRRD::writeHeader(std::ostream& nrrd, int n, const int *size,
+//	std::map<std::string,std::string> hdr_keys=std::map<std::string,std::string>,
+//	std::map<std::string,std::string> hdr_fields=std::map<std::string,std::string>)
+//
+//template <typename T>
 //bool NRRD::load(const std::string& file, T** data, std::vector<int>* size,
 //	std::map<std::string,std::string>* hdr_keys=0x0,
 //	std::map<std::string,std::string>* hdr_fields=0x0)
@@ -65,6 +76,9 @@ namespace NRRD
     // Template for endian conversion of one element
     template <int N> inline void swapBytes(void* v);
 
+    /// nothing to swap for single bytes
+    template <> inline void swapBytes<1>(void*) {}
+
     /// swap 2 bytes (convert short endian)
     template <> inline void swapBytes<2>(void* v) {
         char *d=(char*)v;
@@ -92,6 +106,13 @@ namespace NRRD
         swapBytes<sizeof(v)>((void*)&v);
     }
 
+    /// In-place endian conversion of n elements, in parallel
+    template <typename T> inline void convertEndian(T* v, size_t n) {
+        #pragma omp parallel for
+        for (long long i=0;i<(long long)n;i++)
+            convertEndian(v[i]);
+    }
+
     /// Helper function to allocate an array of a specific type and fill it with values from an array of a different type
     template <typename S, typename T>
     T* convert(S* src, int n)
@@ -102,15 +123,12 @@ namespace NRRD
         return tgt;
     }
 
-	/// Save raw data in NRRD file.
+	/// Write the header of a raw NRRD file. The raw data of n dimensions and size elements of type T must follow.
 	template <typename T>
-	bool save(const std::string& file, const T* data, int n, const int *size,
+	void writeHeader(std::ostream& nrrd, int n, const int *size,
 		std::map<std::string,std::string> hdr_keys=std::map<std::string,std::string>(),
 		std::map<std::string,std::string> hdr_fields=std::map<std::string,std::string>())
 	{
-		std::ofstream nrrd(file.c_str(),std::ios::binary);
-		if (!nrrd||!nrrd.good())
-			return false;
 		// Magic number v.4
 		nrrd << "NRRD0004\n";
 		// Type. special case: char maps to int8.
@@ -124,8 +142,9 @@ namespace NRRD
 		hdr_fields["sizes"]=toString(size[0]);
 		for (int i=1;i<n;i++)
 			hdr_fields["sizes"]=hdr_fields["sizes"]+" "+toString(size[i]);
-		// Encoding
-		hdr_fields["encoding"]="raw";
+		// Encoding (the data is raw unless told otherwise)
+		if (hdr_fields["encoding"]!="gzip")
+			hdr_fields["encoding"]="raw";
 		if (is_cpu_BIG_endian()) hdr_fields["endian"]="big";
 		else hdr_fields["endian"]="little";
 		// Standard fields defined by NRRD format
@@ -144,10 +163,62 @@ namespace NRRD
 		int offset=(int)nrrd.tellp();
 		offset+=(int)raw_read_info_end.length()+8;
 		nrrd << toString(offset,8,' ')+raw_read_info_end;
-		int ne=1;
+	}
+
+	/// Unique name of a file in the directory of file, to be written and then renamed to file with replaceFile.
+	inline std::string temporaryName(const std::string& file)
+	{
+		static std::atomic<unsigned long long> counter(0);
+		std::ostringstream name;
+		name << file << ".tmp" << std::hash<std::thread::id>()(std::this_thread::get_id())
+			<< "_" << std::chrono::steady_clock::now().time_since_epoch().count() << "_" << counter++;
+		return name.str();
+	}
+
+	/// Renames a complete temporary file to file. The previous file is replaced at once, so that it is never truncated
+	/// while it is read or mapped, e.g. when a volume is saved over its input. The temporary file is removed on failure.
+	inline bool replaceFile(const std::string& temporary, const std::string& file)
+	{
+		if (std::rename(temporary.c_str(),file.c_str())==0)
+			return true;
+		std::remove(temporary.c_str());
+		return false;
+	}
+
+	/// Save data in NRRD file, raw or gzip compressed if hdr_fields["encoding"] is "gzip".
+	/// The data is written to a temporary file renamed to file, see replaceFile.
+	template <typename T>
+	bool save(const std::string& file, const T* data, int n, const int *size,
+		std::map<std::string,std::string> hdr_keys=std::map<std::string,std::string>(),
+		std::map<std::string,std::string> hdr_fields=std::map<std::string,std::string>())
+	{
+		const std::string temporary=temporaryName(file);
+		std::ofstream nrrd(temporary.c_str(),std::ios::binary);
+		if (!nrrd||!nrrd.good())
+			return false;
+		size_t ne=1;
 		for (int i=0;i<n;i++) ne*=size[i];
-		nrrd.write((char*)data,sizeof(T)*ne);
-		return true;
+		if (hdr_fields["encoding"]=="gzip")
+		{
+			GzipWriter gzip;
+			gzip.write((const char*)data,sizeof(T)*ne);
+			const std::string& compressed=gzip.finish();
+			hdr_keys["gzip blocks"]=gzip.blocks();
+			writeHeader<T>(nrrd,n,size,hdr_keys,hdr_fields);
+			nrrd.write(compressed.data(),compressed.size());
+		}
+		else
+		{
+			writeHeader<T>(nrrd,n,size,hdr_keys,hdr_fields);
+			nrrd.write((char*)data,sizeof(T)*ne);
+		}
+		nrrd.close();
+		if (!nrrd)
+		{
+			std::remove(temporary.c_str());
+			return false;
+		}
+		return replaceFile(temporary,file);
 	}
 
 	/// Parse header of NRRD file. Returns number of bytes in header (beginning of raw data)
@@ -230,13 +301,16 @@ namespace NRRD
 		std::map<std::string,std::string>* hdr_fields=0x0)
 	{
 		// Parse ascii header
-		std::map<std::string,std::string>	h_fields;
+		std::map<std::string,std::string>	h_fields, h_keys;
 		if (!hdr_fields) hdr_fields=&h_fields;
+		if (!hdr_keys) hdr_keys=&h_keys;
 		int header_offset=parseHeader(file, *hdr_fields, hdr_keys);
 		if (header_offset<=0) return false;
 
-		// Make sure the data is uncompressed
-		if ((*hdr_fields)["encoding"]!="raw")
+		// Make sure the encoding is supported
+		const std::string encoding=(*hdr_fields)["encoding"];
+		const bool gzip=encoding=="gzip"||encoding=="gz";
+		if (encoding!="raw"&&!gzip)
 		{
 			std::cerr << "NDDR::load<T>(...): File encoding not supported\n";
 			return false;
@@ -291,18 +365,32 @@ namespace NRRD
 
 			// Read data after first blank line
 			std::ifstream raw(file.c_str(),std::ios::binary);
-			raw.seekg(header_offset,std::ios::beg);
-			raw.read((char*)*data,n*sizeof(T));
-			int nbytes=(int)(n*sizeof(T)-raw.gcount());
-			if (!raw || nbytes)
+			if (gzip)
 			{
-				std::cerr << "NDDR::load<T>(...): Failed to read complete image chunk. (" << nbytes << ")\n";
-				return false;
+				raw.seekg(0,std::ios::end);
+				std::string compressed(size_t(raw.tellg())-header_offset,'\0');
+				raw.seekg(header_offset,std::ios::beg);
+				raw.read(&compressed[0],compressed.size());
+				if (!raw || !gunzip(compressed.data(),compressed.size(),(char*)*data,n*sizeof(T),(*hdr_keys)["gzip blocks"]))
+				{
+					std::cerr << "NDDR::load<T>(...): Failed to decompress image chunk.\n";
+					return false;
+				}
+			}
+			else
+			{
+				raw.seekg(header_offset,std::ios::beg);
+				raw.read((char*)*data,n*sizeof(T));
+				int nbytes=(int)(n*sizeof(T)-raw.gcount());
+				if (!raw || nbytes)
+				{
+					std::cerr << "NDDR::load<T>(...): Failed to read complete image chunk. (" << nbytes << ")\n";
+					return false;
+				}
 			}
 			// Convert endian if we have to.
 			if (endian_file!=endian_machine)
-				for (int i=0;i<n;i++)
-					convertEndian((*data)[i]);
+				convertEndian(*data,n);
 		}
 		return true;
 	}
@@ -0,0 +1,147 @@
+#ifndef REGIODESICS_ASYNCIO_H
+#define REGIODESICS_ASYNCIO_H
+
+#include "Volume.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Loads a volume in a background thread, so that independent inputs are
+// read concurrently and while the caller computes.
+template <typename T, typename Storage = LinearStorage>
+std::future<Volume<T, Storage>> loadVolumeAsync(
+    const std::string& filename,
+    const VolumeLoading loading = VolumeLoading::read)
+{
+    return std::async(std::launch::async, [filename, loading] {
+        return Volume<T, Storage>(filename, loading);
+    });
+}
+
+// Background threads running output tasks, so that results are written
+// while the next ones are computed. With a single thread the tasks run in
+// submission order. submit() blocks while `capacity` tasks are queued or
+// running, which bounds the memory they hold: with a capacity of 1, one
+// result is written while the next one is computed (double buffering).
+// After a task throws, the remaining tasks are skipped and wait() rethrows
+// its exception.
+class AsyncWriter
+{
+public:
+    explicit AsyncWriter(
+        const size_t threads = 1,
+        const size_t capacity = std::numeric_limits<size_t>::max())
+        : _capacity(std::max(capacity, size_t(1)))
+    {
+        for (size_t i = 0; i < std::max(threads, size_t(1)); ++i)
+            _threads.emplace_back([this] { _run(); });
+    }
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    // Finishes the pending tasks. Call wait() before to get their errors.
+    ~AsyncWriter()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _changed.notify_all();
+        for (auto& thread : _threads)
+            thread.join();
+    }
+
+    void submit(std::function<void()> task)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _changed.wait(lock,
+                      [this] { return _tasks.size() + _busy < _capacity; });
+        _tasks.push_back(std::move(task));
+        lock.unlock();
+        _changed.notify_all();
+    }
+
+    // Saves a volume given to the writer.
+    template <typename T, typename Storage>
+    void save(Volume<T, Storage>&& volume, const std::string& filename,
+              const VolumeEncoding encoding = VolumeEncoding::raw)
+    {
+        auto shared =
+            std::make_shared<Volume<T, Storage>>(std::move(volume));
+        submit([shared, filename, encoding] {
+            shared->save(filename, encoding);
+        });
+    }
+
+    // Waits until all the tasks submitted are done.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _changed.wait(lock, [this] { return _tasks.empty() && _busy == 0; });
+        if (_error)
+        {
+            auto error = _error;
+            _error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    const size_t _capacity;
+    std::vector<std::thread> _threads;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    size_t _busy = 0;
+    bool _stopping = false;
+    std::exception_ptr _error;
+
+    void _run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _changed.wait(lock,
+                          [this] { return _stopping || !_tasks.empty(); });
+            if (_tasks.empty())
+                return;
+            auto task = std::move(_tasks.front());
+            _tasks.pop_front();
+            ++_busy;
+            const bool skip = bool(_error);
+            lock.unlock();
+            _changed.notify_all();
+
+            std::exception_ptr error;
+            if (!skip)
+            {
+                try
+                {
+                    task();
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+            }
+
+            lock.lock();
+            if (error && !_error)
+                _error = error;
+            --_busy;
+            _changed.notify_all();
+        }
+    }
+};
+
+#endif
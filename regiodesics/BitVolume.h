@@ -0,0 +1,234 @@
+#ifndef REGIODESICS_BITVOLUME_H
+#define REGIODESICS_BITVOLUME_H
+
+#include "Volume.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+// Volume of booleans packed in 1 bit per voxel, for masks such as the voxels
+// of a shell or of a region. The bits are stored in the linear order of
+// Volume (x fastest) in 64 bit words, so that 64 consecutive voxels are
+// combined, counted or skipped at once. The bits after the last voxel are
+// always 0.
+class BitVolume
+{
+public:
+    using Word = uint64_t;
+    static const size_t WordBits = 64;
+    // Returned by findNext when no voxel is set.
+    static const size_t npos = size_t(-1);
+
+    BitVolume(const size_t width, const size_t height, const size_t depth,
+              const bool value = false)
+        : _width(width)
+        , _height(height)
+        , _depth(depth)
+        , _words((size() + WordBits - 1) / WordBits)
+    {
+        fill(value);
+    }
+
+    // Sets the voxels of the volume for which predicate(value) is true.
+    template <typename T, typename Storage, typename Predicate>
+    BitVolume(const Volume<T, Storage>& volume, const Predicate& predicate)
+        : BitVolume(volume.width(), volume.height(), volume.depth())
+    {
+        const T* values =
+            Storage::linear && volume.storage().contiguous() && size()
+                ? &volume(size_t(0), 0, 0)
+                : nullptr;
+#pragma omp parallel for
+        for (size_t i = 0; i < _words.size(); ++i)
+        {
+            const size_t begin = i * WordBits;
+            const size_t end = std::min(begin + WordBits, size());
+            Word word = 0;
+            if (values)
+            {
+                for (size_t j = begin; j != end; ++j)
+                    word |= Word(predicate(values[j])) << (j - begin);
+            }
+            else
+            {
+                size_t x = begin % _width;
+                size_t y = begin / _width % _height;
+                size_t z = begin / _width / _height;
+                for (size_t j = begin; j != end; ++j)
+                {
+                    if (predicate(volume(x, y, z)))
+                        word |= Word(1) << (j - begin);
+                    if (++x == _width)
+                    {
+                        x = 0;
+                        if (++y == _height)
+                        {
+                            y = 0;
+                            ++z;
+                        }
+                    }
+                }
+            }
+            _words[i] = word;
+        }
+    }
+
+    // Sets the non zero voxels of the volume.
+    template <typename T, typename Storage>
+    explicit BitVolume(const Volume<T, Storage>& volume)
+        : BitVolume(volume, [](const T& value) { return value != T(0); })
+    {
+    }
+
+    std::tuple<size_t, size_t, size_t> dimensions() const
+    {
+        return std::make_tuple(_width, _height, _depth);
+    }
+    size_t width() const { return _width; }
+    size_t height() const { return _height; }
+    size_t depth() const { return _depth; }
+    // Number of voxels.
+    size_t size() const { return _width * _height * _depth; }
+
+    // Linear index of a voxel.
+    size_t index(const size_t x, const size_t y, const size_t z) const
+    {
+        return x + _width * (y + _height * z);
+    }
+
+    bool operator()(const size_t x, const size_t y, const size_t z) const
+    {
+        return test(index(x, y, z));
+    }
+
+    bool test(const size_t index) const
+    {
+        return (_words[index / WordBits] >> (index % WordBits)) & 1;
+    }
+
+    // Not thread safe for voxels whose linear indices fall in the same 64-bit
+    // word: those must be set by a single thread. Rows are not padded, so a
+    // word can span the end of a row and the start of the next one; threads
+    // must split the volume at word boundaries, not at rows or slices.
+    void set(const size_t x, const size_t y, const size_t z,
+             const bool value = true)
+    {
+        const size_t i = index(x, y, z);
+        const Word bit = Word(1) << (i % WordBits);
+        if (value)
+            _words[i / WordBits] |= bit;
+        else
+            _words[i / WordBits] &= ~bit;
+    }
+
+    void fill(const bool value)
+    {
+        std::fill(_words.begin(), _words.end(), value ? ~Word(0) : Word(0));
+        _clearPadding();
+    }
+
+    BitVolume& operator&=(const BitVolume& other)
+    {
+        _combine(other, [](const Word a, const Word b) { return a & b; });
+        return *this;
+    }
+
+    BitVolume& operator|=(const BitVolume& other)
+    {
+        _combine(other, [](const Word a, const Word b) { return a | b; });
+        return *this;
+    }
+
+    // Clears the voxels set in the other volume.
+    BitVolume& andNot(const BitVolume& other)
+    {
+        _combine(other, [](const Word a, const Word b) { return a & ~b; });
+        return *this;
+    }
+
+    void invert()
+    {
+#pragma omp parallel for
+        for (size_t i = 0; i < _words.size(); ++i)
+            _words[i] = ~_words[i];
+        _clearPadding();
+    }
+
+    // Number of voxels set.
+    size_t count() const
+    {
+        size_t total = 0;
+#pragma omp parallel for reduction(+ : total)
+        for (size_t i = 0; i < _words.size(); ++i)
+            total += __builtin_popcountll(_words[i]);
+        return total;
+    }
+
+    // True if a voxel of [begin, end) in linear order is set.
+    bool any(const size_t begin, const size_t end) const
+    {
+        const size_t next = findNext(begin);
+        return next != npos && next < end;
+    }
+
+    // Returns the linear index of the first voxel set from index on, or npos.
+    size_t findNext(const size_t index) const
+    {
+        size_t i = index / WordBits;
+        if (i >= _words.size())
+            return npos;
+        Word word = _words[i] & (~Word(0) << (index % WordBits));
+        while (word == 0)
+        {
+            if (++i == _words.size())
+                return npos;
+            word = _words[i];
+        }
+        return i * WordBits + __builtin_ctzll(word);
+    }
+
+    // Calls functor(x, y, z) for each voxel set in storage order, skipping
+    // the empty words.
+    template <typename Functor>
+    void visit(const Functor& functor) const
+    {
+        for (size_t i = 0; i != _words.size(); ++i)
+        {
+            for (Word word = _words[i]; word != 0; word &= word - 1)
+            {
+                const size_t j = i * WordBits + __builtin_ctzll(word);
+                functor(j % _width, j / _width % _height,
+                        j / _width / _height);
+            }
+        }
+    }
+
+    const std::vector<Word>& words() const { return _words; }
+
+private:
+    size_t _width;
+    size_t _height;
+    size_t _depth;
+    std::vector<Word> _words;
+
+    void _clearPadding()
+    {
+        if (size() % WordBits)
+            _words.back() &= (Word(1) << (size() % WordBits)) - 1;
+    }
+
+    template <typename Operation>
+    void _combine(const BitVolume& other, const Operation& operation)
+    {
+        if (other.dimensions() != dimensions())
+            throw std::invalid_argument("Bit volume dimensions mismatch");
+#pragma omp parallel for
+        for (size_t i = 0; i < _words.size(); ++i)
+            _words[i] = operation(_words[i], other._words[i]);
+    }
+};
+
+#endif
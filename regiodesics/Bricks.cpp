@@ -1,4 +1,5 @@
 #include "Bricks.h"
+#include "BitVolume.h"
 
 #include <osg/Geode>
 #include <osg/Geometry>
@@ -9,6 +10,10 @@
 
 #include <boost/progress.hpp>
 
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
 inline void addShader(osg::Program* program, osg::Shader::Type type,
                       const char* source)
 {
@@ -159,11 +164,107 @@ inline osg::Program* createBrickShadingProgram()
     return program;
 }
 
+// Shades the triangles of the greedy meshes like the bricks of
+// createBrickShadingProgram. The coordinates of the voxel of a fragment are
+// found half a voxel behind it along the face normal.
+inline osg::Program* createMeshShadingProgram()
+{
+    const char* vertexSource = R"(
+    #version 120
+    varying vec3 normal;
+    varying vec3 eye;
+    varying vec3 inside;
+    void main()
+    {
+        gl_FrontColor = gl_Color;
+        vec4 p = gl_ModelViewMatrix * gl_Vertex;
+        gl_Position = gl_ProjectionMatrix * p;
+        normal = normalize(gl_NormalMatrix * gl_Normal);
+        eye = -p.xyz;
+        inside = gl_Vertex.xyz - gl_Normal * 0.5;
+    })";
+
+    const char* const fragSource = R"(
+    #version 120
+    varying vec3 normal;
+    varying vec3 eye;
+    varying vec3 inside;
+
+    void main()
+    {
+        vec3 norm_eye = normalize(eye);
+        float lambert = normalize(normal).z * 0.9;
+        vec4 color = gl_Color * lambert + vec4(0.05, 0.05, 0.05, 0.0);
+
+        vec3 r = reflect(-norm_eye, normal);
+        color.rgb += vec3(0.05, 0.05, 0.05) *
+                     pow(max(dot(r, norm_eye) , 0.0), 16.0);
+        gl_FragData[0] = color;
+        gl_FragData[1].xyz = floor(inside) + vec3(1, 1, 1);
+    })";
+
+    osg::Program* program = new osg::Program();
+    addShader(program, osg::Shader::VERTEX, vertexSource);
+    addShader(program, osg::Shader::FRAGMENT, fragSource);
+    return program;
+}
+
 Bricks::Bricks(const Volume<char>& volume, const std::vector<char>& values,
-               const ColorMap& colors, bool applyTransform)
+               const ColorMap& colors, bool applyTransform, const Mesh mesh)
+    : _mesh(mesh)
 {
     std::tie(_width, _height, _depth) = volume.dimensions();
 
+    osg::Geometry* geometry = mesh == Mesh::greedy
+                                  ? _createGreedyMesh(volume, values, colors)
+                                  : _createPoints(volume, values, colors);
+
+    osg::StateSet* stateSet = geometry->getOrCreateStateSet();
+    // Assuming isotropy
+    stateSet->setAttributeAndModes(mesh == Mesh::greedy
+                                       ? createMeshShadingProgram()
+                                       : createBrickShadingProgram());
+
+    osg::Geode* geode = new osg::Geode();
+    geode->addDrawable(geometry);
+
+    if (applyTransform)
+    {
+        const auto vx = volume.volumeAxis(0);
+        const auto vy = volume.volumeAxis(1);
+        const auto vz = volume.volumeAxis(2);
+        const auto voxelSize = std::sqrt(boost::geometry::dot_product(vx, vx));
+        stateSet->addUniform(
+            new osg::Uniform("sizes",
+                             osg::Vec3(voxelSize, voxelSize, voxelSize)));
+
+        osg::MatrixTransform* volumeTransform = new osg::MatrixTransform();
+        osg::Matrix transform(vx.get<0>(), vy.get<0>(), vz.get<0>(), 0,
+                              vx.get<1>(), vy.get<1>(), vz.get<1>(), 0,
+                              vx.get<2>(), vy.get<2>(), vz.get<2>(), 0,
+                              0, 0, 0, 1);
+        volumeTransform->setMatrix(transform);
+        volumeTransform->addChild(geode);
+        _node = volumeTransform;
+    }
+    else
+    {
+        stateSet->addUniform(
+            new osg::Uniform("sizes", osg::Vec3(1.f, 1.f, 1.f)));
+        _node = geode;
+    }
+}
+
+osg::Vec4 Bricks::_defaultColor(const size_t x, const size_t y) const
+{
+    const float t = y / float(_height);
+    return osg::Vec4(x / float(_width), t, 1 - t, 1);
+}
+
+osg::Geometry* Bricks::_createPoints(const Volume<char>& volume,
+                                     const std::vector<char>& values,
+                                     const ColorMap& colors)
+{
     osg::Vec3Array* vertices = new osg::Vec3Array();
     _colors = new osg::Vec4Array();
     size_t size = _width * _height * _depth;
@@ -184,15 +285,8 @@ Bricks::Bricks(const Volume<char>& volume, const std::vector<char>& values,
                 _coords.push_back(std::make_tuple(x, y, z));
 
                 auto entry = colors.find(*i);
-                osg::Vec4 color;
-                if (entry != colors.end())
-                    color = entry->second;
-                else
-                {
-                    const float t = y / float(_height);
-                    color = osg::Vec4(x / float(_width), t, 1 - t, 1);
-                }
-                _colors->push_back(color);
+                _colors->push_back(entry != colors.end() ? entry->second
+                                                         : _defaultColor(x, y));
             }
 
     osg::DrawArrays* primitive =
@@ -204,49 +298,196 @@ Bricks::Bricks(const Volume<char>& volume, const std::vector<char>& values,
     geometry->setColorArray(_colors);
     geometry->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
     geometry->addPrimitiveSet(primitive);
+    return geometry;
+}
 
-    osg::StateSet* stateSet = geometry->getOrCreateStateSet();
-    // Assuming isotropy
-    stateSet->setAttributeAndModes(createBrickShadingProgram());
-
-    osg::Geode* geode = new osg::Geode();
-    geode->addDrawable(geometry);
-
-    if (applyTransform)
+namespace
+{
+// Rectangle of faces of a slice of voxels, in voxel units along the two
+// other axes.
+struct Quad
+{
+    size_t u;
+    size_t v;
+    size_t width;
+    size_t height;
+    // Color key of the faces, see _createGreedyMesh.
+    uint64_t key;
+};
+} // namespace
+
+osg::Geometry* Bricks::_createGreedyMesh(const Volume<char>& volume,
+                                         const std::vector<char>& values,
+                                         const ColorMap& colors)
+{
+    bool selected[256] = {};
+    for (const char value : values)
+        selected[(unsigned char)value] = true;
+    bool colored[256] = {};
+    for (const auto& entry : colors)
+        colored[(unsigned char)entry.first] = true;
+    const BitVolume bricks(volume, [&selected](const char value) {
+        return selected[(unsigned char)value];
+    });
+
+    // The faces of a slice are merged if they have the same key: the value
+    // plus 1 for the values with a color, and otherwise a number above 256
+    // given by the x and y of the voxel, which select its default color.
+    const auto key = [this, &volume, &colored](size_t x, size_t y, size_t z) {
+        const auto value = (unsigned char)volume(x, y, z);
+        if (colored[value])
+            return uint64_t(value) + 1;
+        return 257 + uint64_t(x) * _height + y;
+    };
+
+    // A slice is the layer of faces of a given axis and side of the voxels
+    // at a given position along that axis. The slices are meshed in
+    // parallel, the faces of a slice being merged row by row, each
+    // rectangle growing first along the row and then over the next rows.
+    const size_t sizes[] = {_width, _height, _depth};
+    std::vector<std::array<size_t, 3>> slices;
+    for (size_t side = 0; side != 2; ++side)
+        for (size_t axis = 0; axis != 3; ++axis)
+            for (size_t i = 0; i != sizes[axis]; ++i)
+                slices.push_back({{side, axis, i}});
+
+    std::vector<std::vector<Quad>> quads(slices.size());
+    boost::progress_display progress(slices.size());
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < slices.size(); ++i)
     {
-        const auto vx = volume.volumeAxis(0);
-        const auto vy = volume.volumeAxis(1);
-        const auto vz = volume.volumeAxis(2);
-        const auto voxelSize = std::sqrt(boost::geometry::dot_product(vx, vx));
-        stateSet->addUniform(
-            new osg::Uniform("sizes",
-                             osg::Vec3(voxelSize, voxelSize, voxelSize)));
+        const int step = slices[i][0] ? 1 : -1;
+        const size_t axis = slices[i][1];
+        const size_t u = (axis + 1) % 3;
+        const size_t v = (axis + 2) % 3;
+        const size_t width = sizes[u];
+        const size_t height = sizes[v];
+
+        std::vector<uint64_t> faces(width * height, 0);
+        size_t p[3];
+        p[axis] = slices[i][2];
+        const size_t next = p[axis] + step;
+        const bool border = next >= sizes[axis];
+        for (size_t b = 0; b != height; ++b)
+        {
+            for (size_t a = 0; a != width; ++a)
+            {
+                p[u] = a;
+                p[v] = b;
+                if (!bricks(p[0], p[1], p[2]))
+                    continue;
+                if (!border)
+                {
+                    size_t q[] = {p[0], p[1], p[2]};
+                    q[axis] = next;
+                    if (bricks(q[0], q[1], q[2]))
+                        continue;
+                }
+                faces[a + b * width] = key(p[0], p[1], p[2]);
+            }
+        }
 
-        osg::MatrixTransform* volumeTransform = new osg::MatrixTransform();
-        osg::Matrix transform(vx.get<0>(), vy.get<0>(), vz.get<0>(), 0,
-                              vx.get<1>(), vy.get<1>(), vz.get<1>(), 0,
-                              vx.get<2>(), vy.get<2>(), vz.get<2>(), 0,
-                              0, 0, 0, 1);
-        volumeTransform->setMatrix(transform);
-        volumeTransform->addChild(geode);
-        _node = volumeTransform;
+        for (size_t b = 0; b != height; ++b)
+        {
+            for (size_t a = 0; a != width; ++a)
+            {
+                const uint64_t face = faces[a + b * width];
+                if (face == 0)
+                    continue;
+                size_t w = 1;
+                while (a + w != width && faces[a + w + b * width] == face)
+                    ++w;
+                size_t h = 1;
+                for (; b + h != height; ++h)
+                {
+                    const uint64_t* row = &faces[a + (b + h) * width];
+                    if (std::any_of(row, row + w,
+                                    [face](uint64_t f) { return f != face; }))
+                        break;
+                }
+                for (size_t j = b; j != b + h; ++j)
+                    std::fill_n(&faces[a + j * width], w, 0);
+                quads[i].push_back(Quad{a, b, w, h, face});
+                a += w - 1;
+            }
+        }
+#pragma omp critical
+        ++progress;
     }
-    else
+
+    size_t count = 0;
+    for (const auto& slice : quads)
+        count += slice.size();
+    osg::Vec3Array* vertices = new osg::Vec3Array();
+    osg::Vec3Array* normals = new osg::Vec3Array();
+    _colors = new osg::Vec4Array();
+    osg::DrawElementsUInt* primitive =
+        new osg::DrawElementsUInt(GL_TRIANGLES);
+    vertices->reserve(count * 4);
+    normals->reserve(count * 4);
+    _colors->reserve(count * 4);
+    primitive->reserve(count * 6);
+
+    for (size_t i = 0; i != slices.size(); ++i)
     {
-        stateSet->addUniform(
-            new osg::Uniform("sizes", osg::Vec3(1.f, 1.f, 1.f)));
-        _node = geode;
+        const bool positive = slices[i][0];
+        const size_t axis = slices[i][1];
+        const size_t u = (axis + 1) % 3;
+        const size_t v = (axis + 2) % 3;
+        osg::Vec3 normal;
+        normal[axis] = positive ? 1 : -1;
+        for (const auto& quad : quads[i])
+        {
+            osg::Vec4 color;
+            if (quad.key <= 256)
+                color = colors.at(char(quad.key - 1));
+            else
+                color = _defaultColor((quad.key - 257) / _height,
+                                      (quad.key - 257) % _height);
+
+            // Counterclockwise seen from the outside.
+            const size_t corners[4][2] = {{0, 0},
+                                          {quad.width, 0},
+                                          {quad.width, quad.height},
+                                          {0, quad.height}};
+            const unsigned int first = vertices->size();
+            for (const auto& corner : corners)
+            {
+                osg::Vec3 vertex;
+                vertex[axis] = slices[i][2] + positive;
+                vertex[u] = quad.u + corner[0];
+                vertex[v] = quad.v + corner[1];
+                vertices->push_back(vertex);
+                normals->push_back(normal);
+                _colors->push_back(color);
+            }
+            const unsigned int order[2][6] = {{0, 2, 1, 0, 3, 2},
+                                              {0, 1, 2, 0, 2, 3}};
+            for (const unsigned int index : order[positive])
+                primitive->push_back(first + index);
+        }
     }
+
+    osg::Geometry* geometry = new osg::Geometry();
+    geometry->setUseDisplayList(false);
+    geometry->setUseVertexBufferObjects(true);
+    geometry->setVertexArray(vertices);
+    geometry->setNormalArray(normals, osg::Array::BIND_PER_VERTEX);
+    geometry->setColorArray(_colors, osg::Array::BIND_PER_VERTEX);
+    geometry->addPrimitiveSet(primitive);
+    return geometry;
 }
 
 void Bricks::resetBrick(size_t x, size_t y, size_t z)
 {
-    const float t = y / float(_height);
-    paintBrick(x, y, z, osg::Vec4(x / float(_width), t, 1 - t, 1));
+    paintBrick(x, y, z, _defaultColor(x, y));
 }
 
 void Bricks::paintBrick(size_t x, size_t y, size_t z, const osg::Vec4& color)
 {
+    if (_mesh != Mesh::points)
+        throw std::logic_error("Only point bricks can be painted");
+
     if (x == 0 && y == 0 && z == 0)
         abort();
 
@@ -4,6 +4,7 @@
 #include "Volume.h"
 
 #include <osg/Array>
+#include <osg/Geometry>
 #include <osg/Node>
 
 #include <map>
@@ -13,8 +14,22 @@ class Bricks
 public:
     using ColorMap = std::map<char, osg::Vec4>;
 
+    // How the voxels are turned into geometry.
+    enum class Mesh
+    {
+        // One point per voxel, expanded into a cube by a geometry shader.
+        // Bricks can only be painted in this mode.
+        points,
+        // Triangles covering only the faces not hidden by a neighbour, the
+        // coplanar faces of the same color being merged into larger
+        // rectangles (greedy meshing). Much less vertex work for large
+        // static volumes, and no geometry shader.
+        greedy
+    };
+
     Bricks(const Volume<char>& volume, const std::vector<char>& values,
-           const ColorMap& colors = ColorMap(), bool applyTransform = false);
+           const ColorMap& colors = ColorMap(), bool applyTransform = false,
+           Mesh mesh = Mesh::points);
 
     osg::Node* node() { return _node.get(); }
     void paintBrick(size_t x, size_t y, size_t z, const osg::Vec4& color);
@@ -25,9 +40,18 @@ private:
     size_t _width;
     size_t _height;
     size_t _depth;
+    Mesh _mesh;
     osg::ref_ptr<osg::Vec4Array> _colors;
     osg::ref_ptr<osg::Node> _node;
     std::vector<std::tuple<size_t, size_t, size_t>> _coords;
+
+    osg::Vec4 _defaultColor(size_t x, size_t y) const;
+    osg::Geometry* _createPoints(const Volume<char>& volume,
+                                 const std::vector<char>& values,
+                                 const ColorMap& colors);
+    osg::Geometry* _createGreedyMesh(const Volume<char>& volume,
+                                     const std::vector<char>& values,
+                                     const ColorMap& colors);
 };
 
 #endif
@@ -0,0 +1,434 @@
+#include "SegmentIndex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define REGIODESICS_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+const uint32_t LeafSize = 32;
+
+// Header of the index files, followed by the nodes at NodesOffset and then
+// the records.
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    // ByteOrderMark as written by the host.
+    uint32_t byteOrder;
+    uint32_t nodeSize;
+    uint32_t recordSize;
+    uint64_t nodeCount;
+    uint64_t recordCount;
+};
+
+const char FileMagic[8] = {'R', 'G', 'D', 'S', 'I', 'D', 'X', 0};
+const uint32_t FileVersion = 1;
+const uint32_t ByteOrderMark = 0x01020304;
+const size_t NodesOffset = 64;
+
+static_assert(sizeof(FileHeader) <= NodesOffset, "Index file header too big");
+// The records only hold numbers, but std::pair in Segment has a non trivial
+// assignment operator.
+static_assert(std::is_standard_layout<SegmentRecord>::value &&
+                  std::is_trivially_destructible<SegmentRecord>::value,
+              "Segment records are stored as they are in memory");
+
+// Returns the contents of the file, mapped read-only if possible.
+std::shared_ptr<const char> _readFile(const std::string& filename,
+                                      size_t& length)
+{
+#ifdef REGIODESICS_USE_MMAP
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("Could not open " + filename);
+    struct stat status;
+    if (fstat(fd, &status) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Error reading " + filename);
+    }
+    length = size_t(status.st_size);
+    void* address =
+        length ? mmap(0, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (address != MAP_FAILED)
+    {
+        return std::shared_ptr<const char>((const char*)address,
+                                           [length](const char* data) {
+                                               munmap((void*)data, length);
+                                           });
+    }
+#endif
+    // Falling back to reading the file. Operator new aligns the buffer for
+    // any type.
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in)
+        throw std::runtime_error("Could not open " + filename);
+    length = size_t(in.tellg());
+    std::shared_ptr<char> buffer(new char[length],
+                                 std::default_delete<char[]>());
+    in.seekg(0);
+    if (!in.read(buffer.get(), length))
+        throw std::runtime_error("Error reading " + filename);
+    return buffer;
+}
+
+using Key = std::pair<uint32_t, uint32_t>;
+
+// Inserts two 0 bits between each of the 10 lower bits of the input.
+uint32_t _expandBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code of a point given in [0, 1]^3.
+uint32_t _mortonCode(const float x, const float y, const float z)
+{
+    const auto quantize = [](const float v) {
+        return uint32_t(std::min(1023.f, std::max(0.f, v * 1024)));
+    };
+    return _expandBits(quantize(x)) << 2 | _expandBits(quantize(y)) << 1 |
+           _expandBits(quantize(z));
+}
+
+// Splits the sorted keys of [begin, end) at the highest bit that differs
+// between the first and the last Morton code, or in the middle if all codes
+// are equal.
+uint32_t _split(const std::vector<Key>& keys, const uint32_t begin,
+                const uint32_t end)
+{
+    const uint32_t first = keys[begin].first;
+    const uint32_t last = keys[end - 1].first;
+    if (first == last)
+        return begin + (end - begin) / 2;
+
+    uint32_t bit = uint32_t(1) << 31;
+    while (((first ^ last) & bit) == 0)
+        bit >>= 1;
+    const uint32_t threshold = last & ~(bit - 1);
+    return std::lower_bound(keys.begin() + begin, keys.begin() + end,
+                            Key(threshold, 0)) -
+           keys.begin();
+}
+
+template <typename Node>
+float _squaredDistance(const Node& node, const float* point)
+{
+    float distance = 0;
+    for (int i = 0; i != 3; ++i)
+    {
+        const float d = std::max(
+            0.f, std::max(node.min[i] - point[i], point[i] - node.max[i]));
+        distance += d * d;
+    }
+    return distance;
+}
+} // namespace
+
+SegmentIndex::SegmentIndex(SegmentRecords records)
+    : _records(std::move(records))
+{
+    if (_records.size() >= std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Too many segments");
+    if (!_records.empty())
+        _build();
+    _nodeData = _nodes.data();
+    _nodeCount = _nodes.size();
+    _recordData = _records.data();
+    _recordCount = _records.size();
+}
+
+SegmentIndex::SegmentIndex(const std::string& filename)
+{
+    size_t length = 0;
+    _file = _readFile(filename, length);
+    FileHeader header;
+    if (length < NodesOffset)
+        throw std::runtime_error("Invalid segment index file " + filename);
+    memcpy(&header, _file.get(), sizeof(header));
+    if (memcmp(header.magic, FileMagic, sizeof(FileMagic)) != 0 ||
+        header.version != FileVersion)
+    {
+        throw std::runtime_error("Invalid segment index file " + filename);
+    }
+    if (header.byteOrder != ByteOrderMark ||
+        header.nodeSize != sizeof(Node) ||
+        header.recordSize != sizeof(SegmentRecord))
+    {
+        throw std::runtime_error("Segment index file " + filename +
+                                 " written by an incompatible host");
+    }
+    if (length != NodesOffset + header.nodeCount * sizeof(Node) +
+                      header.recordCount * sizeof(SegmentRecord))
+    {
+        throw std::runtime_error("Truncated segment index file " + filename);
+    }
+    _nodeCount = header.nodeCount;
+    _recordCount = header.recordCount;
+    _nodeData = (const Node*)(_file.get() + NodesOffset);
+    _recordData = (const SegmentRecord*)(_nodeData + _nodeCount);
+}
+
+void SegmentIndex::save(const std::string& filename) const
+{
+    FileHeader header;
+    memcpy(header.magic, FileMagic, sizeof(FileMagic));
+    header.version = FileVersion;
+    header.byteOrder = ByteOrderMark;
+    header.nodeSize = sizeof(Node);
+    header.recordSize = sizeof(SegmentRecord);
+    header.nodeCount = _nodeCount;
+    header.recordCount = _recordCount;
+    char padded[NodesOffset] = {};
+    memcpy(padded, &header, sizeof(header));
+
+    std::ofstream out(filename, std::ios::binary);
+    out.write(padded, NodesOffset);
+    out.write((const char*)_nodeData, sizeof(Node) * _nodeCount);
+    out.write((const char*)_recordData, sizeof(SegmentRecord) * _recordCount);
+    if (!out)
+        throw std::runtime_error("Error writing " + filename);
+}
+
+void SegmentIndex::_build()
+{
+    const size_t count = _records.size();
+
+    // Sorting the records by the Morton code of their centers.
+    std::vector<Point3f> centers(count);
+#pragma omp parallel for
+    for (size_t i = 0; i < count; ++i)
+    {
+        const SegmentRecord& record = _records[i];
+        centers[i] = record.origin + record.direction * (record.length * 0.5f);
+    }
+
+    float low[] = {std::numeric_limits<float>::max(),
+                   std::numeric_limits<float>::max(),
+                   std::numeric_limits<float>::max()};
+    float high[] = {std::numeric_limits<float>::lowest(),
+                    std::numeric_limits<float>::lowest(),
+                    std::numeric_limits<float>::lowest()};
+    for (const auto& c : centers)
+    {
+        const float p[] = {c.get<0>(), c.get<1>(), c.get<2>()};
+        for (int i = 0; i != 3; ++i)
+        {
+            low[i] = std::min(low[i], p[i]);
+            high[i] = std::max(high[i], p[i]);
+        }
+    }
+    // Using the same scale for all axes keeps the cells cubic.
+    const float extent = std::max(high[0] - low[0],
+                                  std::max(high[1] - low[1], high[2] - low[2]));
+    const float scale = extent > 0 ? 1 / extent : 0;
+
+    std::vector<Key> keys(count);
+#pragma omp parallel for
+    for (size_t i = 0; i < count; ++i)
+    {
+        const Point3f& c = centers[i];
+        keys[i] = Key(_mortonCode((c.get<0>() - low[0]) * scale,
+                                  (c.get<1>() - low[1]) * scale,
+                                  (c.get<2>() - low[2]) * scale),
+                      uint32_t(i));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    SegmentRecords sorted(count);
+#pragma omp parallel for
+    for (size_t i = 0; i < count; ++i)
+        sorted[i] = _records[keys[i].second];
+    _records.swap(sorted);
+
+    // Creating the nodes breadth first. The range of records of node i is
+    // ranges[i].
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    ranges.emplace_back(0, uint32_t(count));
+    _nodes.resize(1);
+    for (size_t i = 0; i < _nodes.size(); ++i)
+    {
+        const uint32_t begin = ranges[i].first;
+        const uint32_t end = ranges[i].second;
+        if (end - begin <= LeafSize)
+        {
+            _nodes[i].first = begin;
+            _nodes[i].count = end - begin;
+            continue;
+        }
+        const uint32_t split = _split(keys, begin, end);
+        _nodes[i].first = uint32_t(_nodes.size());
+        _nodes[i].count = 0;
+        ranges.emplace_back(begin, split);
+        ranges.emplace_back(split, end);
+        _nodes.resize(_nodes.size() + 2);
+    }
+
+    // Computing the bounding boxes of the leaves in parallel and then the
+    // internal nodes bottom up, children always come after their parent.
+#pragma omp parallel for
+    for (size_t i = 0; i < _nodes.size(); ++i)
+    {
+        Node& node = _nodes[i];
+        if (node.count == 0)
+            continue;
+        std::fill(node.min, node.min + 3, std::numeric_limits<float>::max());
+        std::fill(node.max, node.max + 3, std::numeric_limits<float>::lowest());
+        for (uint32_t j = node.first; j != node.first + node.count; ++j)
+        {
+            const Segment& segment = _records[j].segment;
+            const float p[] = {float(segment.first.get<0>()),
+                               float(segment.first.get<1>()),
+                               float(segment.first.get<2>())};
+            const float q[] = {float(segment.second.get<0>()),
+                               float(segment.second.get<1>()),
+                               float(segment.second.get<2>())};
+            for (int k = 0; k != 3; ++k)
+            {
+                node.min[k] = std::min(node.min[k], std::min(p[k], q[k]));
+                node.max[k] = std::max(node.max[k], std::max(p[k], q[k]));
+            }
+        }
+    }
+    for (size_t i = _nodes.size(); i-- != 0;)
+    {
+        Node& node = _nodes[i];
+        if (node.count != 0)
+            continue;
+        const Node& left = _nodes[node.first];
+        const Node& right = _nodes[node.first + 1];
+        for (int k = 0; k != 3; ++k)
+        {
+            node.min[k] = std::min(left.min[k], right.min[k]);
+            node.max[k] = std::max(left.max[k], right.max[k]);
+        }
+    }
+}
+
+void SegmentIndex::nearest(const Point3f& point, const size_t k,
+                           SegmentRecords& output, const float epsilon) const
+{
+    output.clear();
+    if (_nodeCount == 0 || k == 0)
+        return;
+
+    // The nodes to visit are kept in a min-heap by distance to the point and
+    // the candidate records in a buffer of capacity 2k, which is cut down to
+    // the k nearest when full. Both store squared distances and indices.
+    using Candidate = std::pair<float, uint32_t>;
+    static thread_local std::vector<Candidate> candidates;
+    static thread_local std::vector<Candidate> queue;
+    candidates.clear();
+    queue.clear();
+
+    // Nodes farther than the k-th candidate divided by 1 + epsilon are
+    // pruned.
+    const float shrinkage = 1 / ((1 + epsilon) * (1 + epsilon));
+    float bound = std::numeric_limits<float>::max();
+    float nodeBound = bound;
+    const auto shrink = [k, shrinkage, &bound, &nodeBound]() {
+        std::nth_element(candidates.begin(), candidates.begin() + (k - 1),
+                         candidates.end());
+        candidates.resize(k);
+        bound = candidates.back().first;
+        nodeBound = bound * shrinkage;
+    };
+    const auto farther = [](const Candidate& a, const Candidate& b) {
+        return a > b;
+    };
+
+    const float p[] = {point.get<0>(), point.get<1>(), point.get<2>()};
+    queue.emplace_back(_squaredDistance(_nodeData[0], p), 0);
+    while (!queue.empty())
+    {
+        std::pop_heap(queue.begin(), queue.end(), farther);
+        const Candidate next = queue.back();
+        queue.pop_back();
+        // All the remaining nodes are farther than the k-th candidate.
+        if (next.first > nodeBound)
+            break;
+
+        const Node& node = _nodeData[next.second];
+        if (node.count != 0)
+        {
+            for (uint32_t i = node.first; i != node.first + node.count; ++i)
+            {
+                const float distance = squaredDistance(_recordData[i], point);
+                if (distance > bound)
+                    continue;
+                candidates.emplace_back(distance, i);
+                if (candidates.size() == 2 * k)
+                    shrink();
+            }
+            continue;
+        }
+
+        for (uint32_t child = node.first; child != node.first + 2; ++child)
+        {
+            const float distance = _squaredDistance(_nodeData[child], p);
+            if (distance <= nodeBound)
+            {
+                queue.emplace_back(distance, child);
+                std::push_heap(queue.begin(), queue.end(), farther);
+            }
+        }
+    }
+
+    if (candidates.size() > k)
+        shrink();
+    std::iter_swap(candidates.begin(),
+                   std::min_element(candidates.begin(), candidates.end()));
+    output.reserve(candidates.size());
+    for (const auto& candidate : candidates)
+        output.push_back(_recordData[candidate.second]);
+}
+
+void SegmentIndex::withinDistance(const Point3f& point, const float radius,
+                                  SegmentRecords& output) const
+{
+    output.clear();
+    if (_nodeCount == 0)
+        return;
+
+    static thread_local std::vector<uint32_t> stack;
+    stack.clear();
+
+    const float p[] = {point.get<0>(), point.get<1>(), point.get<2>()};
+    const float squaredRadius = radius * radius;
+    stack.push_back(0);
+    while (!stack.empty())
+    {
+        const Node& node = _nodeData[stack.back()];
+        stack.pop_back();
+        if (_squaredDistance(node, p) > squaredRadius)
+            continue;
+
+        if (node.count == 0)
+        {
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+            continue;
+        }
+        for (uint32_t i = node.first; i != node.first + node.count; ++i)
+        {
+            if (squaredDistance(_recordData[i], point) <= squaredRadius)
+                output.push_back(_recordData[i]);
+        }
+    }
+}
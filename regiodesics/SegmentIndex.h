@@ -0,0 +1,78 @@
+#ifndef REGIODESICS_SEGMENTINDEX_H
+#define REGIODESICS_SEGMENTINDEX_H
+
+#include "kernels.h"
+#include "types.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Static bounding volume hierarchy of segments specialized for point queries.
+// The records are sorted along a Morton curve and the nodes are stored
+// breadth first in a single array, the two children of an internal node
+// being contiguous.
+class SegmentIndex
+{
+public:
+    SegmentIndex() = default;
+    explicit SegmentIndex(SegmentRecords records);
+
+    // Loads an index written by save(). The file is mapped read-only where
+    // mmap is available and queried in place, without any copy.
+    explicit SegmentIndex(const std::string& filename);
+
+    SegmentIndex(const SegmentIndex&) = delete;
+    SegmentIndex& operator=(const SegmentIndex&) = delete;
+    SegmentIndex(SegmentIndex&&) = default;
+    SegmentIndex& operator=(SegmentIndex&&) = default;
+
+    // Writes the nodes and the records as they are in memory, in a file
+    // that can only be loaded on hosts with the same byte order.
+    void save(const std::string& filename) const;
+
+    size_t size() const { return _recordCount; }
+    bool empty() const { return _recordCount == 0; }
+
+    // The size() records in index order.
+    const SegmentRecord* records() const { return _recordData; }
+
+    // Stores in output the k nearest records to the point, the first one
+    // being the nearest. With epsilon > 0 the search is (1 + epsilon)
+    // approximate, the i-th record found is at most (1 + epsilon) times
+    // farther than the true i-th nearest one.
+    void nearest(const Point3f& point, size_t k, SegmentRecords& output,
+                 float epsilon = 0) const;
+
+    // Stores in output all the records at distance <= radius of the point.
+    void withinDistance(const Point3f& point, float radius,
+                        SegmentRecords& output) const;
+
+private:
+    struct Node
+    {
+        float min[3];
+        float max[3];
+        // Index of the first child for internal nodes and of the first record
+        // for leaves.
+        uint32_t first;
+        // Number of records, 0 for internal nodes.
+        uint32_t count;
+    };
+
+    // The nodes and records of a built index, empty for a loaded one.
+    std::vector<Node> _nodes;
+    SegmentRecords _records;
+    // Mapping or buffer of a loaded index.
+    std::shared_ptr<const char> _file;
+    // Nodes and records queried, from the vectors or the file.
+    const Node* _nodeData = nullptr;
+    size_t _nodeCount = 0;
+    const SegmentRecord* _recordData = nullptr;
+    size_t _recordCount = 0;
+
+    void _build();
+};
+
+#endif
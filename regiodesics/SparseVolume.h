@@ -0,0 +1,436 @@
+#ifndef REGIODESICS_SPARSEVOLUME_H
+#define REGIODESICS_SPARSEVOLUME_H
+
+#include "Volume.h"
+#include "types.h"
+
+#include "nrrd.hxx"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Run of consecutive active voxels of a row of a sparse volume.
+struct SparseRun
+{
+    uint32_t begin;
+    uint32_t end;
+    // Index of the value of the voxel begin.
+    uint64_t offset;
+};
+
+// Active voxels of sparse volumes, shared by the volumes created from the
+// same one.
+struct SparseLayout
+{
+    size_t width = 0;
+    size_t height = 0;
+    size_t depth = 0;
+    // Number of active voxels.
+    size_t size = 0;
+    // Index of the first run of each row, plus the total number of runs.
+    std::vector<uint64_t> rows;
+    std::vector<SparseRun> runs;
+
+    template <typename U, typename Storage, typename Predicate>
+    void build(const Volume<U, Storage>& volume, const Predicate& active)
+    {
+        std::tie(width, height, depth) = volume.dimensions();
+        if (width >= std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("Volume too wide");
+
+        // Each z slice is scanned in parallel and the runs are then
+        // concatenated.
+        std::vector<std::vector<SparseRun>> slices(depth);
+        std::vector<std::vector<uint64_t>> sliceRows(depth);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t z = 0; z < depth; ++z)
+        {
+            auto& sliceRuns = slices[z];
+            auto& rowRuns = sliceRows[z];
+            size_t count = 0;
+            for (size_t y = 0; y != height; ++y)
+            {
+                rowRuns.push_back(sliceRuns.size());
+                for (size_t x = 0; x != width;)
+                {
+                    if (!active(volume(x, y, z)))
+                    {
+                        ++x;
+                        continue;
+                    }
+                    SparseRun run{uint32_t(x), 0, count};
+                    while (x != width && active(volume(x, y, z)))
+                        ++x;
+                    run.end = uint32_t(x);
+                    count += run.end - run.begin;
+                    sliceRuns.push_back(run);
+                }
+            }
+        }
+
+        rows.reserve(height * depth + 1);
+        for (size_t z = 0; z != depth; ++z)
+        {
+            for (const auto first : sliceRows[z])
+                rows.push_back(runs.size() + first);
+            for (auto run : slices[z])
+            {
+                run.offset += size;
+                runs.push_back(run);
+            }
+            if (!slices[z].empty())
+            {
+                const SparseRun& last = slices[z].back();
+                size += last.offset + last.end - last.begin;
+            }
+            std::vector<SparseRun>().swap(slices[z]);
+        }
+        rows.push_back(runs.size());
+    }
+
+    const SparseRun* find(size_t x, size_t y, size_t z) const
+    {
+        assert(x < width);
+        assert(y < height);
+        assert(z < depth);
+        const size_t row = z * height + y;
+        const SparseRun* begin = runs.data() + rows[row];
+        const SparseRun* end = runs.data() + rows[row + 1];
+        // Rows of the shells usually contain one or two runs.
+        const SparseRun* run =
+            std::upper_bound(begin, end, x, [](size_t v, const SparseRun& r) {
+                return v < r.end;
+            });
+        return run != end && run->begin <= x ? run : nullptr;
+    }
+
+    template <typename Functor>
+    void forEachRun(const Functor& functor) const
+    {
+        for (size_t z = 0; z != depth; ++z)
+            for (size_t y = 0; y != height; ++y)
+            {
+                const size_t row = z * height + y;
+                for (uint64_t i = rows[row]; i != rows[row + 1]; ++i)
+                    functor(y, z, runs[i]);
+            }
+    }
+};
+
+// Volume that only stores the values of a set of active voxels. Voxels not
+// active have the background value.
+// The active voxels of each row (y, z) are stored as runs of consecutive x
+// in compressed sparse row format: the runs of row r are
+// runs()[rowBegin(r), rowBegin(r + 1)). The values of a run are contiguous
+// and the runs are stored in the same order as the voxels of a dense volume,
+// so the values of all the voxels are visited in storage order.
+// Volumes created from another one share its layout of runs.
+template <typename T>
+class SparseVolume
+{
+public:
+    using Run = SparseRun;
+
+    // Creates a volume with the dimensions of the input volume whose active
+    // voxels are those for which active(value) is true. The values of the
+    // active voxels are initialized to background.
+    template <typename U, typename Storage, typename Predicate>
+    SparseVolume(const Volume<U, Storage>& volume, const Predicate& active,
+                 const T& background, const StringMap& metadata = StringMap())
+        : _layout(std::make_shared<SparseLayout>())
+        , _background(background)
+        , _metadata(metadata)
+    {
+        _layout->build(volume, active);
+        _values.resize(_layout->size, background);
+        _fillMetadata();
+    }
+
+    // Creates a volume with the same active voxels as another one.
+    template <typename U>
+    SparseVolume(const SparseVolume<U>& other, const T& background,
+                 const StringMap& metadata = StringMap())
+        : _layout(other._layout)
+        , _values(_layout->size, background)
+        , _background(background)
+        , _metadata(metadata)
+    {
+        _fillMetadata();
+    }
+
+    // Loads a volume saved with saveSparse.
+    explicit SparseVolume(const std::string& filename);
+
+    SparseVolume(SparseVolume&&) = default;
+    SparseVolume(const SparseVolume&) = delete;
+    SparseVolume& operator=(const SparseVolume&) = delete;
+
+    size_t width() const { return _layout->width; }
+    size_t height() const { return _layout->height; }
+    size_t depth() const { return _layout->depth; }
+    std::tuple<size_t, size_t, size_t> dimensions() const
+    {
+        return std::make_tuple(width(), height(), depth());
+    }
+
+    // Number of active voxels.
+    size_t size() const { return _values.size(); }
+
+    // Bytes used by the values and the runs, the latter being shared between
+    // all the volumes with the same layout.
+    size_t memoryUsage() const
+    {
+        return sizeof(T) * _values.size() +
+               sizeof(Run) * _layout->runs.size() +
+               sizeof(uint64_t) * _layout->rows.size();
+    }
+
+    const T& background() const { return _background; }
+
+    const std::vector<Run>& runs() const { return _layout->runs; }
+    // Index of the first run of the row y + z * height.
+    size_t rowBegin(const size_t row) const { return _layout->rows[row]; }
+
+    T* data() { return _values.data(); }
+    const T* data() const { return _values.data(); }
+
+    // Returns the value of a voxel if active, null otherwise.
+    T* find(size_t x, size_t y, size_t z)
+    {
+        const Run* run = _layout->find(x, y, z);
+        return run ? &_values[run->offset + x - run->begin] : nullptr;
+    }
+
+    const T* find(size_t x, size_t y, size_t z) const
+    {
+        const Run* run = _layout->find(x, y, z);
+        return run ? &_values[run->offset + x - run->begin] : nullptr;
+    }
+
+    // Access to the value of an active voxel.
+    T& operator()(size_t x, size_t y, size_t z)
+    {
+        T* value = find(x, y, z);
+        assert(value);
+        return *value;
+    }
+
+    // Value of any voxel, the background value if not active.
+    T operator()(size_t x, size_t y, size_t z) const
+    {
+        const T* value = find(x, y, z);
+        return value ? *value : _background;
+    }
+
+    // Calls functor(x, y, z, value) for the active voxels in storage order.
+    template <typename Functor>
+    void visit(const Functor& functor) const
+    {
+        _layout->forEachRun([&](size_t y, size_t z, const Run& run) {
+            for (size_t x = run.begin; x != run.end; ++x)
+                functor(x, y, z, _values[run.offset + x - run.begin]);
+        });
+    }
+
+    // Assigns functor(x, y, z, value) to the active voxels in storage order.
+    template <typename Functor>
+    void apply(const Functor& functor)
+    {
+        _layout->forEachRun([&](size_t y, size_t z, const Run& run) {
+            for (size_t x = run.begin; x != run.end; ++x)
+            {
+                T& v = _values[run.offset + x - run.begin];
+                v = functor(x, y, z, v);
+            }
+        });
+    }
+
+    Volume<T> dense() const
+    {
+        Volume<T> volume(width(), height(), depth(), _metadata);
+        volume.set(_background);
+        visit([&volume](size_t x, size_t y, size_t z, const T& value) {
+            volume(x, y, z) = value;
+        });
+        return volume;
+    }
+
+    const StringMap& metadata() const { return _metadata; }
+    // Write access, use with caution
+    StringMap& metadata() { return _metadata; }
+
+    // Saves the volume as a dense NRRD file. The file is written one z
+    // slice at a time, so the dense volume is never allocated.
+    void save(const std::string& filename,
+              VolumeEncoding encoding = VolumeEncoding::raw) const;
+
+    // Saves the volume in the sparse format read by the file constructor.
+    void saveSparse(const std::string& filename) const;
+
+private:
+    template <typename U>
+    friend class SparseVolume;
+
+    using Traits = VolumeTraits<T>;
+    using Scalar = typename Traits::Scalar;
+
+    std::shared_ptr<SparseLayout> _layout;
+    std::vector<T> _values;
+    T _background;
+    StringMap _metadata;
+
+    void _fillMetadata() { Traits::fillMetadata(_metadata); }
+};
+
+template <typename T>
+void SparseVolume<T>::save(const std::string& filename,
+                           const VolumeEncoding encoding) const
+{
+    VolumeWriter<T> writer(filename, depth(), encoding);
+    Volume<T> slice(width(), height(), 1, _metadata);
+    for (size_t z = 0; z != depth(); ++z)
+    {
+        slice.set(_background);
+        for (size_t y = 0; y != height(); ++y)
+        {
+            const size_t row = z * height() + y;
+            for (uint64_t i = _layout->rows[row]; i != _layout->rows[row + 1];
+                 ++i)
+            {
+                const Run& run = _layout->runs[i];
+                std::copy(_values.begin() + run.offset,
+                          _values.begin() + run.offset + run.end - run.begin,
+                          &slice(size_t(run.begin), y, size_t(0)));
+            }
+        }
+        writer.write(slice);
+    }
+    writer.close();
+}
+
+// The sparse format starts with a text header similar to the NRRD one:
+//   REGIODESICS_SPARSE0001
+//   type: <scalar type>
+//   components: <scalars per voxel>
+//   sizes: <width> <height> <depth>
+//   runs: <number of runs>
+//   voxels: <number of active voxels>
+//   endian: little
+//   <metadata key>: <value>
+//   <blank line>
+// followed by the binary background value, row offsets, runs and values.
+template <typename T>
+void SparseVolume<T>::saveSparse(const std::string& filename) const
+{
+    if (NRRD::is_cpu_BIG_endian())
+        throw std::runtime_error("Big endian systems are not supported");
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("Error opening " + filename);
+
+    out << "REGIODESICS_SPARSE0001\n"
+        << "type: " << typeName<Scalar>() << "\n"
+        << "components: " << Traits::components << "\n"
+        << "sizes: " << width() << " " << height() << " " << depth() << "\n"
+        << "runs: " << _layout->runs.size() << "\n"
+        << "voxels: " << _values.size() << "\n"
+        << "endian: little\n";
+    for (const auto& pair : _metadata)
+    {
+        if (pair.second.find('\n') == std::string::npos)
+            out << pair.first << ": " << pair.second << "\n";
+    }
+    out << "\n";
+
+    out.write((const char*)&_background, sizeof(T));
+    out.write((const char*)_layout->rows.data(),
+              sizeof(uint64_t) * _layout->rows.size());
+    out.write((const char*)_layout->runs.data(),
+              sizeof(Run) * _layout->runs.size());
+    out.write((const char*)_values.data(), sizeof(T) * _values.size());
+    if (!out)
+        throw std::runtime_error("Error writing " + filename);
+}
+
+template <typename T>
+SparseVolume<T>::SparseVolume(const std::string& filename)
+    : _layout(std::make_shared<SparseLayout>())
+{
+    std::ifstream in(filename, std::ios::binary);
+    std::string line;
+    if (!std::getline(in, line) || line != "REGIODESICS_SPARSE0001")
+        throw std::runtime_error("Error parsing " + filename +
+                                 ": not a sparse volume");
+    StringMap header;
+    while (std::getline(in, line) && !line.empty())
+    {
+        const auto pos = line.find(": ");
+        if (pos == std::string::npos)
+            throw std::runtime_error("Error parsing " + filename +
+                                     ": invalid header line " + line);
+        header[line.substr(0, pos)] = line.substr(pos + 2);
+    }
+
+    if (header["type"] != typeName<Scalar>() ||
+        std::atoi(header["components"].c_str()) != Traits::components)
+    {
+        throw std::runtime_error("Unexpected volume type: " + header["type"] +
+                                 " with " + header["components"] +
+                                 " components");
+    }
+    if (header["endian"] != "little" || NRRD::is_cpu_BIG_endian())
+        throw std::runtime_error("Big endian volumes are not supported");
+
+    SparseLayout& layout = *_layout;
+    std::stringstream(header["sizes"]) >> layout.width >> layout.height >>
+        layout.depth;
+    size_t runCount = 0;
+    std::stringstream(header["runs"]) >> runCount;
+    std::stringstream(header["voxels"]) >> layout.size;
+    for (const auto key : {"type", "components", "sizes", "runs", "voxels",
+                           "endian"})
+        header.erase(key);
+    _metadata = header;
+
+    layout.rows.resize(layout.height * layout.depth + 1);
+    layout.runs.resize(runCount);
+    _values.resize(layout.size);
+    in.read((char*)&_background, sizeof(T));
+    in.read((char*)layout.rows.data(), sizeof(uint64_t) * layout.rows.size());
+    in.read((char*)layout.runs.data(), sizeof(Run) * runCount);
+    in.read((char*)_values.data(), sizeof(T) * layout.size);
+    if (!in)
+        throw std::runtime_error("Error reading " + filename);
+
+    // Checking the layout so that find never reads out of bounds.
+    bool valid = layout.rows.front() == 0 && layout.rows.back() == runCount;
+    uint64_t offset = 0;
+    for (size_t row = 0; valid && row + 1 < layout.rows.size(); ++row)
+    {
+        valid = layout.rows[row] <= layout.rows[row + 1];
+        uint32_t previous = 0;
+        for (uint64_t i = layout.rows[row];
+             valid && i != layout.rows[row + 1]; ++i)
+        {
+            const Run& run = layout.runs[i];
+            valid = run.begin >= previous && run.begin < run.end &&
+                    run.end <= layout.width && run.offset == offset;
+            offset += run.end - run.begin;
+            previous = run.end;
+        }
+    }
+    if (!valid || offset != layout.size)
+        throw std::runtime_error("Error parsing " + filename +
+                                 ": invalid runs");
+}
+
+#endif
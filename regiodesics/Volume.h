@@ -1,6 +1,7 @@
 #ifndef REGIODESICS_VOLUME_H
 #define REGIODESICS_VOLUME_H
 
+#include "VolumeStorage.h"
 #include "types.h"
 
 #include "nrrd.hxx"
@@ -10,23 +11,132 @@
 #include <boost/geometry/index/rtree.hpp>
 
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <memory>
 #include <regex>
+#include <sstream>
 #include <tuple>
 #include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define REGIODESICS_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// How the file constructor of Volume accesses the data.
+enum class VolumeLoading
+{
+    // Allocates the volume and reads the whole file.
+    read,
+    // Maps the file read-only. Loading is immediate, only the pages touched
+    // are read and they are shared with the other processes mapping the
+    // file. The volume must not be modified.
+    map,
+    // Maps the file copy-on-write. The pages modified are private to the
+    // volume and the file is never written.
+    mapPrivate
+};
 
+// Encoding of the data of saved NRRD files.
+enum class VolumeEncoding
+{
+    raw,
+    // Compressed in parallel, see nrrd/gzip.hxx.
+    gzip
+};
+
+// Returns the type of the values of a NRRD file, as named by typeName, so
+// that the file can be loaded with its own type.
+inline std::string readVolumeType(const std::string& filename)
+{
+    const std::string type = NRRD::getDataType(filename);
+    if (type.empty())
+        throw std::runtime_error("Error parsing " + filename +
+                                 ": missing or unreadable type");
+    return type;
+}
+
+// Type dependent properties of volumes: the scalar type and number of
+// components of the values in NRRD files, and the metadata checked when
+// loading and filled when creating a volume.
 template <typename T>
+struct VolumeTraits
+{
+    using Scalar = T;
+    static const int components = 1;
+
+    static void checkMetadata(StringMap& metadata)
+    {
+        const auto& type = metadata["type"];
+        if (type != typeName<T>())
+            throw std::runtime_error("Unexpected volume type: " + type +
+                                     " was provided whereas " +
+                                     typeName<T>() + " was expected.");
+        const auto& dims = metadata["dimension"];
+        if (std::atoi(dims.c_str()) != 3)
+            throw std::runtime_error("Invalid dimensions: " + dims);
+    }
+
+    static void fillMetadata(StringMap& metadata)
+    {
+        metadata["space dimension"] = "3";
+        metadata["kinds"] = "domain domain domain";
+    }
+};
+
+template <typename T, size_t N>
+struct VolumeTraits<PointTN<T, N>>
+{
+    using Scalar = T;
+    static const int components = N;
+
+    static void checkMetadata(StringMap& metadata)
+    {
+        const auto& type = metadata["type"];
+        if (type != typeName<T>())
+            throw std::runtime_error("Unexpected volume type: " + type);
+        const auto& dims = metadata["dimension"];
+        if (std::atoi(dims.c_str()) != 4)
+            throw std::runtime_error("Invalid dimensions: " + dims);
+        std::stringstream sizes(metadata["sizes"]);
+        size_t first;
+        sizes >> first;
+        if (first != N)
+            throw std::runtime_error("Invalid size in first dimension");
+        std::getline(sizes, metadata["sizes"]);
+    }
+
+    static void fillMetadata(StringMap& metadata)
+    {
+        metadata["kinds"] = "vector domain domain domain";
+        metadata["space dimension"] = "3";
+    }
+};
+
+// The storage policy defines the layout of the values in memory, see
+// VolumeStorage.h. Files are always in the linear layout, and converted
+// while loading and saving.
+template <typename T, typename Storage = LinearStorage>
 class Volume
 {
 public:
+    using Value = T;
     using Index =
         boost::geometry::index::rtree<Coords,
                                       boost::geometry::index::linear<5>>;
 
     Volume(size_t width, size_t height, size_t depth,
            const StringMap& metadata = StringMap())
-        // The storage is in colume-major order
-        : _data(new T[width * height * depth])
+        : _storage(width, height, depth)
+        , _data(new T[_storage.size()], std::default_delete<T[]>())
         , _width(width)
         , _height(height)
         , _depth(depth)
@@ -37,7 +147,8 @@ public:
     }
 
     Volume(Volume&& volume)
-        : _data(std::move(volume._data))
+        : _storage(std::move(volume._storage))
+        , _data(std::move(volume._data))
         , _width(volume._width)
         , _height(volume._height)
         , _depth(volume._depth)
@@ -47,44 +158,65 @@ public:
             _axes[i] = volume._axes[i];
     }
 
-    Volume(const std::string& filename)
+    // Loads a raw or gzip NRRD file, with attached or detached data. Big
+    // endian data is converted. The file is read instead of mapped if it is
+    // not raw little endian, the storage is not linear, the data is not
+    // aligned for T or mmap is not available.
+    Volume(const std::string& filename,
+           const VolumeLoading loading = VolumeLoading::read)
     {
         size_t headerSize = 0;
         std::map<std::string, std::string> dataInfo;
-        headerSize = NRRD::parseHeader(filename, dataInfo);
+        std::map<std::string, std::string> keys;
+        headerSize = NRRD::parseHeader(filename, dataInfo, &keys);
         if (headerSize == 0)
             throw std::runtime_error("Error parsing " + filename +
                                      ": error reading header");
         _parseCoordinateSystem(dataInfo);
 
-        _checkMetadata(dataInfo);
+        Traits::checkMetadata(dataInfo);
 
+        // Detached data files start with the data.
         std::string dataFile = filename;
-        if (dataInfo.count("datafile") > 0)
+        size_t dataOffset = headerSize;
+        const auto detached = dataInfo.count("data file") > 0
+                                  ? dataInfo["data file"]
+                                  : dataInfo["datafile"];
+        if (!detached.empty())
         {
             boost::filesystem::path dataFilePath =
                 boost::filesystem::path(filename).parent_path();
-            dataFilePath /= dataInfo["datafile"];
+            dataFilePath /= detached;
             dataFile = dataFilePath.string();
+            dataOffset = 0;
         }
 
-        if (dataInfo["endian"] != "little" && dataInfo["type"] != "char" &&
-            dataInfo["type"] != "unsigned char")
-        {
-            throw std::runtime_error("Big endian volumes are not supported");
-        }
+        const auto encoding = dataInfo["encoding"];
+        const bool gzip = encoding == "gzip" || encoding == "gz";
+        if (!encoding.empty() && encoding != "raw" && !gzip)
+            throw std::runtime_error("Unsupported encoding: " + encoding);
+
+        const bool bigEndian = dataInfo["endian"] == "big";
+        const bool swap =
+            sizeof(Scalar) > 1 && bigEndian != NRRD::is_cpu_BIG_endian();
 
         std::stringstream dims(dataInfo["sizes"]);
         dims >> _width >> _height >> _depth;
-        const size_t size = _width * _height * _depth;
         if (dims.fail())
             throw std::runtime_error("Error parsing volume size");
 
-        std::fstream inFile;
-        inFile.open(filename, std::ios::in | std::ios::binary);
-        inFile.seekg(headerSize);
-        _data.reset(new T[size]);
-        inFile.read((char*)_data.get(), sizeof(T) * size);
+        _storage = Storage(_width, _height, _depth);
+        if (loading != VolumeLoading::read && Storage::linear && !gzip &&
+            !swap)
+        {
+            _data = _mapFile(dataFile, dataOffset,
+                             loading == VolumeLoading::mapPrivate);
+        }
+        if (!_data && gzip)
+            _readCompressedFile(dataFile, dataOffset, keys["gzip blocks"],
+                                swap);
+        else if (!_data)
+            _readFile(dataFile, dataOffset, swap);
 
         for (auto key : {"space", "space directions", "space origin"})
         {
@@ -95,21 +227,115 @@ public:
         _fillMetadata();
     }
 
+    // Converts a volume from another storage.
+    template <typename OtherStorage>
+    explicit Volume(const Volume<T, OtherStorage>& other)
+        : Volume(other.width(), other.height(), other.depth(),
+                 other.metadata())
+    {
+        _storage.forEachVoxel([this, &other](size_t x, size_t y, size_t z) {
+            (*this)(x, y, z) = other(x, y, z);
+        });
+    }
+
     Volume(const Volume&) = delete;
     Volume& operator=(const Volume&) = delete;
 
-    Volume<T> copy() const
+    // The copy of a view only has the values of the view.
+    Volume copy() const
     {
-        Volume<T> other(_width, _height, _depth, _metadata);
-        memcpy(other._data.get(), _data.get(),
-               sizeof(T) * _width * _height * _depth);
+        Volume other(_width, _height, _depth, _metadata);
+        if (_storage.contiguous())
+            memcpy(other._data.get(), _data.get(),
+                   sizeof(T) * _storage.size());
+        else
+            _storage.forEachVoxel([this, &other](size_t x, size_t y,
+                                                 size_t z) {
+                other(x, y, z) = (*this)(x, y, z);
+            });
         return other;
     }
 
-    void save(const std::string& filename) const
+    // Returns a view of the box of width x height x depth voxels starting at
+    // (x, y, z): a volume sharing the values of this one, so that algorithms
+    // only process the box without copying it. Writing to the view writes to
+    // this volume, which is why const volumes have no views, and views of
+    // volumes mapped read-only must not be modified either. The space origin
+    // is moved to the first voxel of the box.
+    Volume view(const size_t x, const size_t y, const size_t z,
+                const size_t width, const size_t height, const size_t depth)
     {
-        int dims[] = {int(_width), int(_height), int(_depth)};
-        NRRD::save<T>(filename, _data.get(), 3, dims, {}, _metadata);
+        static_assert(Storage::linear, "Only linear volumes have views");
+        if (x + width > _width || y + height > _height || z + depth > _depth)
+            throw std::invalid_argument("View out of the volume");
+        return Volume(*this, x, y, z, width, height, depth);
+    }
+
+    void save(const std::string& filename,
+              const VolumeEncoding encoding = VolumeEncoding::raw) const
+    {
+        static_assert(sizeof(T) == sizeof(Scalar) * Traits::components,
+                      "Unexpected voxel layout");
+        std::vector<int> dims;
+        if (Traits::components != 1)
+            dims.push_back(int(Traits::components));
+        dims.push_back(int(_width));
+        dims.push_back(int(_height));
+        dims.push_back(int(_depth));
+        auto fields = _metadata;
+        fields["encoding"] =
+            encoding == VolumeEncoding::gzip ? "gzip" : "raw";
+        if (Storage::linear && _storage.contiguous())
+        {
+            if (!NRRD::save<Scalar>(filename, (const Scalar*)_data.get(),
+                                    int(dims.size()), dims.data(), {},
+                                    fields))
+            {
+                throw std::runtime_error("Error writing " + filename);
+            }
+            return;
+        }
+
+        // Gathering and writing one z slice at a time, also for views. The
+        // compressed data is written after the header, which lists its
+        // blocks. Like NRRD::save, the file is written under a temporary
+        // name and renamed, so that a volume mapped from the file can be
+        // saved over it.
+        const auto temporary = NRRD::temporaryName(filename);
+        std::ofstream out(temporary, std::ios::binary);
+        NRRD::GzipWriter gzip;
+        if (encoding == VolumeEncoding::raw)
+            NRRD::writeHeader<Scalar>(out, int(dims.size()), dims.data(), {},
+                                      fields);
+        std::vector<T> slice(_width * _height);
+        for (size_t z = 0; z != _depth; ++z)
+        {
+            for (size_t y = 0; y != _height; ++y)
+                for (size_t x = 0; x != _width; ++x)
+                    slice[y * _width + x] = (*this)(x, y, z);
+            if (encoding == VolumeEncoding::raw)
+                out.write((const char*)slice.data(),
+                          sizeof(T) * slice.size());
+            else
+                gzip.write((const char*)slice.data(),
+                           sizeof(T) * slice.size());
+        }
+        if (encoding == VolumeEncoding::gzip)
+        {
+            const auto& compressed = gzip.finish();
+            NRRD::writeHeader<Scalar>(out, int(dims.size()), dims.data(),
+                                      {{"gzip blocks", gzip.blocks()}},
+                                      fields);
+            out.write(compressed.data(), compressed.size());
+        }
+        out.close();
+        if (!out)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Error writing " + filename);
+        }
+        if (!NRRD::replaceFile(temporary, filename))
+            throw std::runtime_error("Error writing " + filename);
     }
 
     std::tuple<size_t, size_t, size_t> dimensions() const
@@ -125,35 +351,23 @@ public:
         apply([value](size_t, size_t, size_t, const T&) { return value; });
     }
 
+    // Calls functor(x, y, z, value) for all the voxels in storage order.
     template <typename Functor>
     void visit(const Functor& functor) const
     {
-        for (size_t z = 0; z != _depth; ++z)
-        {
-            for (size_t y = 0; y != _height; ++y)
-            {
-                for (size_t x = 0; x != _width; ++x)
-                {
-                    functor(x, y, z, operator()(x, y, z));
-                }
-            }
-        }
+        _storage.forEachVoxel([this, &functor](size_t x, size_t y, size_t z) {
+            functor(x, y, z, operator()(x, y, z));
+        });
     }
 
+    // Assigns functor(x, y, z, value) to all the voxels in storage order.
     template <typename Functor>
     void apply(const Functor& functor)
     {
-        for (size_t z = 0; z != _depth; ++z)
-        {
-            for (size_t y = 0; y != _height; ++y)
-            {
-                for (size_t x = 0; x != _width; ++x)
-                {
-                    T& v = operator()(x, y, z);
-                    v = functor(x, y, z, v);
-                }
-            }
-        }
+        _storage.forEachVoxel([this, &functor](size_t x, size_t y, size_t z) {
+            T& v = operator()(x, y, z);
+            v = functor(x, y, z, v);
+        });
     }
 
     Index createIndex(T& value) const
@@ -170,12 +384,14 @@ public:
 
     T& operator()(const Coords& coords)
     {
-        return operator()(coords.get<0>(), coords.get<1>(), coords.get<2>());
+        return operator()(size_t(coords.get<0>()), size_t(coords.get<1>()),
+                          size_t(coords.get<2>()));
     }
 
     const T& operator()(const Coords& coords) const
     {
-        return operator()(coords.get<0>(), coords.get<1>(), coords.get<2>());
+        return operator()(size_t(coords.get<0>()), size_t(coords.get<1>()),
+                          size_t(coords.get<2>()));
     }
 
     template <typename U>
@@ -215,7 +431,7 @@ public:
         assert(x < _width);
         assert(y < _height);
         assert(z < _depth);
-        return _data[z * _width * _height + y * _width + x];
+        return _data.get()[_storage.index(x, y, z)];
     }
 
     const T& operator()(size_t x, size_t y, size_t z) const
@@ -223,7 +439,7 @@ public:
         assert(x < _width);
         assert(y < _height);
         assert(z < _depth);
-        return _data[z * _width * _height + y * _width + x];
+        return _data.get()[_storage.index(x, y, z)];
     }
 
     const std::map<std::string, std::string>& metadata() const
@@ -235,13 +451,58 @@ public:
     std::map<std::string, std::string>& metadata() { return _metadata; }
     const Point3f& volumeAxis(size_t index) const { return _axes[index]; }
 
+    const Storage& storage() const { return _storage; }
+
 private:
-    std::unique_ptr<T[]> _data;
+    using Traits = VolumeTraits<T>;
+    using Scalar = typename Traits::Scalar;
+
+    Storage _storage;
+    // Allocated or mapped values.
+    std::shared_ptr<T> _data;
     size_t _width;
     size_t _height;
     size_t _depth;
     Point3f _axes[3];
 
+    // View of a box of the other volume.
+    Volume(const Volume& other, const size_t x, const size_t y,
+           const size_t z, const size_t width, const size_t height,
+           const size_t depth)
+        : _storage(other._storage, width, height, depth)
+        , _data(other._data, other._data.get() + other._storage.index(x, y, z))
+        , _width(width)
+        , _height(height)
+        , _depth(depth)
+        , _metadata(other._metadata)
+    {
+        for (int i = 0; i != 3; ++i)
+            _axes[i] = other._axes[i];
+        if (x == 0 && y == 0 && z == 0)
+            return;
+
+        // The origin is written as (x,y,z).
+        double origin[3] = {0, 0, 0};
+        std::string values = _metadata["space origin"];
+        for (char& c : values)
+            if (c == '(' || c == ')' || c == ',')
+                c = ' ';
+        std::istringstream in(values);
+        in >> origin[0] >> origin[1] >> origin[2];
+        const size_t offset[] = {x, y, z};
+        for (int i = 0; i != 3; ++i)
+        {
+            origin[0] += offset[i] * _axes[i].get<0>();
+            origin[1] += offset[i] * _axes[i].get<1>();
+            origin[2] += offset[i] * _axes[i].get<2>();
+        }
+        std::ostringstream out;
+        out.precision(std::numeric_limits<double>::max_digits10);
+        out << "(" << origin[0] << "," << origin[1] << "," << origin[2]
+            << ")";
+        _metadata["space origin"] = out.str();
+    }
+
     void _parseCoordinateSystem(
         const std::map<std::string, std::string>& metadata)
     {
@@ -287,80 +548,252 @@ private:
 #undef dot
     }
 
-    void _checkMetadata(std::map<std::string, std::string>& metadata);
+    void _readFile(const std::string& filename, const size_t offset,
+                   const bool swap)
+    {
+        std::fstream inFile;
+        inFile.open(filename, std::ios::in | std::ios::binary);
+        inFile.seekg(offset);
+        _data.reset(new T[_storage.size()], std::default_delete<T[]>());
+        if (Storage::linear)
+        {
+            inFile.read((char*)_data.get(), sizeof(T) * _storage.size());
+            if (swap)
+                _swap(_data.get(), _storage.size());
+        }
+        else
+        {
+            // Reading one z slice at a time and scattering it.
+            std::vector<T> slice(_width * _height);
+            for (size_t z = 0; z != _depth; ++z)
+            {
+                inFile.read((char*)slice.data(), sizeof(T) * slice.size());
+                if (swap)
+                    _swap(slice.data(), slice.size());
+                _scatter(slice.data(), z, 1);
+            }
+        }
+        if (!inFile)
+            throw std::runtime_error("Error reading " + filename);
+    }
+
+    void _readCompressedFile(const std::string& filename, const size_t offset,
+                             const std::string& blocks, const bool swap)
+    {
+        std::ifstream inFile(filename, std::ios::binary | std::ios::ate);
+        const size_t fileSize = inFile.tellg();
+        if (!inFile || fileSize < offset)
+            throw std::runtime_error("Error reading " + filename);
+        std::vector<char> compressed(fileSize - offset);
+        inFile.seekg(offset);
+        inFile.read(compressed.data(), compressed.size());
+
+        _data.reset(new T[_storage.size()], std::default_delete<T[]>());
+        const size_t size = _width * _height * _depth;
+        // Non linear storage is filled from a linear copy.
+        std::vector<T> linear(Storage::linear ? 0 : size);
+        T* values = Storage::linear ? _data.get() : linear.data();
+        if (!inFile || !NRRD::gunzip(compressed.data(), compressed.size(),
+                                     (char*)values, sizeof(T) * size, blocks))
+        {
+            throw std::runtime_error("Error decompressing " + filename);
+        }
+        if (swap)
+            _swap(values, size);
+        if (!Storage::linear)
+            _scatter(values, 0, _depth);
+    }
+
+    // Copies z planes [z, z + depth) stored in linear order.
+    void _scatter(const T* values, const size_t z, const size_t depth)
+    {
+        for (size_t k = 0; k != depth; ++k)
+            for (size_t y = 0; y != _height; ++y)
+                for (size_t x = 0; x != _width; ++x)
+                    (*this)(x, y, z + k) =
+                        values[(k * _height + y) * _width + x];
+    }
+
+    static void _swap(T* values, const size_t count)
+    {
+        NRRD::convertEndian((Scalar*)values, count * Traits::components);
+    }
 
-    void _fillMetadata() {
-        _metadata["space dimension"] = "3";
-        _metadata["kinds"] = "domain domain domain";
+    // Returns null if the file cannot be mapped.
+    std::shared_ptr<T> _mapFile(const std::string& filename,
+                                const size_t offset, const bool copyOnWrite)
+    {
+#ifdef REGIODESICS_USE_MMAP
+        if (offset % alignof(T) != 0)
+            return nullptr;
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1)
+            return nullptr;
+        struct stat status;
+        const size_t length = offset + sizeof(T) * _storage.size();
+        if (fstat(fd, &status) != 0 || size_t(status.st_size) < length)
+        {
+            close(fd);
+            throw std::runtime_error("Error reading " + filename);
+        }
+        // The mapping starts at the beginning of the file since the offset
+        // of a mapping must be a multiple of the page size.
+        void* address =
+            mmap(0, length, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ,
+                 copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED)
+            return nullptr;
+        return std::shared_ptr<T>((T*)((char*)address + offset),
+                                  [address, length](T*) {
+                                      munmap(address, length);
+                                  });
+#else
+        (void)filename;
+        (void)offset;
+        (void)copyOnWrite;
+        return nullptr;
+#endif
     }
+
+    void _fillMetadata() { Traits::fillMetadata(_metadata); }
     StringMap _metadata;
+
+    template <typename U>
+    friend class VolumeWriter;
 };
 
-#define CHECK_NUMERIC_TYPE_METADATA(T)                                   \
-    template <>                                                          \
-    inline void Volume<T>::_checkMetadata(StringMap& metadata)           \
-    {                                                                    \
-        const auto& type = metadata["type"];                             \
-        if (type != #T)                                                  \
-            throw std::runtime_error("Unexpected volume type: " + type + \
-                                     " was provided whereas " #T         \
-                                     " was expected.");                  \
-        const auto& dims = metadata["dimension"];                        \
-        if (std::atoi(dims.c_str()) != 3)                                \
-            throw std::runtime_error("Invalid dimensions: " + dims);     \
-    }
-
-CHECK_NUMERIC_TYPE_METADATA(char)
-CHECK_NUMERIC_TYPE_METADATA(unsigned char)
-CHECK_NUMERIC_TYPE_METADATA(unsigned short)
-CHECK_NUMERIC_TYPE_METADATA(unsigned int)
-CHECK_NUMERIC_TYPE_METADATA(float)
-
-#define CHECK_VECTOR_FIELD_METADATA(T, N)                                \
-    template <>                                                          \
-    inline void Volume<PointTN<T, N>>::_checkMetadata(                   \
-        std::map<std::string, std::string>& metadata)                    \
-    {                                                                    \
-        const auto& type = metadata["type"];                             \
-        if (type != #T)                                                  \
-            throw std::runtime_error("Unexpected volume type: " + type); \
-        const auto& dims = metadata["dimension"];                        \
-        if (std::atoi(dims.c_str()) != 4)                                \
-            throw std::runtime_error("Invalid dimensions: " + dims);     \
-        std::stringstream sizes(metadata["sizes"]);                      \
-        size_t first;                                                    \
-        sizes >> first;                                                  \
-        if (first != N)                                                  \
-            throw std::runtime_error("Invalid size in first dimension"); \
-        std::getline(sizes, metadata["sizes"]);                          \
-    }                                                                    \
-    template <>                                                          \
-    inline void Volume<PointTN<T, N>>::_fillMetadata()                   \
-    {                                                                    \
-        _metadata["kinds"] = "vector domain domain domain";              \
-        _metadata["space dimension"] = "3";                              \
-    }
-
-CHECK_VECTOR_FIELD_METADATA(char, 4)
-CHECK_VECTOR_FIELD_METADATA(float, 3)
-
-// Partial template specialization of member functions in template classes is
-// not allowed by the standard, hence we have to enumerate the cases needed
-// with full template specialization.
-#define VOLUME_POINT_SAVE(T, N)                                                \
-    template <>                                                                \
-    inline void Volume<PointTN<T, N>>::save(const std::string& filename) const \
-    {                                                                          \
-        int dims[] = {N, int(_width), int(_height), int(_depth)};              \
-        assert(sizeof(PointTN<T, N>) == sizeof(T) * N);                        \
-        NRRD::save<T>(filename, (T*)_data.get(), 4, dims, {}, _metadata);      \
-    }
-
-VOLUME_POINT_SAVE(float, 2)
-VOLUME_POINT_SAVE(float, 3)
-VOLUME_POINT_SAVE(float, 4)
-VOLUME_POINT_SAVE(char, 4)
-
-#undef VOLUME_POINT_SAVE
+// Writes a NRRD file of `depth` z planes one slab of planes after the
+// other, for volumes that do not fit in memory. The header is written from
+// the width, height and metadata of the first slab. With gzip encoding, the
+// compressed data is kept in memory and written by close().
+template <typename T>
+class VolumeWriter
+{
+public:
+    VolumeWriter(const std::string& filename, const size_t depth,
+                 const VolumeEncoding encoding = VolumeEncoding::raw)
+        : _filename(filename)
+        , _temporary(NRRD::temporaryName(filename))
+        , _depth(depth)
+        , _encoding(encoding)
+    {
+    }
+
+    // An incomplete file is removed and the previous one kept.
+    ~VolumeWriter()
+    {
+        if (!_out.is_open())
+            return;
+        _out.close();
+        std::remove(_temporary.c_str());
+    }
+
+    // Appends the z planes of the slab.
+    template <typename Storage>
+    void write(const Volume<T, Storage>& slab)
+    {
+        if (_written + slab.depth() > _depth)
+            throw std::runtime_error("Too many planes written to " +
+                                     _filename);
+        if (_written == 0)
+        {
+            _width = slab.width();
+            _height = slab.height();
+            _fields = slab.metadata();
+            _fields["encoding"] =
+                _encoding == VolumeEncoding::gzip ? "gzip" : "raw";
+            if (_encoding == VolumeEncoding::raw)
+            {
+                _out.open(_temporary, std::ios::binary);
+                _writeHeader({});
+            }
+        }
+        else if (slab.width() != _width || slab.height() != _height)
+        {
+            throw std::runtime_error("Invalid slab size for " + _filename);
+        }
+
+        if (Storage::linear && slab.storage().contiguous())
+        {
+            _append(slab._data.get(), _width * _height * slab.depth());
+        }
+        else
+        {
+            std::vector<T> slice(_width * _height);
+            for (size_t z = 0; z != slab.depth(); ++z)
+            {
+                for (size_t y = 0; y != _height; ++y)
+                    for (size_t x = 0; x != _width; ++x)
+                        slice[y * _width + x] = slab(x, y, z);
+                _append(slice.data(), slice.size());
+            }
+        }
+        if (_encoding == VolumeEncoding::raw && !_out)
+            throw std::runtime_error("Error writing " + _filename);
+        _written += slab.depth();
+    }
+
+    // Number of z planes written.
+    size_t written() const { return _written; }
+
+    // Throws if the file is incomplete.
+    void close()
+    {
+        if (_written != _depth)
+            throw std::runtime_error("Incomplete file " + _filename);
+        if (_encoding == VolumeEncoding::gzip)
+        {
+            const auto& compressed = _gzip.finish();
+            _out.open(_temporary, std::ios::binary);
+            _writeHeader({{"gzip blocks", _gzip.blocks()}});
+            _out.write(compressed.data(), compressed.size());
+        }
+        _out.close();
+        if (!_out)
+        {
+            std::remove(_temporary.c_str());
+            throw std::runtime_error("Error writing " + _filename);
+        }
+        if (!NRRD::replaceFile(_temporary, _filename))
+            throw std::runtime_error("Error writing " + _filename);
+    }
+
+private:
+    using Traits = VolumeTraits<T>;
+    using Scalar = typename Traits::Scalar;
+
+    std::string _filename;
+    // Written and renamed to the file when closed, like in NRRD::save.
+    std::string _temporary;
+    std::ofstream _out;
+    NRRD::GzipWriter _gzip;
+    size_t _width = 0;
+    size_t _height = 0;
+    size_t _depth;
+    size_t _written = 0;
+    VolumeEncoding _encoding;
+    StringMap _fields;
+
+    void _writeHeader(const StringMap& keys)
+    {
+        std::vector<int> dims;
+        if (Traits::components != 1)
+            dims.push_back(int(Traits::components));
+        dims.push_back(int(_width));
+        dims.push_back(int(_height));
+        dims.push_back(int(_depth));
+        NRRD::writeHeader<Scalar>(_out, int(dims.size()), dims.data(), keys,
+                                  _fields);
+    }
+
+    void _append(const T* values, const size_t count)
+    {
+        if (_encoding == VolumeEncoding::gzip)
+            _gzip.write((const char*)values, sizeof(T) * count);
+        else
+            _out.write((const char*)values, sizeof(T) * count);
+    }
+};
 
 #endif
@@ -0,0 +1,158 @@
+#ifndef REGIODESICS_VOLUMESTORAGE_H
+#define REGIODESICS_VOLUMESTORAGE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Storage policies of Volume. A policy maps the coordinates of a voxel to
+// the index of its value in a flat array of size() elements and knows how to
+// visit all the voxels in an order that follows the storage.
+
+// x-fastest linear order, the layout of NRRD files. The storage of a box of
+// a larger volume keeps the row and slice pitches of the larger volume.
+class LinearStorage
+{
+public:
+    static const bool linear = true;
+
+    LinearStorage() = default;
+    LinearStorage(size_t width, size_t height, size_t depth)
+        : _width(width)
+        , _height(height)
+        , _depth(depth)
+        , _rowPitch(width)
+        , _slicePitch(width * height)
+    {
+    }
+
+    // Storage of a box of another storage, indexed from its first voxel.
+    LinearStorage(const LinearStorage& other, size_t width, size_t height,
+                  size_t depth)
+        : _width(width)
+        , _height(height)
+        , _depth(depth)
+        , _rowPitch(other._rowPitch)
+        , _slicePitch(other._slicePitch)
+    {
+    }
+
+    size_t size() const { return _width * _height * _depth; }
+
+    // True if the values fill the flat array of size() elements, false for
+    // the box of a larger volume whose rows are apart.
+    bool contiguous() const
+    {
+        return _rowPitch == _width && _slicePitch == _width * _height;
+    }
+
+    size_t index(size_t x, size_t y, size_t z) const
+    {
+        return z * _slicePitch + y * _rowPitch + x;
+    }
+
+    // Calls functor(x, y, z) for all the voxels in storage order.
+    template <typename Functor>
+    void forEachVoxel(const Functor& functor) const
+    {
+        for (size_t z = 0; z != _depth; ++z)
+            for (size_t y = 0; y != _height; ++y)
+                for (size_t x = 0; x != _width; ++x)
+                    functor(x, y, z);
+    }
+
+private:
+    size_t _width = 0;
+    size_t _height = 0;
+    size_t _depth = 0;
+    size_t _rowPitch = 0;
+    size_t _slicePitch = 0;
+};
+
+// Cubic bricks of Side^3 voxels stored one after the other in x-fastest
+// order of bricks, the voxels of each brick being in Morton (Z-curve) order.
+// The 6, 18 or 26 neighbours of most voxels are then in the same brick,
+// which spans a few cache lines and a single page, whatever the direction
+// in which the volume is traversed. The bricks on the high faces of the
+// volume are padded.
+// Since the Morton code of a voxel is the sum of the interleaved bits of its
+// coordinates, the index is the sum of three per axis lookups.
+template <size_t Side = 8>
+class BrickStorage
+{
+public:
+    static_assert(Side >= 2 && Side <= 64 && (Side & (Side - 1)) == 0,
+                  "The brick side must be a power of 2 up to 64");
+    static const bool linear = false;
+    static const size_t BrickSize = Side * Side * Side;
+
+    BrickStorage() = default;
+    BrickStorage(size_t width, size_t height, size_t depth)
+        : _width(width)
+        , _height(height)
+        , _depth(depth)
+    {
+        const size_t bricks[] = {_bricks(width), _bricks(height),
+                                 _bricks(depth)};
+        const size_t strides[] = {BrickSize, bricks[0] * BrickSize,
+                                  bricks[0] * bricks[1] * BrickSize};
+        const size_t sizes[] = {width, height, depth};
+        _size = bricks[0] * bricks[1] * bricks[2] * BrickSize;
+        for (int axis = 0; axis != 3; ++axis)
+        {
+            auto& offsets = _offsets[axis];
+            offsets.resize(sizes[axis]);
+            for (size_t i = 0; i != sizes[axis]; ++i)
+                offsets[i] = i / Side * strides[axis] +
+                             (_spread(i % Side) << axis);
+        }
+    }
+
+    size_t size() const { return _size; }
+
+    // Bricked volumes always own all their values.
+    bool contiguous() const { return true; }
+
+    size_t index(size_t x, size_t y, size_t z) const
+    {
+        return _offsets[0][x] + _offsets[1][y] + _offsets[2][z];
+    }
+
+    // Calls functor(x, y, z) for all the voxels brick by brick.
+    template <typename Functor>
+    void forEachVoxel(const Functor& functor) const
+    {
+        for (size_t bz = 0; bz < _depth; bz += Side)
+            for (size_t by = 0; by < _height; by += Side)
+                for (size_t bx = 0; bx < _width; bx += Side)
+                {
+                    const size_t ex = std::min(bx + Side, _width);
+                    const size_t ey = std::min(by + Side, _height);
+                    const size_t ez = std::min(bz + Side, _depth);
+                    for (size_t z = bz; z != ez; ++z)
+                        for (size_t y = by; y != ey; ++y)
+                            for (size_t x = bx; x != ex; ++x)
+                                functor(x, y, z);
+                }
+    }
+
+private:
+    size_t _width = 0;
+    size_t _height = 0;
+    size_t _depth = 0;
+    size_t _size = 0;
+    std::vector<size_t> _offsets[3];
+
+    static size_t _bricks(size_t size) { return (size + Side - 1) / Side; }
+
+    // Inserts two 0 bits between each of the bits of the input.
+    static size_t _spread(size_t v)
+    {
+        size_t result = 0;
+        for (size_t bit = 0; (size_t(1) << bit) <= v; ++bit)
+            result |= ((v >> bit) & 1) << (3 * bit);
+        return result;
+    }
+};
+
+#endif
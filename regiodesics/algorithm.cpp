@@ -1,62 +1,1152 @@
 #include "algorithm.h"
+#include "kernels.h"
+#include "traversal.h"
 
+#include <boost/filesystem/operations.hpp>
 #include <boost/geometry/algorithms/distance.hpp>
 #include <boost/progress.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+
+namespace
+{
+// Computing the relative position of a voxel along a virtual top bottom line.
+// For this we use this measures:
+// - The average of the relative position of its projection to the nearest
+//   lines connecting top and bottom voxels (a)
+// - And the relative position on the nearest line (b)
+// The final result is computed as t^8 * a + (1 - t^8) * b where t is
+// 1 - (b - 0.5) * 2 if b > 0.5 or b * 2 if b < 0.5
+// The average is good for points between top and bottom but tends to move
+// distances to the center, the linear interpolation with the closest
+// distance correct this drift near the outer shell.
+float _relativeDistance(const SegmentBatch& neighbours, const Point3f& point)
+{
+    const float relativeToClosest = relativePosition(neighbours, 0, point);
+    const float average =
+        sumRelativePositions(neighbours, point) / neighbours.size();
+
+    const float t = relativeToClosest < 0.5 ? 1 - relativeToClosest * 2
+                                            : (relativeToClosest - 0.5) * 2;
+    const float t8 = std::pow(t, 8);
+    return relativeToClosest * t8 + average * (1 - t8);
+}
+
+// Returns the normalized average direction of the segments and their average
+// length.
+std::pair<Point3f, float> _orientationAndHeight(
+    const SegmentBatch& neighbours)
+{
+    const Point4f sums = sumDirectionsAndLengths(neighbours);
+    Point3f averageDirection(sums.get<0>(), sums.get<1>(), sums.get<2>());
+
+    const auto x = averageDirection.get<0>();
+    const auto y = averageDirection.get<1>();
+    const auto z = averageDirection.get<2>();
+    const auto l = std::sqrt(x * x + y * y + z * z);
+    boost::geometry::divide_value(averageDirection, l);
+
+    return std::make_pair(averageDirection, sums.get<3>() / neighbours.size());
+}
+
+// k-nearest segment query for voxels visited in a continuous order.
+// Each query keeps a cache with all the segments within a radius R of the
+// voxel c that created it. For a later voxel p, the cache contains all the
+// segments within R - |p - c| of p, so if the k-th nearest cached segment is
+// closer than that, the cached result is exact and the index is not touched.
+// Otherwise the cache is rebuilt around p. The k segments found for the
+// previous voxel are all within B = max(distance(p, s)) of p, which is at
+// most the previous k-th distance plus the step between both voxels, so B
+// plus some slack is used as the new radius.
+// With epsilon > 0 the cached result is accepted as long as the k-th cached
+// segment is within (1 + epsilon)(R - |p - c|), which makes the query
+// (1 + epsilon) approximate.
+class CoherentQuery
+{
+public:
+    CoherentQuery(const SegmentIndex& index, const size_t size,
+                  const float epsilon = 0)
+        : _index(index)
+        , _size(size)
+        , _tolerance((1 + epsilon) * (1 + epsilon))
+        , _epsilon(epsilon)
+    {
+    }
+
+    // Forget the previous result, the next query starts from the root.
+    void reset()
+    {
+        _neighbours.clear();
+        _cache.clear();
+    }
+
+    // Returns the k nearest segments to the point, the first one being the
+    // nearest.
+    const SegmentRecords& operator()(const Coords& coords)
+    {
+        const Point3f point = point3d_cast<float>(coords);
+
+        if (!_cache.empty())
+        {
+            const float reach =
+                _radius - std::sqrt(boost::geometry::comparable_distance(
+                              point, _center));
+            if (reach > 0 && _select(point) <= reach * reach * _tolerance)
+                return _neighbours;
+        }
+
+        float bound = 0;
+        if (_neighbours.size() != _size)
+        {
+            _index.nearest(point, _size, _neighbours, _epsilon);
+        }
+        for (const auto& segment : _neighbours)
+            bound = std::max(bound, squaredDistance(segment, point));
+
+        _center = point;
+        _radius = std::sqrt(bound) + Slack;
+        _index.withinDistance(_center, _radius, _cache);
+        _select(point);
+        return _neighbours;
+    }
+
+private:
+    using Candidate = std::pair<float, const SegmentRecord*>;
+
+    // Distance margin added to the radius of the cache.
+    static constexpr float Slack = 2;
+
+    const SegmentIndex& _index;
+    const size_t _size;
+    const float _tolerance;
+    const float _epsilon;
+    SegmentRecords _neighbours;
+    SegmentRecords _cache;
+    Point3f _center;
+    float _radius = 0;
+    std::vector<Candidate> _candidates;
+
+    // Stores the k nearest cached segments in _neighbours and returns the
+    // squared distance of the farthest one.
+    float _select(const Point3f& point)
+    {
+        _candidates.clear();
+        for (const auto& segment : _cache)
+            _candidates.emplace_back(squaredDistance(segment, point),
+                                     &segment);
+
+        const auto compare = [](const Candidate& a, const Candidate& b) {
+            return a.first < b.first;
+        };
+        auto last = _candidates.end();
+        if (_candidates.size() > _size)
+        {
+            last = _candidates.begin() + _size;
+            std::nth_element(_candidates.begin(), last - 1, _candidates.end(),
+                             compare);
+        }
+        std::iter_swap(_candidates.begin(),
+                       std::min_element(_candidates.begin(), last, compare));
+
+        float farthest = 0;
+        _neighbours.clear();
+        for (auto i = _candidates.begin(); i != last; ++i)
+        {
+            _neighbours.push_back(*i->second);
+            farthest = std::max(farthest, i->first);
+        }
+        return farthest;
+    }
+};
+
+// Tells whether a voxel is computed: a non empty voxel of the shell, also set
+// in the active mask of the options if any.
+struct ActiveVoxels
+{
+    ActiveVoxels(const Volume<char>& shell_, const FieldOptions& options)
+        : shell(shell_)
+        , mask(options.active)
+    {
+        if (mask && mask->dimensions() != shell.dimensions())
+            throw std::invalid_argument(
+                "The active mask and the shell dimensions differ");
+    }
+
+    bool operator()(const size_t x, const size_t y, const size_t z) const
+    {
+        return shell(x, y, z) != 0 && (!mask || (*mask)(x, y, z));
+    }
+
+    const Volume<char>& shell;
+    const BitVolume* mask;
+};
+
+// Progress bar and completion of a traversal of tiles, and its cancellation.
+class TileProgress
+{
+public:
+    TileProgress(const size_t tiles, const FieldOptions& options)
+        : _none(nullptr)
+        , _display(tiles, options.progress ? *options.progress : _none)
+        , _tiles(tiles)
+        , _completion(options.completion)
+        , _cancel(options.cancel)
+    {
+        if (_completion)
+            *_completion = 0;
+    }
+
+    // True once the remaining tiles must be skipped.
+    bool cancelled() const { return _cancel && *_cancel; }
+
+    // Counts a tile done, from a critical section.
+    void operator++()
+    {
+        ++_display;
+        if (_completion)
+            *_completion = float(_display.count()) / _tiles;
+    }
+
+    // Throws Cancelled if the traversal was cancelled.
+    void check() const
+    {
+        if (cancelled())
+            throw Cancelled();
+    }
+
+private:
+    std::ostream _none;
+    boost::progress_display _display;
+    size_t _tiles;
+    std::atomic<float>* _completion;
+    const std::atomic<bool>* _cancel;
+};
+
+// Calls evaluate(x, y, z, neighbours) for every active voxel of the shell
+// with a batch of its k nearest segments, the first one being the nearest, and
+// clear(x, y, z) for the empty voxels. The volume is processed in tiles by
+// the traversal engine. With coherent queries, each tile is walked in
+// boustrophedon order so that consecutive voxels are face neighbours.
+// Only the z planes [zBegin, zEnd) are visited.
+template <typename Evaluate, typename Clear>
+void _forEachShellVoxel(const Volume<char>& shell, const SegmentIndex& index,
+                        const size_t setSize, const FieldOptions& options,
+                        const Evaluate& evaluate, const Clear& clear,
+                        const size_t zBegin = 0,
+                        const size_t zEnd = std::numeric_limits<size_t>::max())
+{
+    if (options.epsilon < 0)
+        throw std::invalid_argument("epsilon must be non-negative");
+
+    auto tiles = makeTiles(shell.width(), shell.height(), zBegin,
+                           std::min(zEnd, shell.depth()));
+    const ActiveVoxels active(shell, options);
+    classifyTiles(tiles, active);
+
+    TileProgress progress(tiles.size(), options);
+    parallelForEachTile(tiles, [&](const Tile& tile) {
+        if (progress.cancelled())
+            return;
+        SegmentBatch batch;
+        const auto evaluateBatch = [&](size_t x, size_t y, size_t z,
+                                       const SegmentRecords& neighbours) {
+            batch.clear();
+            for (const auto& record : neighbours)
+                batch.push_back(record);
+            evaluate(x, y, z, batch);
+        };
+
+        if (tile.empty)
+        {
+            forEachVoxel(tile, clear);
+        }
+        else if (options.coherent)
+        {
+            CoherentQuery query(index, setSize, options.epsilon);
+            forEachVoxelBoustrophedon(tile, [&](size_t x, size_t y, size_t z) {
+                if (!active(x, y, z))
+                    clear(x, y, z);
+                else
+                    evaluateBatch(x, y, z, query(Coords(x, y, z)));
+            });
+        }
+        else
+        {
+            SegmentRecords neighbours;
+            forEachVoxel(tile, [&](size_t x, size_t y, size_t z) {
+                if (!active(x, y, z))
+                {
+                    clear(x, y, z);
+                    return;
+                }
+                index.nearest(Point3f(x, y, z), setSize, neighbours,
+                              options.epsilon);
+                evaluateBatch(x, y, z, neighbours);
+            });
+        }
+#pragma omp critical
+        ++progress;
+    });
+    progress.check();
+}
+
+// Side of the blocks of the coarse lattice of the adaptive evaluation.
+const size_t AdaptiveTileSize = 16;
+
+// Field values of a voxel used by the adaptive evaluation.
+struct Sample
+{
+    float relativeDistance;
+    Point3f orientation;
+    float height;
+};
+
+// Adaptive evaluation of the fields in a tile. The tile is treated as a box
+// whose corners are evaluated exactly. If the box only contains interior
+// voxels and the trilinear interpolation of the corners matches the exact
+// values at the center and face centers of the box within the tolerance,
+// all its voxels are interpolated. Otherwise the box is split in 8 and
+// refined recursively, down to boxes without inner voxels.
+// Boxes with void or boundary voxels are always refined, so that the voxels
+// near the shell are evaluated exactly.
+class AdaptiveTile
+{
+public:
+    AdaptiveTile(const Volume<char>& shell, const SegmentIndex& index,
+                 const size_t setSize, const FieldOptions& options,
+                 const bool relativeDistances, const bool orientations,
+                 const Tile& tile)
+        : _shell(shell)
+        , _index(index)
+        , _setSize(setSize)
+        , _options(options)
+        , _relativeDistances(relativeDistances)
+        , _orientations(orientations)
+    {
+        const size_t sizes[] = {shell.width(), shell.height(), shell.depth()};
+        for (int i = 0; i != 3; ++i)
+        {
+            _begin[i] = tile.begin[i];
+            // The box includes the first voxel of the next tile if any.
+            _last[i] = std::min(tile.end[i], sizes[i] - 1);
+            _size[i] = _last[i] - _begin[i] + 1;
+        }
+        _samples.resize(_size[0] * _size[1] * _size[2]);
+        _states.resize(_samples.size(), Missing);
+    }
+
+    // Computes the samples of all the voxels of the box.
+    void compute() { _refine(_begin, _last); }
+
+    // Returns the sample of a voxel of the box.
+    const Sample& operator()(size_t x, size_t y, size_t z) const
+    {
+        return _samples[_offset(x, y, z)];
+    }
+
+    // Number of voxels evaluated exactly.
+    size_t evaluated() const { return _evaluated; }
+
+private:
+    enum State : char
+    {
+        Missing,
+        Interpolated,
+        Exact
+    };
+
+    const Volume<char>& _shell;
+    const SegmentIndex& _index;
+    const size_t _setSize;
+    const FieldOptions& _options;
+    const bool _relativeDistances;
+    const bool _orientations;
+    size_t _begin[3];
+    size_t _last[3];
+    size_t _size[3];
+    std::vector<Sample> _samples;
+    std::vector<State> _states;
+    size_t _evaluated = 0;
+    SegmentRecords _neighbours;
+    SegmentBatch _batch;
+
+    size_t _offset(size_t x, size_t y, size_t z) const
+    {
+        return ((z - _begin[2]) * _size[1] + (y - _begin[1])) * _size[0] +
+               (x - _begin[0]);
+    }
+
+    const Sample& _exact(size_t x, size_t y, size_t z)
+    {
+        const size_t offset = _offset(x, y, z);
+        if (_states[offset] == Exact)
+            return _samples[offset];
+
+        const Point3f point(x, y, z);
+        _index.nearest(point, _setSize, _neighbours, _options.epsilon);
+        _batch.clear();
+        for (const auto& record : _neighbours)
+            _batch.push_back(record);
+
+        Sample& sample = _samples[offset];
+        if (_relativeDistances)
+            sample.relativeDistance = _relativeDistance(_batch, point);
+        if (_orientations)
+        {
+            std::tie(sample.orientation, sample.height) =
+                _orientationAndHeight(_batch);
+        }
+        _states[offset] = Exact;
+        ++_evaluated;
+        return sample;
+    }
+
+    Sample _interpolate(const size_t* lo, const size_t* hi, size_t x, size_t y,
+                        size_t z) const
+    {
+        const size_t p[] = {x, y, z};
+        float t[3];
+        for (int i = 0; i != 3; ++i)
+            t[i] = hi[i] == lo[i] ? 0 : float(p[i] - lo[i]) / (hi[i] - lo[i]);
+
+        Sample result{0, Point3f(0, 0, 0), 0};
+        for (int corner = 0; corner != 8; ++corner)
+        {
+            float weight = 1;
+            size_t c[3];
+            for (int i = 0; i != 3; ++i)
+            {
+                const bool high = corner & (1 << i);
+                c[i] = high ? hi[i] : lo[i];
+                weight *= high ? t[i] : 1 - t[i];
+            }
+            const Sample& sample = (*this)(c[0], c[1], c[2]);
+            result.relativeDistance += sample.relativeDistance * weight;
+            result.orientation += sample.orientation * weight;
+            result.height += sample.height * weight;
+        }
+        const float length = std::sqrt(boost::geometry::dot_product(
+            result.orientation, result.orientation));
+        if (length > 0)
+            boost::geometry::divide_value(result.orientation, length);
+        return result;
+    }
+
+    float _error(const Sample& a, const Sample& b) const
+    {
+        float error = 0;
+        if (_relativeDistances)
+            error = std::abs(a.relativeDistance - b.relativeDistance);
+        if (_orientations)
+        {
+            const Point3f d = a.orientation - b.orientation;
+            error =
+                std::max(error, std::sqrt(boost::geometry::dot_product(d, d)));
+            error = std::max(error, std::abs(a.height - b.height) /
+                                        std::max(1.f, std::abs(b.height)));
+        }
+        return error;
+    }
+
+    bool _interior(const size_t* lo, const size_t* hi) const
+    {
+        for (size_t z = lo[2]; z <= hi[2]; ++z)
+            for (size_t y = lo[1]; y <= hi[1]; ++y)
+                for (size_t x = lo[0]; x <= hi[0]; ++x)
+                    if (_shell(x, y, z) != Interior)
+                        return false;
+        return true;
+    }
+
+    void _refine(const size_t* lo, const size_t* hi)
+    {
+        size_t mid[3];
+        bool leaf = true;
+        for (int i = 0; i != 3; ++i)
+        {
+            mid[i] = (lo[i] + hi[i]) / 2;
+            leaf &= hi[i] - lo[i] <= 1;
+        }
+
+        if (leaf)
+        {
+            for (size_t z = lo[2]; z <= hi[2]; ++z)
+                for (size_t y = lo[1]; y <= hi[1]; ++y)
+                    for (size_t x = lo[0]; x <= hi[0]; ++x)
+                        if (_shell(x, y, z) != 0)
+                            _exact(x, y, z);
+            return;
+        }
+
+        if (_interior(lo, hi) && _interpolable(lo, hi, mid))
+        {
+            for (size_t z = lo[2]; z <= hi[2]; ++z)
+                for (size_t y = lo[1]; y <= hi[1]; ++y)
+                    for (size_t x = lo[0]; x <= hi[0]; ++x)
+                    {
+                        const size_t offset = _offset(x, y, z);
+                        if (_states[offset] != Missing)
+                            continue;
+                        _samples[offset] = _interpolate(lo, hi, x, y, z);
+                        _states[offset] = Interpolated;
+                    }
+            return;
+        }
+
+        // Splitting in 8 (or less if some side is too short) boxes that
+        // share their faces.
+        for (int child = 0; child != 8; ++child)
+        {
+            size_t childLo[3];
+            size_t childHi[3];
+            bool valid = true;
+            for (int i = 0; i != 3; ++i)
+            {
+                const bool high = child & (1 << i);
+                if (high && hi[i] - lo[i] <= 1)
+                    valid = false;
+                childLo[i] = high ? mid[i] : lo[i];
+                childHi[i] = hi[i] - lo[i] <= 1 ? hi[i] : high ? hi[i] : mid[i];
+            }
+            if (valid)
+                _refine(childLo, childHi);
+        }
+    }
+
+    // Evaluates the corners and checks the interpolation at the center and
+    // the face centers. These samples are the corners of the children boxes,
+    // so they are not wasted if the box is split.
+    bool _interpolable(const size_t* lo, const size_t* hi, const size_t* mid)
+    {
+        for (int corner = 0; corner != 8; ++corner)
+            _exact(corner & 1 ? hi[0] : lo[0], corner & 2 ? hi[1] : lo[1],
+                   corner & 4 ? hi[2] : lo[2]);
+
+        const auto check = [&](size_t x, size_t y, size_t z) {
+            return _error(_interpolate(lo, hi, x, y, z), _exact(x, y, z)) <=
+                   _options.tolerance;
+        };
+        return check(mid[0], mid[1], mid[2]) && check(lo[0], mid[1], mid[2]) &&
+               check(hi[0], mid[1], mid[2]) && check(mid[0], lo[1], mid[2]) &&
+               check(mid[0], hi[1], mid[2]) && check(mid[0], mid[1], lo[2]) &&
+               check(mid[0], mid[1], hi[2]);
+    }
+};
+
+// Adaptive counterpart of _forEachShellVoxel. Calls store(x, y, z, sample)
+// for every active voxel of the shell, the sample being exact or
+// interpolated, and clear(x, y, z) for the empty voxels. Only the fields
+// requested are computed. The results of a slab of z planes only match
+// those of the whole volume if zBegin is a multiple of AdaptiveTileSize.
+template <typename Store, typename Clear>
+void _forEachShellVoxelAdaptive(
+    const Volume<char>& shell, const SegmentIndex& index,
+    const size_t setSize, const FieldOptions& options,
+    const bool relativeDistances, const bool orientations, const Store& store,
+    const Clear& clear, const size_t zBegin = 0,
+    const size_t zEnd = std::numeric_limits<size_t>::max())
+{
+    if (options.epsilon < 0)
+        throw std::invalid_argument("epsilon must be non-negative");
+
+    const size_t depth = std::min(zEnd, shell.depth());
+    std::vector<Tile> tiles;
+    for (size_t z = zBegin; z < depth; z += AdaptiveTileSize)
+        for (size_t y = 0; y < shell.height(); y += AdaptiveTileSize)
+            for (size_t x = 0; x < shell.width(); x += AdaptiveTileSize)
+                tiles.push_back(
+                    Tile{{x, y, z},
+                         {std::min(x + AdaptiveTileSize, shell.width()),
+                          std::min(y + AdaptiveTileSize, shell.height()),
+                          std::min(z + AdaptiveTileSize, depth)},
+                         false});
+    const ActiveVoxels active(shell, options);
+    classifyTiles(tiles, active);
+
+    size_t voxels = 0;
+    size_t evaluated = 0;
+    TileProgress progress(tiles.size(), options);
+    parallelForEachTile(tiles, [&](const Tile& tile) {
+        if (progress.cancelled())
+            return;
+        size_t count = 0;
+        size_t exact = 0;
+        if (tile.empty)
+        {
+            forEachVoxel(tile, clear);
+        }
+        else
+        {
+            AdaptiveTile adaptive(shell, index, setSize, options,
+                                  relativeDistances, orientations, tile);
+            adaptive.compute();
+            exact = adaptive.evaluated();
+            forEachVoxel(tile, [&](size_t x, size_t y, size_t z) {
+                if (!active(x, y, z))
+                {
+                    clear(x, y, z);
+                    return;
+                }
+                store(x, y, z, adaptive(x, y, z));
+                ++count;
+            });
+        }
+#pragma omp critical
+        {
+            voxels += count;
+            evaluated += exact;
+            ++progress;
+        }
+    });
+    progress.check();
+
+    if (options.evaluatedFraction)
+        *options.evaluatedFraction = voxels ? float(evaluated) / voxels : 0;
+}
+
+void _throwMissingShell(const char label)
+{
+    std::string missing = (label == Bottom) ? "bottom" : "top";
+    missing = "The required " + missing +
+              " shell is missing. Computations failed.";
+    throw(std::invalid_argument(missing));
+}
+
+// Computes in place the lower envelope of the parabolas
+// (q - p)^2 + distances[p] and assigns to each position of `features` the
+// feature of the parabola that is minimal there (Felzenszwalb and
+// Huttenlocher). Entries with NoFeature are not considered.
+void _featureTransform1D(std::vector<int64_t>& distances,
+                         std::vector<unsigned int>& features,
+                         std::vector<int64_t>& vertices,
+                         std::vector<double>& boundaries,
+                         std::vector<unsigned int>& output)
+{
+    const int64_t n = features.size();
+    int64_t k = -1;
+    for (int64_t q = 0; q != n; ++q)
+    {
+        if (features[q] == NoFeature)
+            continue;
+        const int64_t f = distances[q] + q * q;
+        double s = -std::numeric_limits<double>::infinity();
+        while (k >= 0)
+        {
+            const int64_t v = vertices[k];
+            s = double(f - (distances[v] + v * v)) / (2 * (q - v));
+            if (s > boundaries[k])
+                break;
+            --k;
+        }
+        ++k;
+        vertices[k] = q;
+        boundaries[k] = k == 0 ? -std::numeric_limits<double>::infinity() : s;
+    }
+
+    if (k == -1)
+    {
+        std::fill(output.begin(), output.end(), NoFeature);
+        return;
+    }
+
+    int64_t j = 0;
+    for (int64_t q = 0; q != n; ++q)
+    {
+        while (j < k && boundaries[j + 1] < q)
+            ++j;
+        output[q] = features[vertices[j]];
+    }
+}
+
+// Computes the fields of all the non empty voxels of the shell into
+// `fields`, which can be dense or sparse. clear(x, y, z) is called for the
+// empty voxels. If only the z planes [zBegin, zEnd) are computed, the fields
+// hold these planes, stored from z = 0.
+template <typename Output, typename Clear>
+void _computeFields(const Volume<char>& shell, const SegmentIndex& index,
+                    const size_t setSize, const FieldOptions& options,
+                    Output& fields, const Clear& clear,
+                    const size_t zBegin = 0,
+                    const size_t zEnd = std::numeric_limits<size_t>::max())
+{
+    // For correcting the distances from voxel space to volume space we take
+    // into account that the volume is isotropic.
+    const auto axis = shell.volumeAxis(0);
+    const float voxelSize =
+        std::sqrt(boost::geometry::dot_product(axis, axis));
+
+    const auto store = [&fields, voxelSize, zBegin](size_t x, size_t y,
+                                                    size_t z,
+                                                    const Sample& sample) {
+        z -= zBegin;
+        fields.relativeDistances(x, y, z) = sample.relativeDistance;
+        fields.orientations(x, y, z) = sample.orientation;
+        fields.heights(x, y, z) = sample.height * voxelSize;
+        fields.distances(x, y, z) =
+            sample.height * voxelSize * sample.relativeDistance;
+    };
+    const auto clearSlab = [&clear, zBegin](size_t x, size_t y, size_t z) {
+        clear(x, y, z - zBegin);
+    };
+    if (options.tolerance > 0)
+    {
+        _forEachShellVoxelAdaptive(shell, index, setSize, options, true, true,
+                                   store, clearSlab, zBegin, zEnd);
+        return;
+    }
+
+    _forEachShellVoxel(shell, index, setSize, options,
+                       [&store](size_t x, size_t y, size_t z,
+                                const SegmentBatch& neighbours) {
+                           Sample sample;
+                           sample.relativeDistance =
+                               _relativeDistance(neighbours, Point3f(x, y, z));
+                           std::tie(sample.orientation, sample.height) =
+                               _orientationAndHeight(neighbours);
+                           store(x, y, z, sample);
+                       },
+                       clearSlab, zBegin, zEnd);
+}
+
+// Allocates dense fields for `depth` z planes of the shell.
+Fields _makeFields(const Volume<char>& shell, const size_t depth)
+{
+    const size_t width = shell.width();
+    const size_t height = shell.height();
+    auto point3_metadata = shell.metadata();
+    point3_metadata["space directions"] =
+        "none " + point3_metadata["space directions"];
+    return Fields{Volume<float>(width, height, depth, shell.metadata()),
+                  Volume<Point3f>(width, height, depth, point3_metadata),
+                  Volume<float>(width, height, depth, shell.metadata()),
+                  Volume<float>(width, height, depth, shell.metadata())};
+}
+
+void _clearFields(Fields& fields, size_t x, size_t y, size_t z)
+{
+    fields.relativeDistances(x, y, z) = NAN;
+    fields.orientations(x, y, z) = Point3f(0, 0, 0);
+    fields.heights(x, y, z) = NAN;
+    fields.distances(x, y, z) = NAN;
+}
+
+// Dense or sparse implementation of estimateFieldDeviation.
+template <typename Distances, typename Orientations>
+FieldDeviation _estimateFieldDeviation(const Volume<char>& shell,
+                                       const size_t setSize,
+                                       const SegmentIndex& index,
+                                       const Distances* relativeDistances,
+                                       const Orientations* orientations,
+                                       const size_t samples)
+{
+    std::vector<Coords> voxels;
+    shell.visit([&voxels](size_t x, size_t y, size_t z, const char& v) {
+        if (v != 0)
+            voxels.push_back(Coords(x, y, z));
+    });
+    const size_t stride =
+        std::max(size_t(1), voxels.size() / std::max(size_t(1), samples));
+
+    FieldDeviation deviation;
+    if (relativeDistances)
+        deviation.relativeDistance = 0;
+    if (orientations)
+        deviation.orientation = 0;
+#pragma omp parallel
+    {
+        SegmentRecords neighbours;
+        SegmentBatch batch;
+        FieldDeviation local = deviation;
+#pragma omp for
+        for (size_t i = 0; i < voxels.size(); i += stride)
+        {
+            const Coords& voxel = voxels[i];
+            const size_t x = voxel.get<0>();
+            const size_t y = voxel.get<1>();
+            const size_t z = voxel.get<2>();
+            const Point3f point = point3d_cast<float>(voxel);
+            index.nearest(point, setSize, neighbours);
+            batch.clear();
+            for (const auto& record : neighbours)
+                batch.push_back(record);
+
+            if (relativeDistances)
+            {
+                const float error = std::abs(_relativeDistance(batch, point) -
+                                             (*relativeDistances)(x, y, z));
+                local.relativeDistance =
+                    std::max(local.relativeDistance, error);
+            }
+            if (orientations)
+            {
+                const Point3f orientation = (*orientations)(x, y, z);
+                const float cosine = boost::geometry::dot_product(
+                    _orientationAndHeight(batch).first, orientation);
+                const float angle =
+                    std::acos(std::min(1.f, std::max(-1.f, cosine))) * 180 /
+                    M_PI;
+                local.orientation = std::max(local.orientation, angle);
+            }
+            ++local.samples;
+        }
+#pragma omp critical
+        {
+            deviation.relativeDistance =
+                std::max(deviation.relativeDistance, local.relativeDistance);
+            deviation.orientation =
+                std::max(deviation.orientation, local.orientation);
+            deviation.samples += local.samples;
+        }
+    }
+    return deviation;
+}
+
+
+} // namespace
+
+std::istream& operator>>(std::istream& in, NearestVoxelMethod& method)
+{
+    std::string name;
+    in >> name;
+    if (name == "rtree")
+        method = NearestVoxelMethod::rtree;
+    else if (name == "transform")
+        method = NearestVoxelMethod::featureTransform;
+    else
+        in.setstate(std::ios::failbit);
+    return in;
+}
+
+std::ostream& operator<<(std::ostream& out, const NearestVoxelMethod method)
+{
+    switch (method)
+    {
+    case NearestVoxelMethod::rtree:
+        return out << "rtree";
+    case NearestVoxelMethod::featureTransform:
+        return out << "transform";
+    }
+    return out;
+}
 
 namespace
 {
-float _relativePositionOnSegment(const Segment& segment, Point3f c)
-{
-    using namespace boost::geometry;
-    Point3f p = point3d_cast<float>(segment.first);
-    Point3f q = point3d_cast<float>(segment.second);
-    Segmentf s(p, q);
-    subtract_point(q, p);
-    const float totalLength = length(s);
-    divide_value(q, length(s));
-    subtract_point(c, p);
-    multiply_value(q, dot_product(q, c));
-    add_point(q, p);
-    const float t = length(Segmentf(p, q)) / totalLength;
-    return std::min(1.f, std::max(0.f, t));
+// Stores in row 1 for the voxels of the row (y, z) that belong to the
+// region and 0 for the others.
+template <typename T, typename Storage>
+void _regionRow(const Volume<T, Storage>& volume, const size_t y,
+                const size_t z, const T label, uint8_t* row)
+{
+    const size_t width = volume.width();
+    if (Storage::linear)
+    {
+        const T* values = &volume(size_t(0), y, z);
+        if (label == 0)
+        {
+#pragma omp simd
+            for (size_t x = 0; x < width; ++x)
+                row[x] = values[x] != 0;
+        }
+        else
+        {
+#pragma omp simd
+            for (size_t x = 0; x < width; ++x)
+                row[x] = values[x] == label;
+        }
+        return;
+    }
+    for (size_t x = 0; x < width; ++x)
+        row[x] = label == 0 ? volume(x, y, z) != 0 : volume(x, y, z) == label;
+}
+
+// Clears the voxels of inside whose neighbours in row at x + dx, for dx in
+// [-reach, reach], are not all in the region.
+void _intersectNeighbours(uint8_t* inside, const uint8_t* row,
+                          const size_t width, const int reach)
+{
+    for (int dx = -reach; dx <= reach; ++dx)
+    {
+        const uint8_t* shifted = row + 1 + dx;
+#pragma omp simd
+        for (size_t x = 1; x < width - 1; ++x)
+            inside[x] &= shifted[x - 1];
+    }
 }
 } // namespace
 
-Volume<char> annotateBoundaryVoxels(const Volume<unsigned int>& volume)
-{
-    Volume<char> output(volume.width(), volume.height(), volume.depth(),
-                        volume.metadata());
-    output.set(0);
-    output.apply([&volume](size_t x, size_t y, size_t z, const char&) {
-        if (volume(x, y, z) == 0)
-            return Void;
-
-        // Border voxels are always boundary
-        if (x == 0 || y == 0 || z == 0 || x == volume.width() - 1 ||
-            y == volume.height() - 1 || z == volume.depth() - 1)
-            return Shell;
-
-        if (volume(x - 1, y, z) == 0 || volume(x + 1, y, z) == 0 ||
-            volume(x, y - 1, z) == 0 || volume(x, y + 1, z) == 0 ||
-            volume(x, y, z - 1) == 0 || volume(x, y, z + 1) == 0)
-            return Shell;
-        return Interior;
-    });
-    return output;
+template <typename T, typename Storage>
+Volume<char, Storage> annotateBoundaryVoxels(
+    const Volume<T, Storage>& volume, const size_t connectivity,
+    const typename Volume<T, Storage>::Value label)
+{
+    if (connectivity != 6 && connectivity != 18 && connectivity != 26)
+        throw std::invalid_argument("Invalid connectivity: " +
+                                    std::to_string(connectivity));
+
+    size_t width, height, depth;
+    std::tie(width, height, depth) = volume.dimensions();
+    Volume<char, Storage> output(width, height, depth, volume.metadata());
+    if (width == 0 || height == 0 || depth == 0)
+        return output;
+
+    // Each row of voxels is compared with the rows (y + dy, z + dz) around
+    // it as a whole. A face neighbour row has its neighbours at x - 1, x and
+    // x + 1 with 18 and 26 connectivity, an edge neighbour row only with 26.
+    const int faceReach = connectivity == 6 ? 0 : 1;
+    const int edgeReach = connectivity == 26 ? 1 : 0;
+#pragma omp parallel
+    {
+        std::vector<uint8_t> center(width);
+        std::vector<uint8_t> neighbour(width);
+        std::vector<uint8_t> inside(width);
+        std::vector<char> labels(width);
+
+#pragma omp for schedule(dynamic, 16)
+        for (long long i = 0; i < (long long)(height * depth); ++i)
+        {
+            const size_t y = i % height;
+            const size_t z = i / height;
+            _regionRow(volume, y, z, label, center.data());
+            inside = center;
+            // Voxels at the border of the volume are always boundary.
+            inside[0] = inside[width - 1] = 0;
+            if (y == 0 || z == 0 || y == height - 1 || z == depth - 1)
+                std::fill(inside.begin(), inside.end(), 0);
+            else
+            {
+                _intersectNeighbours(inside.data(), center.data(), width, 1);
+                for (int dz = -1; dz <= 1; ++dz)
+                {
+                    for (int dy = -1; dy <= 1; ++dy)
+                    {
+                        const bool edge = dy != 0 && dz != 0;
+                        if ((dy == 0 && dz == 0) || (edge && connectivity == 6))
+                            continue;
+                        _regionRow(volume, y + dy, z + dz, label,
+                                   neighbour.data());
+                        _intersectNeighbours(inside.data(), neighbour.data(),
+                                             width,
+                                             edge ? edgeReach : faceReach);
+                    }
+                }
+            }
+
+            char* out =
+                Storage::linear ? &output(size_t(0), y, z) : labels.data();
+#pragma omp simd
+            for (size_t x = 0; x < width; ++x)
+                out[x] = center[x] ? (inside[x] ? Interior : Shell) : Void;
+            if (!Storage::linear)
+            {
+                for (size_t x = 0; x < width; ++x)
+                    output(x, y, z) = labels[x];
+            }
+        }
+    }
+    return output;
+}
+
+#define ANNOTATE_BOUNDARY_VOXELS(T)                                          \
+    template Volume<char> annotateBoundaryVoxels(const Volume<T>&, size_t,   \
+                                                 T);                         \
+    template Volume<char, BrickStorage<>> annotateBoundaryVoxels(            \
+        const Volume<T, BrickStorage<>>&, size_t, T);
+
+ANNOTATE_BOUNDARY_VOXELS(unsigned char)
+ANNOTATE_BOUNDARY_VOXELS(unsigned short)
+ANNOTATE_BOUNDARY_VOXELS(unsigned int)
+ANNOTATE_BOUNDARY_VOXELS(int)
+
+template <typename T>
+std::map<T, LabelBox> computeLabelBoxes(const Volume<T>& volume,
+                                        const std::vector<T>& labels)
+{
+    std::vector<T> sorted(labels);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    size_t width, height, depth;
+    std::tie(width, height, depth) = volume.dimensions();
+    const LabelBox none{{width, height, depth}, {0, 0, 0}, 0};
+    std::vector<LabelBox> boxes(sorted.size(), none);
+#pragma omp parallel
+    {
+        std::vector<LabelBox> local(sorted.size(), none);
+#pragma omp for schedule(dynamic, 16)
+        for (long long i = 0; i < (long long)(height * depth); ++i)
+        {
+            const size_t y = i % height;
+            const size_t z = i / height;
+            const T* values = &volume(size_t(0), y, z);
+            // Labels come in runs, the search is only done when the value
+            // changes.
+            size_t x = 0;
+            while (x != width)
+            {
+                const T value = values[x];
+                size_t end = x + 1;
+                while (end != width && values[end] == value)
+                    ++end;
+                const auto found =
+                    std::lower_bound(sorted.begin(), sorted.end(), value);
+                if (found != sorted.end() && *found == value)
+                {
+                    auto& box = local[found - sorted.begin()];
+                    box.begin[0] = std::min(box.begin[0], x);
+                    box.begin[1] = std::min(box.begin[1], y);
+                    box.begin[2] = std::min(box.begin[2], z);
+                    box.end[0] = std::max(box.end[0], end);
+                    box.end[1] = std::max(box.end[1], y + 1);
+                    box.end[2] = std::max(box.end[2], z + 1);
+                    box.voxels += end - x;
+                }
+                x = end;
+            }
+        }
+#pragma omp critical
+        for (size_t i = 0; i != boxes.size(); ++i)
+        {
+            for (int axis = 0; axis != 3; ++axis)
+            {
+                boxes[i].begin[axis] =
+                    std::min(boxes[i].begin[axis], local[i].begin[axis]);
+                boxes[i].end[axis] =
+                    std::max(boxes[i].end[axis], local[i].end[axis]);
+            }
+            boxes[i].voxels += local[i].voxels;
+        }
+    }
+
+    std::map<T, LabelBox> result;
+    for (size_t i = 0; i != sorted.size(); ++i)
+    {
+        if (boxes[i].voxels != 0)
+            result[sorted[i]] = boxes[i];
+    }
+    return result;
+}
+
+#define COMPUTE_LABEL_BOXES(T)                                           \
+    template std::map<T, LabelBox> computeLabelBoxes(const Volume<T>&, \
+                                                     const std::vector<T>&);
+
+COMPUTE_LABEL_BOXES(unsigned char)
+COMPUTE_LABEL_BOXES(unsigned short)
+COMPUTE_LABEL_BOXES(unsigned int)
+COMPUTE_LABEL_BOXES(int)
+
+Volume<unsigned int> computeFeatureTransform(const Volume<char>& volume,
+                                             const char value)
+{
+    size_t width, height, depth;
+    std::tie(width, height, depth) = volume.dimensions();
+    if (width * height * depth >= NoFeature)
+        throw std::runtime_error("Volume too large for feature transform");
+
+    Volume<unsigned int> features(width, height, depth, volume.metadata());
+
+    // First pass, closest feature along each x row.
+#pragma omp parallel for schedule(dynamic)
+    for (size_t z = 0; z < depth; ++z)
+    {
+        for (size_t y = 0; y < height; ++y)
+        {
+            const unsigned int row = (z * height + y) * width;
+            unsigned int last = NoFeature;
+            for (size_t x = 0; x < width; ++x)
+            {
+                if (volume(x, y, z) == value)
+                    last = x;
+                features(x, y, z) = last;
+            }
+            unsigned int next = NoFeature;
+            for (size_t x = width; x-- != 0;)
+            {
+                if (volume(x, y, z) == value)
+                    next = x;
+                unsigned int& f = features(x, y, z);
+                if (next != NoFeature && (f == NoFeature || next - x < x - f))
+                    f = next;
+                if (f != NoFeature)
+                    f += row;
+            }
+        }
+    }
+
+    // Second and third passes, lower envelopes along y columns and z
+    // columns using the squared distances to the features found so far.
+    for (int axis = 1; axis != 3; ++axis)
+    {
+        const size_t length = axis == 1 ? height : depth;
+        const size_t outer = axis == 1 ? depth : height;
+#pragma omp parallel for schedule(dynamic)
+        for (size_t o = 0; o < outer; ++o)
+        {
+            std::vector<int64_t> distances(length);
+            std::vector<unsigned int> column(length);
+            std::vector<int64_t> vertices(length);
+            std::vector<double> boundaries(length);
+            std::vector<unsigned int> output(length);
+            for (size_t x = 0; x < width; ++x)
+            {
+                auto at = [&features, axis, o, x](size_t i) -> unsigned int& {
+                    return axis == 1 ? features(x, i, o) : features(x, o, i);
+                };
+                for (size_t i = 0; i != length; ++i)
+                {
+                    const unsigned int f = at(i);
+                    column[i] = f;
+                    if (f == NoFeature)
+                        continue;
+                    const int64_t dx = int64_t(f % width) - int64_t(x);
+                    const int64_t dy =
+                        axis == 1 ? 0
+                                  : int64_t((f / width) % height) - int64_t(o);
+                    distances[i] = dx * dx + dy * dy;
+                }
+                _featureTransform1D(distances, column, vertices, boundaries,
+                                    output);
+                for (size_t i = 0; i != length; ++i)
+                    at(i) = output[i];
+            }
+        }
+    }
+
+    return features;
 }
 
-Segments findNearestVoxels(const Volume<char>& volume, char from, char to)
+Segments findNearestVoxels(const Volume<char>& volume, char from, char to,
+                           const NearestVoxelMethod method)
 {
     Segments segments;
-    auto index = volume.createIndex(to);
-    if (index.size() == 0)
+    if (method == NearestVoxelMethod::featureTransform)
     {
-        std::string missing = (to == Bottom) ? "bottom" : "top";
-        missing = "The required " + missing +
-                  " shell is missing. Computations failed.";
-        throw(std::invalid_argument(missing));
+        const auto features = computeFeatureTransform(volume, to);
+        if (features(Coords(0, 0, 0)) == NoFeature)
+            _throwMissingShell(to);
+
+        const size_t width = volume.width();
+        const size_t height = volume.height();
+        volume.visit([&features, from, &segments, width, height](
+                         size_t x, size_t y, size_t z, const char& v) {
+            if (v != from)
+                return;
+            const unsigned int f = features(x, y, z);
+            segments.push_back(Segment(Coords(x, y, z),
+                                       Coords(f % width, (f / width) % height,
+                                              f / (width * height))));
+        });
+        return segments;
     }
+
+    auto index = volume.createIndex(to);
+    if (index.size() == 0)
+        _throwMissingShell(to);
     volume.visit(
         [index, from, &segments](size_t x, size_t y, size_t z, const char& v) {
             if (v != from)
@@ -70,97 +1160,672 @@ Segments findNearestVoxels(const Volume<char>& volume, char from, char to)
     return segments;
 }
 
-SegmentIndex computeSegmentIndex(const Volume<char>& shell)
+SegmentRecords computeSegmentRecords(const Volume<char>& shell,
+                                     const NearestVoxelMethod method)
 {
-    auto segments = findNearestVoxels(shell, Bottom, Top);
-    auto segments2 = findNearestVoxels(shell, Top, Bottom);
+    auto segments = findNearestVoxels(shell, Bottom, Top, method);
+    auto segments2 = findNearestVoxels(shell, Top, Bottom, method);
     // We need to reverse the second set of segments to make sure all go in
     // the same direction.
     for (const auto& segment : segments2)
         segments.push_back(Segment(segment.second, segment.first));
 
-    return SegmentIndex(segments.begin(), segments.end());
+    if (segments.size() >= std::numeric_limits<unsigned int>::max())
+        throw std::runtime_error("Too many segments");
+    SegmentRecords records(segments.size());
+#pragma omp parallel for
+    for (size_t i = 0; i < segments.size(); ++i)
+        records[i] = SegmentRecord(segments[i], i);
+    return records;
+}
+
+SegmentIndex computeSegmentIndex(const Volume<char>& shell,
+                                 const NearestVoxelMethod method)
+{
+    return SegmentIndex(computeSegmentRecords(shell, method));
+}
+
+namespace
+{
+// 64 bit FNV-1a hash.
+uint64_t _hash(const void* data, const size_t size,
+               uint64_t hash = 0xcbf29ce484222325)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i != size; ++i)
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    return hash;
+}
+
+// Hash of the dimensions and values of the shell. The z planes are hashed
+// in parallel and their hashes combined in order.
+uint64_t _hashShell(const Volume<char>& shell)
+{
+    size_t width, height, depth;
+    std::tie(width, height, depth) = shell.dimensions();
+    std::vector<uint64_t> hashes(depth + 1);
+    const uint64_t dimensions[] = {width, height, depth};
+    hashes[depth] = _hash(dimensions, sizeof(dimensions));
+#pragma omp parallel for schedule(dynamic)
+    for (size_t z = 0; z < depth; ++z)
+    {
+        uint64_t hash = _hash(0, 0);
+        for (size_t y = 0; y != height && width != 0; ++y)
+            hash = _hash(&shell(size_t(0), y, z), width, hash);
+        hashes[z] = hash;
+    }
+    return _hash(hashes.data(), sizeof(uint64_t) * hashes.size());
+}
+} // namespace
+
+SegmentIndex computeSegmentIndex(const Volume<char>& shell,
+                                 const NearestVoxelMethod method,
+                                 const std::string& cacheDirectory)
+{
+    if (cacheDirectory.empty())
+        return computeSegmentIndex(shell, method);
+
+    namespace fs = boost::filesystem;
+    std::stringstream name;
+    name << std::hex << std::setfill('0') << std::setw(16)
+         << _hashShell(shell) << "-" << method << ".index";
+    const fs::path path = fs::path(cacheDirectory) / name.str();
+    if (fs::exists(path))
+    {
+        try
+        {
+            return SegmentIndex(path.string());
+        }
+        catch (const std::runtime_error&)
+        {
+            // Replaced below, e.g. a file of another version.
+        }
+    }
+
+    auto index = computeSegmentIndex(shell, method);
+    // Written under a unique name and renamed, so that concurrent runs never
+    // see a partial file.
+    fs::create_directories(cacheDirectory);
+    const fs::path temporary = fs::unique_path(path.string() + ".%%%%%%%%");
+    index.save(temporary.string());
+    fs::rename(temporary, path);
+    return index;
+}
+
+namespace
+{
+// Calls store(x, y, z, relative distance) for every voxel, with NaN for the
+// voxels outside the shell.
+template <typename Store>
+void _computeRelativeDistances(const Volume<char>& shell,
+                               const SegmentIndex& index, const size_t setSize,
+                               const FieldOptions& options, const Store& store)
+{
+    const auto clear = [&store](size_t x, size_t y, size_t z) {
+        store(x, y, z, NAN);
+    };
+    if (options.tolerance > 0)
+    {
+        _forEachShellVoxelAdaptive(
+            shell, index, setSize, options, true, false,
+            [&store](size_t x, size_t y, size_t z, const Sample& sample) {
+                store(x, y, z, sample.relativeDistance);
+            },
+            clear);
+        return;
+    }
+
+    _forEachShellVoxel(
+        shell, index, setSize, options,
+        [&store](size_t x, size_t y, size_t z, const SegmentBatch& neighbours) {
+            store(x, y, z, _relativeDistance(neighbours, Point3f(x, y, z)));
+        },
+        clear);
 }
+} // namespace
 
 Volume<float> computeRelativeDistanceField(const Volume<char>& shell,
                                            const size_t setSize,
-                                           const SegmentIndex* inIndex)
+                                           const SegmentIndex* inIndex,
+                                           const FieldOptions& options)
 {
-    const SegmentIndex& index = inIndex ? *inIndex : computeSegmentIndex(shell);
+    SegmentIndex computed;
+    if (!inIndex)
+        computed = computeSegmentIndex(shell);
+    const SegmentIndex& index = inIndex ? *inIndex : computed;
 
     size_t width, height, depth;
     std::tie(width, height, depth) = shell.dimensions();
 
     Volume<float> field(width, height, depth, shell.metadata());
-    boost::progress_display progress(width * height);
+    _computeRelativeDistances(shell, index, setSize, options,
+                              [&field](size_t x, size_t y, size_t z,
+                                       const float value) {
+                                  field(x, y, z) = value;
+                              });
+    return field;
+}
 
-    for (size_t x = 0; x < width; ++x)
+std::tuple<Volume<float>, Volume<char>> computeRelativeDistancesAndLayers(
+    const Volume<char>& shell, const size_t setSize,
+    const LayerClassifier& classifier, const SegmentIndex* inIndex,
+    const FieldOptions& options)
+{
+    SegmentIndex computed;
+    if (!inIndex)
+        computed = computeSegmentIndex(shell);
+    const SegmentIndex& index = inIndex ? *inIndex : computed;
+
+    size_t width, height, depth;
+    std::tie(width, height, depth) = shell.dimensions();
+
+    Volume<float> field(width, height, depth, shell.metadata());
+    Volume<char> layers(width, height, depth, shell.metadata());
+    _computeRelativeDistances(shell, index, setSize, options,
+                              [&](size_t x, size_t y, size_t z,
+                                  const float value) {
+                                  field(x, y, z) = value;
+                                  layers(x, y, z) = classifier(value);
+                              });
+    return std::make_tuple(std::move(field), std::move(layers));
+}
+
+namespace
+{
+// Index of the top and bottom voxels in IncrementalSegmentation.
+int _side(const char label)
+{
+    return label == Top ? 0 : 1;
+}
+
+size_t _linearIndex(const Volume<char>& volume, const Coords& voxel)
+{
+    return voxel.get<0>() +
+           volume.width() * (voxel.get<1>() + volume.height() * voxel.get<2>());
+}
+
+int64_t _squaredDistance(const Coords& a, const Coords& b)
+{
+    const int64_t dx = int64_t(a.get<0>()) - b.get<0>();
+    const int64_t dy = int64_t(a.get<1>()) - b.get<1>();
+    const int64_t dz = int64_t(a.get<2>()) - b.get<2>();
+    return dx * dx + dy * dy + dz * dz;
+}
+
+Coords _nearestVoxel(const Volume<char>::Index& voxels, const Coords& voxel)
+{
+    Coords nearest;
+    voxels.query(boost::geometry::index::nearest(voxel, 1), &nearest);
+    return nearest;
+}
+
+// Returns the segment from the bottom to the top voxel.
+Segment _segment(const char label, const Coords& voxel, const Coords& nearest)
+{
+    return label == Bottom ? Segment(voxel, nearest) : Segment(nearest, voxel);
+}
+
+// Returns the squared distance from the point to the farthest segment of the
+// batch, computed like squaredDistance.
+float _farthestSquaredDistance(const SegmentBatch& batch, const Point3f& point)
+{
+    const float px = point.get<0>();
+    const float py = point.get<1>();
+    const float pz = point.get<2>();
+    const float* ox = batch.data(SegmentBatch::originX);
+    const float* oy = batch.data(SegmentBatch::originY);
+    const float* oz = batch.data(SegmentBatch::originZ);
+    const float* dx = batch.data(SegmentBatch::directionX);
+    const float* dy = batch.data(SegmentBatch::directionY);
+    const float* dz = batch.data(SegmentBatch::directionZ);
+    const float* length = batch.data(SegmentBatch::length);
+    float farthest = 0;
+#pragma omp simd reduction(max : farthest)
+    for (size_t i = 0; i < batch.size(); ++i)
     {
-#pragma omp parallel for schedule(dynamic)
-        for (size_t y = 0; y < height; ++y)
+        const float vx = px - ox[i];
+        const float vy = py - oy[i];
+        const float vz = pz - oz[i];
+        const float t = std::min(
+            length[i], std::max(0.f, dx[i] * vx + dy[i] * vy + dz[i] * vz));
+        const float wx = vx - dx[i] * t;
+        const float wy = vy - dy[i] * t;
+        const float wz = vz - dz[i] * t;
+        farthest = std::max(farthest, wx * wx + wy * wy + wz * wz);
+    }
+    return farthest;
+}
+} // namespace
+
+IncrementalSegmentation::IncrementalSegmentation(
+    const Volume<char>& shell, const size_t setSize,
+    const LayerClassifier& classifier, const SegmentIndex* index,
+    const FieldOptions& options)
+    : _shell(shell)
+    , _setSize(setSize)
+    , _classifier(classifier)
+    , _options(options)
+    , _relativeDistances(shell.width(), shell.height(), shell.depth(),
+                         shell.metadata())
+    , _layers(shell.width(), shell.height(), shell.depth(), shell.metadata())
+    , _radii(shell.width(), shell.height(), shell.depth(), shell.metadata())
+    , _pending(shell.width(), shell.height(), shell.depth())
+{
+    if (options.epsilon != 0 || options.tolerance != 0)
+        throw std::invalid_argument(
+            "Incremental segmentation requires exact queries");
+    _options.active = 0;
+    _options.evaluatedFraction = 0;
+
+    std::vector<Coords> voxels[2];
+    size_t shellVoxels = 0;
+    shell.visit([&voxels, &shellVoxels](size_t x, size_t y, size_t z,
+                                        const char& value) {
+        shellVoxels += value != Void;
+        if (value == Top || value == Bottom)
+            voxels[_side(value)].push_back(Coords(x, y, z));
+    });
+    const char labels[] = {Top, Bottom};
+    for (int side = 0; side != 2; ++side)
+    {
+        if (voxels[side].empty())
+            _throwMissingShell(labels[side]);
+        // Bulk loading gives a better tree than inserting the voxels.
+        _voxels[side] = Volume<char>::Index(voxels[side].begin(),
+                                            voxels[side].end());
+    }
+    if (index)
+        _setEntries(*index, voxels[1].size());
+    else
+    {
+        for (int side = 0; side != 2; ++side)
+        {
+            const auto& from = voxels[side];
+            const auto& to = _voxels[1 - side];
+            std::vector<Coords> nearest(from.size());
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (size_t i = 0; i < from.size(); ++i)
+                nearest[i] = _nearestVoxel(to, from[i]);
+            for (size_t i = 0; i != from.size(); ++i)
+                _entries[_linearIndex(shell, from[i])] =
+                    Entry{labels[side], from[i], nearest[i]};
+        }
+    }
+    _buildIndex();
+    _computeFields(0, 0, shell.depth());
+    _dirtyBox = LabelBox{{0, 0, 0},
+                         {shell.width(), shell.height(), shell.depth()},
+                         shellVoxels};
+}
+
+void IncrementalSegmentation::markChanged(const size_t x, const size_t y,
+                                          const size_t z)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _changed.insert(x + _shell.width() * (y + _shell.height() * z));
+}
+
+size_t IncrementalSegmentation::update()
+{
+    std::unordered_set<size_t> changed;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        changed.swap(_changed);
+    }
+    size_t width, height, depth;
+    std::tie(width, height, depth) = _shell.dimensions();
+
+    // The top and bottom voxels added and removed, and the voxels that
+    // entered the shell. The changes are checked before being applied so
+    // that this object stays usable if a label is missing.
+    struct Change
+    {
+        size_t index;
+        Coords voxel;
+        char from;
+        char to;
+    };
+    std::vector<Change> changes;
+    std::vector<Coords> entered;
+    const size_t previousSegments = _entries.size();
+    size_t counts[] = {_voxels[0].size(), _voxels[1].size()};
+    for (const size_t i : changed)
+    {
+        const Coords voxel(i % width, i / width % height, i / width / height);
+        const char value = _shell(voxel);
+        if (value != Void && std::isnan(_radii(voxel)))
+            entered.push_back(voxel);
+        else if (value == Void && !std::isnan(_radii(voxel)))
+        {
+            _relativeDistances(voxel) = NAN;
+            _layers(voxel) = 0;
+            _radii(voxel) = NAN;
+        }
+
+        const auto entry = _entries.find(i);
+        const char from = entry == _entries.end() ? Void : entry->second.label;
+        const char to = value == Top || value == Bottom ? value : Void;
+        if (from == to)
+            continue;
+        if (from != Void)
+            --counts[_side(from)];
+        if (to != Void)
+            ++counts[_side(to)];
+        changes.push_back(Change{i, voxel, from, to});
+    }
+    if (counts[0] == 0 || counts[1] == 0)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _changed.insert(changed.begin(), changed.end());
+        _throwMissingShell(counts[0] == 0 ? Top : Bottom);
+    }
+
+    // The segments of the removed voxels are changed segments. The new
+    // entries point to themselves until their nearest voxel is found.
+    Segments changedSegments;
+    std::unordered_set<size_t> removed[2];
+    std::vector<Coords> added[2];
+    for (const auto& change : changes)
+    {
+        if (change.from != Void)
+        {
+            const Entry& entry = _entries[change.index];
+            _voxels[_side(change.from)].remove(change.voxel);
+            removed[_side(change.from)].insert(change.index);
+            changedSegments.push_back(
+                _segment(entry.label, entry.voxel, entry.nearest));
+            _entries.erase(change.index);
+        }
+        if (change.to != Void)
+        {
+            _voxels[_side(change.to)].insert(change.voxel);
+            added[_side(change.to)].push_back(change.voxel);
+            _entries[change.index] =
+                Entry{change.to, change.voxel, change.voxel};
+        }
+    }
+
+    // The nearest voxel of an entry only changes if it was removed or if an
+    // added voxel is closer. Ties keep the current one.
+    const Volume<char>::Index addedVoxels[] = {
+        Volume<char>::Index(added[0].begin(), added[0].end()),
+        Volume<char>::Index(added[1].begin(), added[1].end())};
+    std::vector<Entry*> entries;
+    entries.reserve(_entries.size());
+    for (auto& item : _entries)
+        entries.push_back(&item.second);
+    std::vector<Coords> previous(entries.size());
+    std::vector<char> moved(entries.size(), 0);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        Entry& entry = *entries[i];
+        const int target = 1 - _side(entry.label);
+        const size_t current = _linearIndex(_shell, entry.nearest);
+        const bool fresh = current == _linearIndex(_shell, entry.voxel);
+        Coords nearest = entry.nearest;
+        if (fresh || removed[target].count(current))
+            nearest = _nearestVoxel(_voxels[target], entry.voxel);
+        else if (addedVoxels[target].size() != 0)
         {
-            for (size_t z = 0; z < depth; ++z)
+            const Coords candidate =
+                _nearestVoxel(addedVoxels[target], entry.voxel);
+            if (_squaredDistance(entry.voxel, candidate) <
+                _squaredDistance(entry.voxel, nearest))
             {
-                if (shell(x, y, z) == 0)
-                {
-                    field(x, y, z) = NAN;
+                nearest = candidate;
+            }
+        }
+        if (_linearIndex(_shell, nearest) == current)
+            continue;
+        previous[i] = entry.nearest;
+        moved[i] = fresh ? 2 : 1;
+        entry.nearest = nearest;
+    }
+    for (size_t i = 0; i != entries.size(); ++i)
+    {
+        const Entry& entry = *entries[i];
+        if (moved[i] == 1)
+            changedSegments.push_back(
+                _segment(entry.label, entry.voxel, previous[i]));
+        if (moved[i] != 0)
+            changedSegments.push_back(
+                _segment(entry.label, entry.voxel, entry.nearest));
+    }
+    _changedSegments = changedSegments.size();
+    if (!changedSegments.empty())
+        _buildIndex();
+
+    // A voxel can only have different k nearest segments if a changed
+    // segment is not farther than its k-th nearest one, so only the
+    // bounding box of the changed segments enlarged by the largest of these
+    // distances is searched. With at most k segments before or after the
+    // update, all segments are among the k nearest of every voxel and every
+    // voxel is recomputed.
+    const bool everywhere =
+        std::min(previousSegments, _entries.size()) <= _setSize;
+    float maxRadius = 0;
+#pragma omp parallel for reduction(max : maxRadius)
+    for (size_t z = 0; z < depth; ++z)
+    {
+        for (size_t y = 0; y != height; ++y)
+        {
+            for (size_t x = 0; x != width; ++x)
+            {
+                const float radius = _radii(x, y, z);
+                if (radius > maxRadius)
+                    maxRadius = radius;
+            }
+        }
+    }
+    const float reach = std::sqrt(maxRadius);
+    const size_t sizes[] = {width, height, depth};
+    float low[3], high[3];
+    std::fill(low, low + 3, std::numeric_limits<float>::infinity());
+    std::fill(high, high + 3, -std::numeric_limits<float>::infinity());
+    SegmentRecords records;
+    for (const auto& segment : changedSegments)
+    {
+        records.push_back(SegmentRecord(segment, records.size()));
+        const float ends[2][3] = {
+            {float(segment.first.get<0>()), float(segment.first.get<1>()),
+             float(segment.first.get<2>())},
+            {float(segment.second.get<0>()), float(segment.second.get<1>()),
+             float(segment.second.get<2>())}};
+        for (int axis = 0; axis != 3; ++axis)
+        {
+            low[axis] = std::min({low[axis], ends[0][axis], ends[1][axis]});
+            high[axis] = std::max({high[axis], ends[0][axis], ends[1][axis]});
+        }
+    }
+    size_t begin[3] = {0, 0, 0};
+    size_t end[3] = {0, 0, 0};
+    if (!records.empty())
+    {
+        for (int axis = 0; axis != 3; ++axis)
+        {
+            if (everywhere)
+            {
+                end[axis] = sizes[axis];
+                continue;
+            }
+            begin[axis] = size_t(std::max(0.f, std::floor(low[axis] - reach)));
+            end[axis] = std::min(sizes[axis],
+                                 size_t(std::ceil(high[axis] + reach)) + 1);
+        }
+    }
+    const SegmentIndex changedIndex(std::move(records));
+
+    const size_t boxHeight = end[1] - begin[1];
+    const size_t rows = boxHeight * (end[2] - begin[2]);
+    std::vector<std::vector<unsigned int>> dirtyRows(rows);
+#pragma omp parallel for schedule(dynamic, 16)
+    for (size_t row = 0; row < rows; ++row)
+    {
+        const size_t y = begin[1] + row % boxHeight;
+        const size_t z = begin[2] + row / boxHeight;
+        SegmentRecords nearest;
+        for (size_t x = begin[0]; x != end[0]; ++x)
+        {
+            if (_shell(x, y, z) == Void)
+                continue;
+            const float radius = _radii(x, y, z);
+            const Point3f point(x, y, z);
+            // The margin covers the rounding differences between the
+            // distances of the kernels and those of the index.
+            if (!everywhere && !std::isnan(radius))
+            {
+                changedIndex.nearest(point, 1, nearest);
+                if (squaredDistance(nearest[0], point) > radius * 1.0001f)
                     continue;
-                }
+            }
+            dirtyRows[row].push_back(x);
+        }
+    }
+
+    BitVolume dirty(width, height, depth);
+    size_t count = 0;
+    LabelBox box{{width, height, depth}, {0, 0, 0}, 0};
+    const auto mark = [&dirty, &count, &box](const size_t x, const size_t y,
+                                             const size_t z) {
+        if (dirty(x, y, z))
+            return;
+        dirty.set(x, y, z);
+        ++count;
+        const size_t coords[] = {x, y, z};
+        for (int axis = 0; axis != 3; ++axis)
+        {
+            box.begin[axis] = std::min(box.begin[axis], coords[axis]);
+            box.end[axis] = std::max(box.end[axis], coords[axis] + 1);
+        }
+    };
+    for (size_t row = 0; row != rows; ++row)
+    {
+        for (const unsigned int x : dirtyRows[row])
+            mark(x, begin[1] + row % boxHeight, begin[2] + row / boxHeight);
+    }
+    for (const auto& voxel : entered)
+        mark(voxel.get<0>(), voxel.get<1>(), voxel.get<2>());
+    _pending.visit(mark);
+
+    box.voxels = count;
+    if (count == 0)
+        box = LabelBox{{0, 0, 0}, {0, 0, 0}, 0};
+    else
+    {
+        try
+        {
+            _computeFields(&dirty, box.begin[2], box.end[2]);
+        }
+        catch (const Cancelled&)
+        {
+            _pending = dirty;
+            throw;
+        }
+        _pending.fill(false);
+    }
+    _dirtyBox = box;
+    return count;
+}
 
-                Segments neighbours;
-
-                // Computing the relative position of this voxel along a
-                // virtual top bottom line.
-                // For this we use this measures:
-                // - The average of the relative position of its projection
-                //   to the `setSize' nearest lines connecting top and bottom
-                //   voxels (a)
-                // - And the relative position on the nearest line (b)
-                // The final result is computed as t^8 * a + (1 - t^8) * b where
-                // t is 1 - (b - 0.5) * 2 if b > 0.5 or b * 2 if b < 0.5
-                // The average is good for points between top and bottom but
-                // tends to move distances to the center, the linear
-                // interpolation with the closest distance correct this drift
-                // near the outer shell.
-                Coords coords(x, y, z);
-
-                const Point3f point(x, y, z);
-                index.query(boost::geometry::index::nearest(coords, 1),
-                            std::back_inserter(neighbours));
-                float relativeToClosest =
-                    _relativePositionOnSegment(neighbours[0], point);
-
-                neighbours.clear();
-                index.query(boost::geometry::index::nearest(coords, setSize),
-                            std::back_inserter(neighbours));
-                float average = 0;
-
-                for (const auto& segment : neighbours)
-                    average += _relativePositionOnSegment(segment, point);
-
-                average /= neighbours.size();
-
-                const float t = relativeToClosest < 0.5
-                                    ? 1 - relativeToClosest * 2
-                                    : (relativeToClosest - 0.5) * 2;
-                const float t8 = std::pow(t, 8);
-                const float pos = relativeToClosest * t8 + average * (1 - t8);
-
-                field(x, y, z) = pos;
+void IncrementalSegmentation::_setEntries(const SegmentIndex& index,
+                                          const size_t bottomVoxels)
+{
+    // The records of computeSegmentRecords number the segments of the
+    // bottom voxels first.
+    const auto mismatch = [] {
+        throw std::invalid_argument("The segment index does not match the "
+                                    "shell");
+    };
+    if (index.size() != _voxels[0].size() + _voxels[1].size())
+        mismatch();
+    for (size_t i = 0; i != index.size(); ++i)
+    {
+        const SegmentRecord& record = index.records()[i];
+        const bool bottom = record.id < bottomVoxels;
+        const Coords& voxel =
+            bottom ? record.segment.first : record.segment.second;
+        const Coords& nearest =
+            bottom ? record.segment.second : record.segment.first;
+        const Coords* coords[] = {&voxel, &nearest};
+        for (const Coords* c : coords)
+        {
+            if (c->get<0>() >= _shell.width() ||
+                c->get<1>() >= _shell.height() || c->get<2>() >= _shell.depth())
+            {
+                mismatch();
             }
-#pragma omp critical
-            ++progress;
         }
+        if (_shell(voxel) != (bottom ? Bottom : Top) ||
+            _shell(nearest) != (bottom ? Top : Bottom))
+        {
+            mismatch();
+        }
+        _entries[_linearIndex(_shell, voxel)] =
+            Entry{bottom ? char(Bottom) : char(Top), voxel, nearest};
     }
+    if (_entries.size() != index.size())
+        mismatch();
+}
 
-    return field;
+void IncrementalSegmentation::_buildIndex()
+{
+    if (_entries.size() >= std::numeric_limits<unsigned int>::max())
+        throw std::runtime_error("Too many segments");
+    // The bottom and then the top voxels in storage order like in
+    // computeSegmentRecords, so that the index does not depend on the order
+    // of the edits.
+    std::vector<std::tuple<bool, size_t, const Entry*>> entries;
+    entries.reserve(_entries.size());
+    for (const auto& item : _entries)
+        entries.emplace_back(item.second.label == Top, item.first,
+                             &item.second);
+    std::sort(entries.begin(), entries.end());
+    SegmentRecords records(entries.size());
+#pragma omp parallel for
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const Entry& entry = *std::get<2>(entries[i]);
+        records[i] = SegmentRecord(
+            _segment(entry.label, entry.voxel, entry.nearest), i);
+    }
+    _index = SegmentIndex(std::move(records));
+}
+
+void IncrementalSegmentation::_computeFields(const BitVolume* mask,
+                                             const size_t zBegin,
+                                             const size_t zEnd)
+{
+    FieldOptions options = _options;
+    options.active = mask;
+    _forEachShellVoxel(
+        _shell, _index, _setSize, options,
+        [this](size_t x, size_t y, size_t z, const SegmentBatch& neighbours) {
+            const Point3f point(x, y, z);
+            const float value = _relativeDistance(neighbours, point);
+            _relativeDistances(x, y, z) = value;
+            _layers(x, y, z) = _classifier(value);
+            _radii(x, y, z) = _farthestSquaredDistance(neighbours, point);
+        },
+        [this, mask](size_t x, size_t y, size_t z) {
+            // Outside of the mask the previous values are kept.
+            if (mask)
+                return;
+            _relativeDistances(x, y, z) = NAN;
+            _layers(x, y, z) = 0;
+            _radii(x, y, z) = NAN;
+        },
+        zBegin, zEnd);
 }
 
 std::tuple<Volume<Point3f>, Volume<float>> computeOrientationsAndHeights(
     const Volume<char>& shell, const size_t setSize,
-    const SegmentIndex* inIndex)
+    const SegmentIndex* inIndex, const FieldOptions& options)
 {
-    const SegmentIndex& index = inIndex ? *inIndex : computeSegmentIndex(shell);
+    SegmentIndex computed;
+    if (!inIndex)
+        computed = computeSegmentIndex(shell);
+    const SegmentIndex& index = inIndex ? *inIndex : computed;
 
     size_t width, height, depth;
     std::tie(width, height, depth) = shell.dimensions();
@@ -170,98 +1835,228 @@ std::tuple<Volume<Point3f>, Volume<float>> computeOrientationsAndHeights(
         "none " + point3_metadata["space directions"];
     Volume<Point3f> orientations(width, height, depth, point3_metadata);
     Volume<float> heights(width, height, depth, shell.metadata());
-    boost::progress_display progress(width * height);
 
-    for (size_t i = 0; i < width; ++i)
+    const auto clear = [&orientations, &heights](size_t i, size_t j,
+                                                 size_t k) {
+        orientations(i, j, k) = Point3f(0, 0, 0);
+        heights(i, j, k) = NAN;
+    };
+    if (options.tolerance > 0)
     {
-#pragma omp parallel for schedule(dynamic)
-        for (size_t j = 0; j < height; ++j)
-        {
-            for (size_t k = 0; k < depth; ++k)
-            {
-                if (shell(i, j, k) == 0)
-                {
-                    orientations(i, j, k) = Point3f(0, 0, 0);
-                    heights(i, j, k) = NAN;
-                    continue;
-                }
+        _forEachShellVoxelAdaptive(
+            shell, index, setSize, options, false, true,
+            [&orientations, &heights](size_t i, size_t j, size_t k,
+                                      const Sample& sample) {
+                orientations(i, j, k) = sample.orientation;
+                heights(i, j, k) = sample.height;
+            },
+            clear);
+        return std::make_tuple(std::move(orientations), std::move(heights));
+    }
 
-                Segments neighbours;
-                Coords coords(i, j, k);
-                using namespace boost::geometry;
-                index.query(index::nearest(coords, setSize),
-                            std::back_inserter(neighbours));
+    _forEachShellVoxel(
+        shell, index, setSize, options,
+        [&orientations, &heights](size_t i, size_t j, size_t k,
+                                  const SegmentBatch& neighbours) {
+            std::tie(orientations(i, j, k), heights(i, j, k)) =
+                _orientationAndHeight(neighbours);
+        },
+        clear);
 
-                Point3f averageDirection(0, 0, 0);
-                float averageLength = 0;
-                for (const auto& segment : neighbours)
-                {
-                    Point3f p(segment.first.get<0>(), segment.first.get<1>(),
-                              segment.first.get<2>());
-                    Point3f q(segment.second.get<0>(), segment.second.get<1>(),
-                              segment.second.get<2>());
-                    Segmentf s(p, q);
-                    subtract_point(q, p);
-                    const auto l = length(s);
-                    averageLength += l;
-                    divide_value(q, l);
-                    averageDirection += q;
-                }
+    return std::make_tuple(std::move(orientations), std::move(heights));
+}
 
-                const auto x = averageDirection.get<0>();
-                const auto y = averageDirection.get<1>();
-                const auto z = averageDirection.get<2>();
-                const auto l = std::sqrt(x * x + y * y + z * z);
-                divide_value(averageDirection, l);
+Fields computeFields(const Volume<char>& shell, const size_t setSize,
+                     const SegmentIndex* inIndex, const FieldOptions& options)
+{
+    SegmentIndex computed;
+    if (!inIndex)
+        computed = computeSegmentIndex(shell);
+    const SegmentIndex& index = inIndex ? *inIndex : computed;
 
-                averageLength = averageLength / neighbours.size();
+    Fields fields = _makeFields(shell, shell.depth());
+    _computeFields(shell, index, setSize, options, fields,
+                   [&fields](size_t x, size_t y, size_t z) {
+                       _clearFields(fields, x, y, z);
+                   });
+    return fields;
+}
 
-                orientations(i, j, k) = averageDirection;
-                heights(i, j, k) = averageLength;
-            }
-#pragma omp critical
-            ++progress;
+size_t fieldSlabDepth(const Volume<char>& shell, const size_t bytesPerVoxel,
+                      const size_t budget)
+{
+    const size_t plane = shell.width() * shell.height() * bytesPerVoxel;
+    const size_t depth = plane ? budget / plane : shell.depth();
+    return std::max(AdaptiveTileSize,
+                    depth / AdaptiveTileSize * AdaptiveTileSize);
+}
+
+void computeFieldSlabs(const Volume<char>& shell, const size_t setSize,
+                       const size_t slabDepth, const FieldSlabConsumer& consume,
+                       const SegmentIndex* inIndex,
+                       const FieldOptions& options)
+{
+    if (slabDepth == 0)
+        throw std::invalid_argument("The slab depth must be positive");
+
+    SegmentIndex computed;
+    if (!inIndex)
+        computed = computeSegmentIndex(shell);
+    const SegmentIndex& index = inIndex ? *inIndex : computed;
+
+    // The evaluated fraction of each slab is weighted by its shell voxels.
+    FieldOptions slabOptions = options;
+    float fraction = 0;
+    slabOptions.evaluatedFraction = &fraction;
+    size_t voxels = 0;
+    double evaluated = 0;
+
+    for (size_t z = 0; z < shell.depth(); z += slabDepth)
+    {
+        const size_t end = std::min(z + slabDepth, shell.depth());
+        Fields fields = _makeFields(shell, end - z);
+        _computeFields(shell, index, setSize, slabOptions, fields,
+                       [&fields](size_t x, size_t y, size_t k) {
+                           _clearFields(fields, x, y, k);
+                       },
+                       z, end);
+        if (options.tolerance > 0)
+        {
+            const ActiveVoxels active(shell, options);
+            size_t count = 0;
+            for (size_t k = z; k != end; ++k)
+                for (size_t y = 0; y != shell.height(); ++y)
+                    for (size_t x = 0; x != shell.width(); ++x)
+                        count += active(x, y, k);
+            voxels += count;
+            evaluated += double(fraction) * count;
         }
+        consume(fields, z);
     }
 
-    return std::make_tuple(std::move(orientations), std::move(heights));
+    if (options.evaluatedFraction)
+        *options.evaluatedFraction = voxels ? evaluated / voxels : 0;
+}
+
+SparseFields computeSparseFields(const Volume<char>& shell,
+                                 const size_t setSize,
+                                 const SegmentIndex* inIndex,
+                                 const FieldOptions& options)
+{
+    SegmentIndex computed;
+    if (!inIndex)
+        computed = computeSegmentIndex(shell);
+    const SegmentIndex& index = inIndex ? *inIndex : computed;
+
+    auto point3_metadata = shell.metadata();
+    point3_metadata["space directions"] =
+        "none " + point3_metadata["space directions"];
+    SparseVolume<float> relativeDistances(
+        shell, [](const char v) { return v != 0; }, NAN, shell.metadata());
+    SparseVolume<Point3f> orientations(relativeDistances, Point3f(0, 0, 0),
+                                       point3_metadata);
+    SparseVolume<float> heights(relativeDistances, NAN, shell.metadata());
+    SparseVolume<float> distances(relativeDistances, NAN, shell.metadata());
+    SparseFields fields{std::move(relativeDistances), std::move(orientations),
+                        std::move(heights), std::move(distances)};
+
+    // The empty voxels are not stored.
+    _computeFields(shell, index, setSize, options, fields,
+                   [](size_t, size_t, size_t) {});
+    return fields;
+}
+
+FieldDeviation estimateFieldDeviation(const Volume<char>& shell,
+                                      const size_t setSize,
+                                      const SegmentIndex& index,
+                                      const Volume<float>* relativeDistances,
+                                      const Volume<Point3f>* orientations,
+                                      const size_t samples)
+{
+    return _estimateFieldDeviation(shell, setSize, index, relativeDistances,
+                                   orientations, samples);
+}
+
+FieldDeviation estimateFieldDeviation(
+    const Volume<char>& shell, const size_t setSize, const SegmentIndex& index,
+    const SparseVolume<float>* relativeDistances,
+    const SparseVolume<Point3f>* orientations, const size_t samples)
+{
+    return _estimateFieldDeviation(shell, setSize, index, relativeDistances,
+                                   orientations, samples);
+}
+
+std::ostream& operator<<(std::ostream& out, const FieldDeviation& deviation)
+{
+    out << "Maximum deviation over " << deviation.samples << " samples:";
+    if (!std::isnan(deviation.relativeDistance))
+        out << " relative distance " << deviation.relativeDistance;
+    if (!std::isnan(deviation.orientation))
+        out << " orientation " << deviation.orientation << " degrees";
+    return out;
+}
+
+LayerClassifier::LayerClassifier(const std::vector<float>& separations,
+                                 const bool bottomUp)
+    : _bottomUp(bottomUp)
+{
+    // The layer of a value is 1 plus the number of thresholds above it once
+    // they are made non increasing.
+    float threshold = std::numeric_limits<float>::infinity();
+    for (const float separation : separations)
+    {
+        threshold = std::min(threshold, 1 - separation);
+        _thresholds.push_back(threshold);
+    }
+}
+
+void LayerClassifier::operator()(const float* values, char* layers,
+                                 const size_t count) const
+{
+    // Branchless compare and count, one threshold at a time so that the
+    // loops over the values are vectorized.
+    if (_bottomUp)
+    {
+#pragma omp simd
+        for (size_t i = 0; i < count; ++i)
+            layers[i] = 1 - values[i] == 1 - values[i];
+        for (const float threshold : _thresholds)
+        {
+#pragma omp simd
+            for (size_t i = 0; i < count; ++i)
+                layers[i] += 1 - values[i] <= threshold;
+        }
+        return;
+    }
+#pragma omp simd
+    for (size_t i = 0; i < count; ++i)
+        layers[i] = values[i] == values[i];
+    for (const float threshold : _thresholds)
+    {
+#pragma omp simd
+        for (size_t i = 0; i < count; ++i)
+            layers[i] += values[i] <= threshold;
+    }
 }
 
 Volume<char> annotateLayers(const Volume<float>& distanceField,
-                            const std::vector<float>& separations)
+                            const std::vector<float>& separations,
+                            const bool bottomUp)
 {
     size_t width, height, depth;
     std::tie(width, height, depth) = distanceField.dimensions();
     Volume<char> layers(width, height, depth, distanceField.metadata());
+    if (width == 0)
+        return layers;
 
-    boost::progress_display progress(width * height);
-    for (size_t x = 0; x < width; ++x)
+    const LayerClassifier classifier(separations, bottomUp);
+#pragma omp parallel for schedule(dynamic, 16)
+    for (long long i = 0; i < (long long)(height * depth); ++i)
     {
-#pragma omp parallel for schedule(dynamic)
-        for (size_t y = 0; y < height; ++y)
-        {
-            for (size_t z = 0; z < depth; ++z)
-            {
-                auto value = distanceField(x, y, z);
-                if (std::isnan(value))
-                {
-                    layers(x, y, z) = 0;
-                    continue;
-                }
-
-                // Finding out in which layer this voxel falls
-                char layer = 1;
-                for (auto s : separations)
-                {
-                    if (value > 1 - s)
-                        break;
-                    layer++;
-                }
-                layers(x, y, z) = layer;
-            }
-#pragma omp critical
-            ++progress;
-        }
+        const size_t y = i % height;
+        const size_t z = i / height;
+        classifier(&distanceField(size_t(0), y, z), &layers(size_t(0), y, z),
+                   width);
     }
     return layers;
 }
@@ -309,6 +2104,8 @@ void clearOutsideRange(Volume<T>& volume,
     CLEAR_OUTSIDE_RANGE_AXIS(T, 2)
 
 CLEAR_OUTSIDE_RANGE(unsigned int)
+CLEAR_OUTSIDE_RANGE(int)
 CLEAR_OUTSIDE_RANGE(unsigned short)
+CLEAR_OUTSIDE_RANGE(unsigned char)
 CLEAR_OUTSIDE_RANGE(char)
 CLEAR_OUTSIDE_RANGE(float)
@@ -1,29 +1,405 @@
 #ifndef REGIODESICS_ALGORITHM_H
 #define REGIODESICS_ALGORITHM_H
 
+#include "BitVolume.h"
+#include "SegmentIndex.h"
+#include "SparseVolume.h"
 #include "Volume.h"
+#include "kernels.h"
 #include "types.h"
 
 #include <boost/geometry/arithmetic/arithmetic.hpp>
 
-Volume<char> annotateBoundaryVoxels(const Volume<unsigned int>& volume);
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
-Segments findNearestVoxels(const Volume<char>& volume, char from, char to);
+// Labels the voxels of a region of the volume as Shell or Interior depending
+// on whether they have a neighbour outside of it, and the other voxels as
+// Void. The region is made of the voxels with the given label, or of all the
+// non zero voxels if label is 0. The neighbours of a voxel are its 6 face
+// neighbours, or with a connectivity of 18 or 26 also its edge and corner
+// neighbours. Voxels at the border of the volume are always Shell.
+// Instantiated for unsigned char, unsigned short, unsigned int and int
+// labels, and for LinearStorage and BrickStorage<>.
+template <typename T, typename Storage>
+Volume<char, Storage> annotateBoundaryVoxels(
+    const Volume<T, Storage>& volume, size_t connectivity = 6,
+    typename Volume<T, Storage>::Value label = 0);
 
-using SegmentIndex =
-    boost::geometry::index::rtree<Segment, boost::geometry::index::rstar<16>>;
+// Bounding box [begin, end) of the voxels of a label, and their number.
+struct LabelBox
+{
+    size_t begin[3];
+    size_t end[3];
+    size_t voxels;
+};
+
+// Returns the bounding boxes of the given labels, found in a single pass over
+// the volume. The labels without voxels are left out. Instantiated for the
+// same label types as annotateBoundaryVoxels.
+template <typename T>
+std::map<T, LabelBox> computeLabelBoxes(const Volume<T>& volume,
+                                        const std::vector<T>& labels);
+
+// Strategy used to pair every voxel of a label with its closest voxel of
+// another label.
+enum class NearestVoxelMethod
+{
+    // One R-tree nearest neighbour query per voxel.
+    rtree,
+    // A single exact Euclidean feature transform of the whole volume.
+    featureTransform
+};
+
+std::istream& operator>>(std::istream& in, NearestVoxelMethod& method);
+std::ostream& operator<<(std::ostream& out, NearestVoxelMethod method);
+
+// Value stored by computeFeatureTransform when the volume has no voxel with
+// the requested value.
+const unsigned int NoFeature = std::numeric_limits<unsigned int>::max();
+
+// Returns a volume that stores for each voxel the linear index
+// (z * width * height + y * width + x) of its closest voxel (in Euclidean
+// distance) whose value is `value`.
+Volume<unsigned int> computeFeatureTransform(const Volume<char>& volume,
+                                             char value);
+
+Segments findNearestVoxels(
+    const Volume<char>& volume, char from, char to,
+    NearestVoxelMethod method = NearestVoxelMethod::rtree);
+
+// Returns the segments connecting the nearest bottom and top voxels of the
+// shell, all going from bottom to top. Record ids number the segments in
+// creation order.
+SegmentRecords computeSegmentRecords(
+    const Volume<char>& shell,
+    NearestVoxelMethod method = NearestVoxelMethod::rtree);
+
+// Makes the rtree index the segment of each record.
+struct SegmentRecordIndexable
+{
+    using result_type = const Segment&;
+    result_type operator()(const SegmentRecord& record) const
+    {
+        return record.segment;
+    }
+};
+
+// Boost R-tree alternative to SegmentIndex, used for benchmarking.
+using SegmentRTree =
+    boost::geometry::index::rtree<SegmentRecord,
+                                  boost::geometry::index::rstar<16>,
+                                  SegmentRecordIndexable>;
 
-SegmentIndex computeSegmentIndex(const Volume<char>& shell);
+// Returns the index of the segments given by computeSegmentRecords.
+SegmentIndex computeSegmentIndex(
+    const Volume<char>& shell,
+    NearestVoxelMethod method = NearestVoxelMethod::rtree);
 
-Volume<float> computeRelativeDistanceField(const Volume<char>& shell,
-                                           size_t lineSetSize,
-                                           const SegmentIndex* index = 0);
+// Same as computeSegmentIndex, but looking for the index first in a cache
+// directory, where index files are named after a hash of the dimensions and
+// values of the shell and the method. A cached index is mapped and used as
+// is. Otherwise the index is computed and saved to the directory, which is
+// created if needed. An empty directory name disables the cache.
+SegmentIndex computeSegmentIndex(const Volume<char>& shell,
+                                 NearestVoxelMethod method,
+                                 const std::string& cacheDirectory);
+
+// Thrown by the field computations cancelled with FieldOptions::cancel.
+class Cancelled : public std::runtime_error
+{
+public:
+    Cancelled()
+        : std::runtime_error("Computation cancelled")
+    {
+    }
+};
+
+// Options of the per-voxel field kernels.
+struct FieldOptions
+{
+    // Visit voxels brick by brick in a continuous (boustrophedon) order and
+    // bound each k-nearest segment query with the result of the previous
+    // voxel, instead of starting every query from the root of the index.
+    bool coherent = false;
+    // Accept (1 + epsilon)-approximate neighbours: the distance to the i-th
+    // segment found is at most (1 + epsilon) times the distance to the true
+    // i-th nearest segment. 0 gives exact queries.
+    float epsilon = 0;
+    // If > 0, evaluate the fields on a coarse lattice and interpolate them,
+    // refining the blocks near the shell boundary or where the
+    // interpolation error at a few sample voxels exceeds this tolerance.
+    // The error is measured on the relative distance, the unit orientation
+    // vector and the height relative to its value. The coherent option is
+    // ignored in this mode.
+    float tolerance = 0;
+    // If not null, receives the number of exact kernel evaluations of the
+    // adaptive mode divided by the number of shell voxels.
+    float* evaluatedFraction = 0;
+    // If not null, only the shell voxels set in this mask are computed, the
+    // others are left empty like the voxels outside the shell.
+    const BitVolume* active = 0;
+    // Stream of the progress bar of the traversals, none if null.
+    std::ostream* progress = &std::cout;
+    // If not null, set to the fraction of the tiles of the current traversal
+    // done, e.g. to show the progress from another thread.
+    std::atomic<float>* completion = 0;
+    // If not null, polled before each tile. Once it is true the remaining
+    // tiles are skipped and the traversal throws Cancelled.
+    const std::atomic<bool>* cancel = 0;
+};
+
+Volume<float> computeRelativeDistanceField(
+    const Volume<char>& shell, size_t lineSetSize,
+    const SegmentIndex* index = 0,
+    const FieldOptions& options = FieldOptions());
 std::tuple<Volume<Point3f>, Volume<float>> computeOrientationsAndHeights(
     const Volume<char>& shell, size_t lineSetSize,
-    const SegmentIndex* index = 0);
+    const SegmentIndex* index = 0,
+    const FieldOptions& options = FieldOptions());
+
+// Output of computeFields. Heights and distances are in the units of the
+// space directions of the shell volume.
+struct Fields
+{
+    Volume<float> relativeDistances;
+    Volume<Point3f> orientations;
+    Volume<float> heights;
+    Volume<float> distances;
+};
+
+// Computes the relative distance, orientation, height and distance to the
+// bottom shell fields from a single k-nearest segment query per voxel.
+Fields computeFields(const Volume<char>& shell, size_t lineSetSize,
+                     const SegmentIndex* index = 0,
+                     const FieldOptions& options = FieldOptions());
+
+// Receives the fields of the z planes [z, z + slab depth) of the shell,
+// stored from z = 0 with the metadata of the shell. The slab may be moved
+// away, e.g. to write it in the background while the next one is computed.
+using FieldSlabConsumer = std::function<void(Fields& slab, size_t z)>;
+
+// Out-of-core version of computeFields for shells whose fields do not fit in
+// memory. The fields are computed for one slab of `slabDepth` z planes at a
+// time and passed to `consume` in increasing z order, so only the shell, the
+// index and the fields of a slab are in memory. The results are the same as
+// with computeFields, provided slabDepth is a multiple of 16 in the adaptive
+// mode.
+void computeFieldSlabs(const Volume<char>& shell, size_t lineSetSize,
+                       size_t slabDepth, const FieldSlabConsumer& consume,
+                       const SegmentIndex* index = 0,
+                       const FieldOptions& options = FieldOptions());
+
+// Returns the largest slab depth of computeFieldSlabs for which `budget`
+// bytes hold `bytesPerVoxel` bytes per voxel of a slab (24 for the fields
+// alone). The depth is rounded down to a multiple of the tile size of the
+// adaptive mode, which is also the minimum.
+size_t fieldSlabDepth(const Volume<char>& shell, size_t bytesPerVoxel,
+                      size_t budget);
+
+// Output of computeSparseFields, with values only for the non empty voxels
+// of the shell.
+struct SparseFields
+{
+    SparseVolume<float> relativeDistances;
+    SparseVolume<Point3f> orientations;
+    SparseVolume<float> heights;
+    SparseVolume<float> distances;
+};
+
+// Same as computeFields but storing the fields in sparse volumes, which
+// takes much less memory when the shell only fills a small part of its
+// bounding volume. The void voxels have the same values as with
+// computeFields.
+SparseFields computeSparseFields(const Volume<char>& shell,
+                                 size_t lineSetSize,
+                                 const SegmentIndex* index = 0,
+                                 const FieldOptions& options = FieldOptions());
+
+// Maximum deviations of approximate fields with respect to the exact ones,
+// NaN for the fields not checked.
+struct FieldDeviation
+{
+    float relativeDistance = NAN;
+    // Angle in degrees.
+    float orientation = NAN;
+    size_t samples = 0;
+};
+
+std::ostream& operator<<(std::ostream& out, const FieldDeviation& deviation);
+
+// Estimates the deviation of fields computed with FieldOptions::epsilon > 0
+// by evaluating the exact kernels on about `samples` shell voxels. Either
+// field may be null.
+FieldDeviation estimateFieldDeviation(const Volume<char>& shell,
+                                      size_t lineSetSize,
+                                      const SegmentIndex& index,
+                                      const Volume<float>* relativeDistances,
+                                      const Volume<Point3f>* orientations,
+                                      size_t samples = 1000);
+FieldDeviation estimateFieldDeviation(
+    const Volume<char>& shell, size_t lineSetSize, const SegmentIndex& index,
+    const SparseVolume<float>* relativeDistances,
+    const SparseVolume<Point3f>* orientations, size_t samples = 1000);
+
+// Assigns layers to relative distances. The layers are numbered from 1 at
+// the top (relative distance 1), a voxel being in the layer after the
+// separations s for which its relative distance is at most 1 - s, or from 1
+// at the bottom, comparing 1 - relative distance instead. NaN values are in
+// layer 0.
+class LayerClassifier
+{
+public:
+    explicit LayerClassifier(const std::vector<float>& separations,
+                             bool bottomUp = false);
+
+    char operator()(const float value) const
+    {
+        const float v = _bottomUp ? 1 - value : value;
+        char layer = v == v;
+        for (const float threshold : _thresholds)
+            layer += v <= threshold;
+        return layer;
+    }
+
+    // Assigns the layers of count consecutive values.
+    void operator()(const float* values, char* layers, size_t count) const;
+
+private:
+    // Non increasing, so that the values below a threshold are also below
+    // the previous ones.
+    std::vector<float> _thresholds;
+    bool _bottomUp;
+};
 
 Volume<char> annotateLayers(const Volume<float>& distanceField,
-                            const std::vector<float>& separations);
+                            const std::vector<float>& separations,
+                            bool bottomUp = false);
+
+// Computes the relative distance field and assigns the layer of each voxel
+// in the same pass, see computeRelativeDistanceField and annotateLayers.
+std::tuple<Volume<float>, Volume<char>> computeRelativeDistancesAndLayers(
+    const Volume<char>& shell, size_t lineSetSize,
+    const LayerClassifier& classifier, const SegmentIndex* index = 0,
+    const FieldOptions& options = FieldOptions());
+
+// Relative distances and layers of a shell whose top and bottom voxels are
+// edited, e.g. painted in layer_segmenter. Each top or bottom voxel keeps the
+// segment to its nearest opposite voxel, and after a batch of edits only the
+// segments whose nearest voxel can have changed are searched again: those of
+// the edited voxels and those whose nearest voxel was removed, the others
+// only checking the added voxels. The fields are then recomputed only at the
+// voxels closer to a changed segment than to their k-th nearest segment, the
+// only ones whose k nearest segments can have changed, or at all the voxels
+// if there are at most k segments before or after the edits. The results are
+// those of computeRelativeDistancesAndLayers on the edited shell, up to ties
+// between equidistant voxels or segments, as checked by index_benchmark. Only
+// exact queries are supported.
+class IncrementalSegmentation
+{
+public:
+    // Computes the segments and the fields of the whole shell, which must
+    // outlive this object. The initial segments are taken from the index if
+    // given, which must be that of computeSegmentIndex on the shell, e.g.
+    // with another nearest method or from a cache. Throws
+    // std::invalid_argument if the index does not match the shell or if the
+    // epsilon or tolerance options are not 0.
+    IncrementalSegmentation(const Volume<char>& shell, size_t lineSetSize,
+                            const LayerClassifier& classifier,
+                            const SegmentIndex* index = 0,
+                            const FieldOptions& options = FieldOptions());
+
+    // Records that a voxel of the shell has changed. May be called from
+    // another thread than update.
+    void markChanged(size_t x, size_t y, size_t z);
+
+    // Updates the segments, the index and the fields after the recorded
+    // changes. Returns the number of voxels recomputed. Throws
+    // std::invalid_argument if the shell has no top or bottom voxel left, in
+    // which case the changes are kept for the next update. If cancelled, the
+    // voxels not recomputed are recomputed by the next update.
+    size_t update();
+
+    const SegmentIndex& index() const { return _index; }
+    const Volume<float>& relativeDistances() const
+    {
+        return _relativeDistances;
+    }
+    const Volume<char>& layers() const { return _layers; }
+    // Bounding box of the voxels recomputed by the last update.
+    const LabelBox& dirtyBox() const { return _dirtyBox; }
+    // Number of segments that changed in the last update.
+    size_t changedSegments() const { return _changedSegments; }
+
+private:
+    // A top or bottom voxel and its nearest opposite voxel.
+    struct Entry
+    {
+        char label;
+        Coords voxel;
+        Coords nearest;
+    };
+
+    const Volume<char>& _shell;
+    size_t _setSize;
+    LayerClassifier _classifier;
+    FieldOptions _options;
+    // Top and bottom voxels.
+    Volume<char>::Index _voxels[2];
+    // Entries by linear voxel index.
+    std::unordered_map<size_t, Entry> _entries;
+    std::mutex _mutex;
+    std::unordered_set<size_t> _changed;
+    SegmentIndex _index;
+    Volume<float> _relativeDistances;
+    Volume<char> _layers;
+    // Squared distance of each shell voxel to its k-th nearest segment.
+    Volume<float> _radii;
+    // Voxels to recompute left by a cancelled update.
+    BitVolume _pending;
+    LabelBox _dirtyBox;
+    size_t _changedSegments = 0;
+
+    // Sets the entries from the records of computeSegmentRecords.
+    void _setEntries(const SegmentIndex& index, size_t bottomVoxels);
+    void _buildIndex();
+    // Computes the fields of the active voxels of the z planes [zBegin, zEnd)
+    // of the mask, or of all voxels if null.
+    void _computeFields(const BitVolume* mask, size_t zBegin, size_t zEnd);
+};
+
+// Returns a view of the voxels of the volume in the inclusive ranges
+// [first, second] of the x, y and z axes, clamped to the volume, as given by
+// the crop options of the apps.
+template <typename T>
+Volume<T> cropVolume(Volume<T>& volume,
+                     const std::pair<size_t, size_t>& xRange,
+                     const std::pair<size_t, size_t>& yRange,
+                     const std::pair<size_t, size_t>& zRange)
+{
+    const std::pair<size_t, size_t> ranges[] = {xRange, yRange, zRange};
+    const size_t sizes[] = {volume.width(), volume.height(), volume.depth()};
+    size_t begin[3];
+    size_t extent[3];
+    for (int axis = 0; axis != 3; ++axis)
+    {
+        begin[axis] = std::min(ranges[axis].first, sizes[axis]);
+        const size_t end =
+            sizes[axis] ? std::min(ranges[axis].second, sizes[axis] - 1) + 1
+                        : 0;
+        extent[axis] = end > begin[axis] ? end - begin[axis] : 0;
+    }
+    return volume.view(begin[0], begin[1], begin[2], extent[0], extent[1],
+                       extent[2]);
+}
 
 template <typename T, int axis>
 void clearOutsideRange(Volume<T>& volume,
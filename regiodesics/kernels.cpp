@@ -0,0 +1,305 @@
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REGIODESICS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+SegmentRecord::SegmentRecord(const Segment& input, const unsigned int index)
+    : segment(input)
+    , origin(point3d_cast<float>(input.first))
+    , id(index)
+{
+    direction = point3d_cast<float>(input.second);
+    direction -= origin;
+    length = std::sqrt(boost::geometry::dot_product(direction, direction));
+    inverseLength = 1 / length;
+    boost::geometry::multiply_value(direction, inverseLength);
+}
+
+void SegmentBatch::push_back(const SegmentRecord& record)
+{
+    if (_fields[0].size() == _size)
+    {
+        for (auto& field : _fields)
+            field.resize(std::max(size_t(16), _size * 2));
+    }
+
+    _fields[originX][_size] = record.origin.get<0>();
+    _fields[originY][_size] = record.origin.get<1>();
+    _fields[originZ][_size] = record.origin.get<2>();
+    _fields[directionX][_size] = record.direction.get<0>();
+    _fields[directionY][_size] = record.direction.get<1>();
+    _fields[directionZ][_size] = record.direction.get<2>();
+    _fields[length][_size] = record.length;
+    _fields[inverseLength][_size] = record.inverseLength;
+    ++_size;
+}
+
+namespace
+{
+struct Arrays
+{
+    Arrays(const SegmentBatch& batch)
+        : px(batch.data(SegmentBatch::originX))
+        , py(batch.data(SegmentBatch::originY))
+        , pz(batch.data(SegmentBatch::originZ))
+        , ux(batch.data(SegmentBatch::directionX))
+        , uy(batch.data(SegmentBatch::directionY))
+        , uz(batch.data(SegmentBatch::directionZ))
+        , length(batch.data(SegmentBatch::length))
+        , inverseLength(batch.data(SegmentBatch::inverseLength))
+    {
+    }
+    const float* px;
+    const float* py;
+    const float* pz;
+    const float* ux;
+    const float* uy;
+    const float* uz;
+    const float* length;
+    const float* inverseLength;
+};
+
+// boost::geometry points only have constructors for up to 3 coordinates.
+Point4f _point4f(const float* values)
+{
+    Point4f point;
+    point.set<0>(values[0]);
+    point.set<1>(values[1]);
+    point.set<2>(values[2]);
+    point.set<3>(values[3]);
+    return point;
+}
+
+// The distance from the origin to the projection of the point is the
+// absolute value of the dot product with the unit direction.
+inline float _relativePosition(const Arrays& a, const size_t i, const float cx,
+                               const float cy, const float cz)
+{
+    const float dot = a.ux[i] * (cx - a.px[i]) + a.uy[i] * (cy - a.py[i]) +
+                      a.uz[i] * (cz - a.pz[i]);
+    return std::min(1.f, std::abs(dot) * a.inverseLength[i]);
+}
+
+float _sumRelativePositionsScalar(const SegmentBatch& batch, const float cx,
+                                  const float cy, const float cz)
+{
+    const Arrays a(batch);
+    float sum = 0;
+    for (size_t i = 0; i != batch.size(); ++i)
+        sum += _relativePosition(a, i, cx, cy, cz);
+    return sum;
+}
+
+Point4f _sumDirectionsAndLengthsScalar(const SegmentBatch& batch)
+{
+    const Arrays a(batch);
+    float sums[] = {0, 0, 0, 0};
+    for (size_t i = 0; i != batch.size(); ++i)
+    {
+        sums[0] += a.ux[i];
+        sums[1] += a.uy[i];
+        sums[2] += a.uz[i];
+        sums[3] += a.length[i];
+    }
+    return _point4f(sums);
+}
+
+#ifdef REGIODESICS_X86_SIMD
+__attribute__((target("avx2,fma"))) float _sumRelativePositionsAVX2(
+    const SegmentBatch& batch, const float cx, const float cy, const float cz)
+{
+    const Arrays a(batch);
+    const size_t size = batch.size();
+    const __m256 x = _mm256_set1_ps(cx);
+    const __m256 y = _mm256_set1_ps(cy);
+    const __m256 z = _mm256_set1_ps(cz);
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 sign = _mm256_set1_ps(-0.f);
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        const __m256 vx = _mm256_sub_ps(x, _mm256_loadu_ps(a.px + i));
+        const __m256 vy = _mm256_sub_ps(y, _mm256_loadu_ps(a.py + i));
+        const __m256 vz = _mm256_sub_ps(z, _mm256_loadu_ps(a.pz + i));
+        __m256 dot = _mm256_mul_ps(_mm256_loadu_ps(a.ux + i), vx);
+        dot = _mm256_fmadd_ps(_mm256_loadu_ps(a.uy + i), vy, dot);
+        dot = _mm256_fmadd_ps(_mm256_loadu_ps(a.uz + i), vz, dot);
+        const __m256 t = _mm256_mul_ps(_mm256_andnot_ps(sign, dot),
+                                       _mm256_loadu_ps(a.inverseLength + i));
+        sum = _mm256_add_ps(sum, _mm256_min_ps(t, one));
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, sum);
+    float total = 0;
+    for (const float lane : lanes)
+        total += lane;
+    for (; i != size; ++i)
+        total += _relativePosition(a, i, cx, cy, cz);
+    return total;
+}
+
+__attribute__((target("avx2,fma"))) Point4f _sumDirectionsAndLengthsAVX2(
+    const SegmentBatch& batch)
+{
+    const Arrays a(batch);
+    const size_t size = batch.size();
+    __m256 sums[] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                     _mm256_setzero_ps(), _mm256_setzero_ps()};
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        sums[0] = _mm256_add_ps(sums[0], _mm256_loadu_ps(a.ux + i));
+        sums[1] = _mm256_add_ps(sums[1], _mm256_loadu_ps(a.uy + i));
+        sums[2] = _mm256_add_ps(sums[2], _mm256_loadu_ps(a.uz + i));
+        sums[3] = _mm256_add_ps(sums[3], _mm256_loadu_ps(a.length + i));
+    }
+
+    float totals[4];
+    for (int j = 0; j != 4; ++j)
+    {
+        float lanes[8];
+        _mm256_storeu_ps(lanes, sums[j]);
+        totals[j] = 0;
+        for (const float lane : lanes)
+            totals[j] += lane;
+    }
+    for (; i != size; ++i)
+    {
+        totals[0] += a.ux[i];
+        totals[1] += a.uy[i];
+        totals[2] += a.uz[i];
+        totals[3] += a.length[i];
+    }
+    return _point4f(totals);
+}
+
+__attribute__((target("avx512f"))) float _sumRelativePositionsAVX512(
+    const SegmentBatch& batch, const float cx, const float cy, const float cz)
+{
+    const Arrays a(batch);
+    const size_t size = batch.size();
+    const __m512 x = _mm512_set1_ps(cx);
+    const __m512 y = _mm512_set1_ps(cy);
+    const __m512 z = _mm512_set1_ps(cz);
+    const __m512 one = _mm512_set1_ps(1.f);
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m512 vx = _mm512_sub_ps(x, _mm512_loadu_ps(a.px + i));
+        const __m512 vy = _mm512_sub_ps(y, _mm512_loadu_ps(a.py + i));
+        const __m512 vz = _mm512_sub_ps(z, _mm512_loadu_ps(a.pz + i));
+        __m512 dot = _mm512_mul_ps(_mm512_loadu_ps(a.ux + i), vx);
+        dot = _mm512_fmadd_ps(_mm512_loadu_ps(a.uy + i), vy, dot);
+        dot = _mm512_fmadd_ps(_mm512_loadu_ps(a.uz + i), vz, dot);
+        const __m512 t = _mm512_mul_ps(_mm512_abs_ps(dot),
+                                       _mm512_loadu_ps(a.inverseLength + i));
+        sum = _mm512_add_ps(sum, _mm512_min_ps(t, one));
+    }
+
+    float total = _mm512_reduce_add_ps(sum);
+    for (; i != size; ++i)
+        total += _relativePosition(a, i, cx, cy, cz);
+    return total;
+}
+
+__attribute__((target("avx512f"))) Point4f _sumDirectionsAndLengthsAVX512(
+    const SegmentBatch& batch)
+{
+    const Arrays a(batch);
+    const size_t size = batch.size();
+    __m512 sums[] = {_mm512_setzero_ps(), _mm512_setzero_ps(),
+                     _mm512_setzero_ps(), _mm512_setzero_ps()};
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        sums[0] = _mm512_add_ps(sums[0], _mm512_loadu_ps(a.ux + i));
+        sums[1] = _mm512_add_ps(sums[1], _mm512_loadu_ps(a.uy + i));
+        sums[2] = _mm512_add_ps(sums[2], _mm512_loadu_ps(a.uz + i));
+        sums[3] = _mm512_add_ps(sums[3], _mm512_loadu_ps(a.length + i));
+    }
+
+    float totals[4];
+    for (int j = 0; j != 4; ++j)
+        totals[j] = _mm512_reduce_add_ps(sums[j]);
+    for (; i != size; ++i)
+    {
+        totals[0] += a.ux[i];
+        totals[1] += a.uy[i];
+        totals[2] += a.uz[i];
+        totals[3] += a.length[i];
+    }
+    return _point4f(totals);
+}
+#endif
+
+struct Kernels
+{
+    float (*sumRelativePositions)(const SegmentBatch&, float, float, float);
+    Point4f (*sumDirectionsAndLengths)(const SegmentBatch&);
+    const char* name;
+};
+
+Kernels _selectKernels()
+{
+    const char* variable = std::getenv("REGIODESICS_SIMD");
+    const std::string requested = variable ? variable : "";
+#ifdef REGIODESICS_X86_SIMD
+    __builtin_cpu_init();
+    if (requested != "scalar" && requested != "avx2" &&
+        __builtin_cpu_supports("avx512f"))
+    {
+        return Kernels{_sumRelativePositionsAVX512,
+                       _sumDirectionsAndLengthsAVX512, "avx512"};
+    }
+    if (requested != "scalar" && __builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("fma"))
+    {
+        return Kernels{_sumRelativePositionsAVX2,
+                       _sumDirectionsAndLengthsAVX2, "avx2"};
+    }
+#endif
+    return Kernels{_sumRelativePositionsScalar, _sumDirectionsAndLengthsScalar,
+                   "scalar"};
+}
+
+const Kernels& _kernels()
+{
+    static const Kernels kernels = _selectKernels();
+    return kernels;
+}
+} // namespace
+
+float relativePosition(const SegmentBatch& batch, const size_t index,
+                       const Point3f& point)
+{
+    return _relativePosition(Arrays(batch), index, point.get<0>(),
+                             point.get<1>(), point.get<2>());
+}
+
+float sumRelativePositions(const SegmentBatch& batch, const Point3f& point)
+{
+    return _kernels().sumRelativePositions(batch, point.get<0>(),
+                                           point.get<1>(), point.get<2>());
+}
+
+Point4f sumDirectionsAndLengths(const SegmentBatch& batch)
+{
+    return _kernels().sumDirectionsAndLengths(batch);
+}
+
+const char* simdInstructionSet()
+{
+    return _kernels().name;
+}
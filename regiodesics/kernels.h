@@ -0,0 +1,91 @@
+#ifndef REGIODESICS_KERNELS_H
+#define REGIODESICS_KERNELS_H
+
+#include "types.h"
+
+#include <algorithm>
+#include <vector>
+
+// Segment stored in the SegmentIndex together with the float quantities
+// needed to evaluate the voxels near it, so they are computed only once.
+struct SegmentRecord
+{
+    SegmentRecord() = default;
+    SegmentRecord(const Segment& segment, unsigned int id);
+
+    Segment segment;
+    Point3f origin;
+    // Unit vector from the first to the second point of the segment.
+    Point3f direction;
+    float length;
+    float inverseLength;
+    unsigned int id;
+};
+
+using SegmentRecords = std::vector<SegmentRecord>;
+
+// Returns the squared distance from the point to the segment of the record.
+inline float squaredDistance(const SegmentRecord& record, const Point3f& point)
+{
+    using namespace boost::geometry;
+    Point3f v = point;
+    subtract_point(v, record.origin);
+    const float t = std::min(record.length,
+                             std::max(0.f, dot_product(record.direction, v)));
+    subtract_point(v, record.direction * t);
+    return dot_product(v, v);
+}
+
+// Structure of arrays with the segments used to evaluate a voxel, each one
+// stored as its origin, unit direction, length and inverse length.
+class SegmentBatch
+{
+public:
+    enum Field
+    {
+        originX,
+        originY,
+        originZ,
+        directionX,
+        directionY,
+        directionZ,
+        length,
+        inverseLength,
+        fieldCount
+    };
+
+    void clear() { _size = 0; }
+    void push_back(const SegmentRecord& record);
+
+    size_t size() const { return _size; }
+    const float* data(const Field field) const
+    {
+        return _fields[field].data();
+    }
+
+private:
+    size_t _size = 0;
+    std::vector<float> _fields[fieldCount];
+};
+
+// The following functions are vectorized with AVX-512 or AVX2 when the CPU
+// supports them, the instruction set being chosen at runtime. The environment
+// variable REGIODESICS_SIMD can be set to "avx2" or "scalar" to restrict the
+// choice.
+
+// Returns the relative position along the given segment of the batch of the
+// projection of the point, clamped to [0, 1].
+float relativePosition(const SegmentBatch& batch, size_t index,
+                       const Point3f& point);
+
+// Returns the sum of relativePosition for all the segments of the batch.
+float sumRelativePositions(const SegmentBatch& batch, const Point3f& point);
+
+// Returns the sum of the unit directions of the segments of the batch in the
+// first three components and the sum of their lengths in the fourth one.
+Point4f sumDirectionsAndLengths(const SegmentBatch& batch);
+
+// Returns the name of the instruction set used by the functions above.
+const char* simdInstructionSet();
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef REGIODESICS_TRAVERSAL_H
+#define REGIODESICS_TRAVERSAL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Box of voxels [begin, end) of a volume.
+struct Tile
+{
+    size_t begin[3];
+    size_t end[3];
+    // True if no voxel of the tile needs to be computed.
+    bool empty;
+};
+
+// Tile extents matched to the storage order of Volume (x fastest), so that
+// each tile row spans whole cache lines.
+const size_t TileWidth = 64;
+const size_t TileHeight = 8;
+const size_t TileDepth = 8;
+
+// Splits the z planes [zBegin, zEnd) of the volume in tiles listed in
+// storage order.
+inline std::vector<Tile> makeTiles(const size_t width, const size_t height,
+                                   const size_t zBegin, const size_t zEnd)
+{
+    std::vector<Tile> tiles;
+    for (size_t z = zBegin; z < zEnd; z += TileDepth)
+        for (size_t y = 0; y < height; y += TileHeight)
+            for (size_t x = 0; x < width; x += TileWidth)
+                tiles.push_back(Tile{{x, y, z},
+                                     {std::min(x + TileWidth, width),
+                                      std::min(y + TileHeight, height),
+                                      std::min(z + TileDepth, zEnd)},
+                                     false});
+    return tiles;
+}
+
+// Splits the volume in tiles listed in storage order.
+inline std::vector<Tile> makeTiles(const size_t width, const size_t height,
+                                   const size_t depth)
+{
+    return makeTiles(width, height, 0, depth);
+}
+
+// Calls functor(x, y, z) for each voxel of the tile in storage order.
+template <typename Functor>
+void forEachVoxel(const Tile& tile, const Functor& functor)
+{
+    for (size_t z = tile.begin[2]; z != tile.end[2]; ++z)
+        for (size_t y = tile.begin[1]; y != tile.end[1]; ++y)
+            for (size_t x = tile.begin[0]; x != tile.end[0]; ++x)
+                functor(x, y, z);
+}
+
+// Calls functor(x, y, z) for each voxel of the tile in boustrophedon order,
+// so that consecutive voxels are always face neighbours.
+template <typename Functor>
+void forEachVoxelBoustrophedon(const Tile& tile, const Functor& functor)
+{
+    const size_t nx = tile.end[0] - tile.begin[0];
+    const size_t ny = tile.end[1] - tile.begin[1];
+    const size_t nz = tile.end[2] - tile.begin[2];
+    size_t row = 0;
+    for (size_t k = 0; k != nz; ++k)
+    {
+        for (size_t jj = 0; jj != ny; ++jj, ++row)
+        {
+            const size_t j = k % 2 == 0 ? jj : ny - 1 - jj;
+            for (size_t ii = 0; ii != nx; ++ii)
+            {
+                const size_t i = row % 2 == 0 ? ii : nx - 1 - ii;
+                functor(tile.begin[0] + i, tile.begin[1] + j,
+                        tile.begin[2] + k);
+            }
+        }
+    }
+}
+
+// Marks as empty the tiles without any voxel for which active(x, y, z) is
+// true.
+template <typename Predicate>
+void classifyTiles(std::vector<Tile>& tiles, const Predicate& active)
+{
+#pragma omp parallel for schedule(dynamic, 16)
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        Tile& tile = tiles[i];
+        tile.empty = true;
+        for (size_t z = tile.begin[2]; z != tile.end[2] && tile.empty; ++z)
+            for (size_t y = tile.begin[1]; y != tile.end[1] && tile.empty; ++y)
+                for (size_t x = tile.begin[0]; x != tile.end[0]; ++x)
+                    if (active(x, y, z))
+                    {
+                        tile.empty = false;
+                        break;
+                    }
+    }
+}
+
+// Calls functor(tile) for every tile on all the OpenMP threads.
+// Each thread starts with a contiguous range of tiles, which it consumes from
+// the front. Threads that run out of work steal the back half of the range
+// of another thread, so the load is balanced while consecutive tiles, which
+// are contiguous in memory, tend to stay on the same thread.
+template <typename Functor>
+void parallelForEachTile(const std::vector<Tile>& tiles,
+                         const Functor& functor)
+{
+    if (tiles.size() >= (uint64_t(1) << 32))
+        throw std::runtime_error("Too many tiles");
+
+    // Each range is packed as (begin << 32 | end) so it can be popped from
+    // the front by its owner and split by thieves with a single CAS.
+    const auto pack = [](const uint64_t begin, const uint64_t end) {
+        return begin << 32 | end;
+    };
+#ifdef _OPENMP
+    const int maxThreads = omp_get_max_threads();
+#else
+    const int maxThreads = 1;
+#endif
+    std::unique_ptr<std::atomic<uint64_t>[]> ranges(
+        new std::atomic<uint64_t>[maxThreads]);
+
+#pragma omp parallel
+    {
+#ifdef _OPENMP
+        const uint64_t threads = omp_get_num_threads();
+        const uint64_t id = omp_get_thread_num();
+#else
+        const uint64_t threads = 1;
+        const uint64_t id = 0;
+#endif
+        const uint64_t count = tiles.size();
+        ranges[id].store(
+            pack(count * id / threads, count * (id + 1) / threads));
+#pragma omp barrier
+
+        std::atomic<uint64_t>& own = ranges[id];
+        while (true)
+        {
+            uint64_t range = own.load();
+            uint64_t begin = range >> 32;
+            const uint64_t end = range & 0xffffffff;
+            if (begin < end)
+            {
+                if (own.compare_exchange_weak(range, pack(begin + 1, end)))
+                    functor(tiles[begin]);
+                continue;
+            }
+
+            bool stolen = false;
+            for (uint64_t i = 1; i < threads && !stolen; ++i)
+            {
+                std::atomic<uint64_t>& victim = ranges[(id + i) % threads];
+                uint64_t other = victim.load();
+                while (true)
+                {
+                    begin = other >> 32;
+                    const uint64_t last = other & 0xffffffff;
+                    if (begin >= last)
+                        break;
+                    const uint64_t half = last - (last - begin + 1) / 2;
+                    if (victim.compare_exchange_weak(other, pack(begin, half)))
+                    {
+                        own.store(pack(half, last));
+                        stolen = true;
+                        break;
+                    }
+                }
+            }
+            if (!stolen)
+                break;
+        }
+    }
+}
+
+#endif
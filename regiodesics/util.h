@@ -7,6 +7,7 @@
 #include <osg/Geode>
 #include <osg/Geometry>
 #include <osg/Node>
+#include <osg/Quat>
 
 #include <iostream>
 
@@ -26,6 +27,99 @@ istream& operator>>(istream& in, std::pair<size_t, size_t>& pair)
 }
 }
 
+using Point4c = PointTN<char, 4>;
+
+// Returns functor(volume) for the label volume loaded with the type of its
+// file, so that the labels are never converted.
+template <typename Functor>
+auto visitLabelVolume(const std::string& filename, const Functor& functor)
+    -> decltype(functor(std::declval<Volume<unsigned int>&>()))
+{
+    const auto type = readVolumeType(filename);
+    const auto loading = VolumeLoading::map;
+    if (type == typeName<unsigned char>())
+    {
+        Volume<unsigned char> volume(filename, loading);
+        return functor(volume);
+    }
+    if (type == typeName<unsigned short>())
+    {
+        Volume<unsigned short> volume(filename, loading);
+        return functor(volume);
+    }
+    if (type == typeName<unsigned int>())
+    {
+        Volume<unsigned int> volume(filename, loading);
+        return functor(volume);
+    }
+    if (type == typeName<int>())
+    {
+        Volume<int> volume(filename, loading);
+        return functor(volume);
+    }
+    throw std::runtime_error("Unsupported label type " + type + " in " +
+                             filename);
+}
+
+Point4c nullQuaternion()
+{
+    Point4c p;
+    p.set<0>(0);
+    p.set<1>(0);
+    p.set<2>(0);
+    p.set<3>(0);
+    return p;
+}
+
+Point4c directionToQuaternion(const Point3f& direction,
+                              const Volume<char>& shell)
+{
+    // This code ignores the possible mirrorings being applied by
+    // by the NRRD space directions
+    const auto vx = shell.volumeAxis(0);
+    const auto vy = shell.volumeAxis(1);
+    const auto vz = shell.volumeAxis(2);
+    const auto orientation = vx * direction.get<0>() +
+                             vy * direction.get<1>() + vz * direction.get<2>();
+    osg::Vec3 v(orientation.get<0>(), orientation.get<1>(),
+                orientation.get<2>());
+    v.normalize();
+
+    osg::Vec3 up(0, 1, 0);
+    osg::Quat q(std::acos(up * v), up ^ v);
+    q /= q.length();
+    // According to nrrd specs a quaternion is w x y z
+    Point4c p;
+    p.set<0>(static_cast<int8_t>(std::round(q[3] * 127)));
+    p.set<1>(static_cast<int8_t>(std::round(q[0] * 127)));
+    p.set<2>(static_cast<int8_t>(std::round(q[1] * 127)));
+    p.set<3>(static_cast<int8_t>(std::round(q[2] * 127)));
+    return p;
+}
+
+// Converts direction vectors given for the z planes starting at z of the
+// shell.
+Volume<Point4c> toQuaternions(const Volume<Point3f>& direction_vectors,
+                              const Volume<char>& shell, const size_t z = 0)
+{
+    Volume<Point4c> output(direction_vectors.width(),
+                           direction_vectors.height(),
+                           direction_vectors.depth(),
+                           direction_vectors.metadata());
+    // Overriding the original metadata to provide what the consumer tools
+    // expect
+    auto& metadata = output.metadata();
+    metadata["kinds"] = "quaternion domain domain domain";
+
+    output.apply([&direction_vectors, &shell, z](size_t i, size_t j, size_t k,
+                                                 const Point4c&) {
+        if (shell(i, j, k + z) == 0)
+            return nullQuaternion();
+        return directionToQuaternion(direction_vectors(i, j, k), shell);
+    });
+    return output;
+}
+
 std::vector<float> computeSplitPoints(const std::vector<float>& thicknesses)
 {
     std::vector<float> splitPoints;